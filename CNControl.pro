@@ -4,7 +4,7 @@
 #
 #-------------------------------------------------
 
-QT       += core gui serialport svg
+QT       += core gui serialport svg concurrent
 
 greaterThan(QT_MAJOR_VERSION, 4): QT += widgets
 
@@ -30,6 +30,16 @@ SOURCES += \
     aaaa_idees.cpp \
     configuration.cpp \
     gcode.cpp \
+    gcodecache.cpp \
+    gcodeestimator.cpp \
+    gcodeloader.cpp \
+    gcodereorderer.cpp \
+    gcodeminimizer.cpp \
+    gcodeprogramsource.cpp \
+    gcodesimplifier.cpp \
+    gcodesource.cpp \
+    gcodestreamer.cpp \
+    gcodestreamring.cpp \
     gcodehighlighter.cpp \
     machine.cpp \
     machineGrbl.cpp \
@@ -38,7 +48,11 @@ SOURCES += \
     operation.cpp \
     port.cpp \
     codeeditor.cpp \
+    compacttoolpath.cpp \
     portSerial.cpp \
+    runtimepredictor.cpp \
+    toolpathbuffer.cpp \
+    toolpathstats.cpp \
     visualizer.cpp
 
 HEADERS += \
@@ -46,6 +60,17 @@ HEADERS += \
     QFocusLineEdit \
     configuration.h \
     gcode.h \
+    gcodecache.h \
+    gcodeestimator.h \
+    gcodeloader.h \
+    gcodereorderer.h \
+    gcodeminimizer.h \
+    gcodeprogramsource.h \
+    gcodesimplifier.h \
+    gcodesource.h \
+    gcodestreamer.h \
+    gcodestreamring.h \
+    gcodetokenizer.h \
     gcodehighlighter.h \
     grbl.h \
     grbl_config.h \
@@ -56,8 +81,12 @@ HEADERS += \
     bits.h \
     port.h \
     codeeditor.h \
+    compacttoolpath.h \
     portSerial.h \
+    runtimepredictor.h \
     singletonFactory.h \
+    toolpathbuffer.h \
+    toolpathstats.h \
     visualizer.h
 
 FORMS += \
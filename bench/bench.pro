@@ -0,0 +1,41 @@
+#-------------------------------------------------
+#
+# Benchmark of the parser and tool path, over the Exemples files.
+# Build it on its own : qmake bench/bench.pro && make
+#
+#-------------------------------------------------
+
+QT       += core gui concurrent
+
+TARGET = cncbench
+TEMPLATE = app
+
+CONFIG += c++11 console
+CONFIG -= app_bundle
+
+DEFINES += QT_DEPRECATED_WARNINGS
+
+# Files benched when none is given
+DEFINES += EXEMPLES_DIR=\\\"$$PWD/../Exemples\\\"
+
+INCLUDEPATH += ..
+
+SOURCES += \
+    main.cpp \
+    ../gcode.cpp \
+    ../gcodesource.cpp \
+    ../compacttoolpath.cpp \
+    ../toolpathbuffer.cpp \
+    ../toolpathstats.cpp
+
+HEADERS += \
+    ../bits.h \
+    ../gcode.h \
+    ../gcodesource.h \
+    ../gcodetokenizer.h \
+    ../compacttoolpath.h \
+    ../toolpathbuffer.h \
+    ../toolpathstats.h
+
+# Peak working set
+win32: LIBS += -lpsapi
@@ -0,0 +1,459 @@
+#include <QCoreApplication>
+#include <QCommandLineParser>
+#include <QDebug>
+#include <QDir>
+#include <QElapsedTimer>
+#include <QFileInfo>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QMap>
+#include <QSaveFile>
+#include <QTextStream>
+#include <QThread>
+#include <atomic>
+#include <cstdlib>
+#include <functional>
+#include <new>
+
+#include "gcode.h"
+#include "gcodesource.h"
+
+#if defined(Q_OS_WIN)
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+// A stage is run again until a sample lasts this long, for short files
+#define MIN_SAMPLE_NS 20000000
+
+// Chord error of the arcs cut in segments when points are extracted (mm)
+#define EXTRACT_TOLERANCE 0.01
+
+// Grbl default resolution ($100, $101, $102), for the compact tool path
+#define DEFAULT_STEPS_PER_MILLIMETER 250.0
+
+//----------------------------------------------------------------------------------------------------
+// Allocations, from all threads
+
+static std::atomic<quint64> allocations(0);
+
+#if defined(__GLIBC__)
+// Qt containers allocate with malloc, not new : malloc is replaced over the glibc one
+#define ALLOCATOR "malloc"
+
+extern "C" {
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t count, size_t size);
+void *__libc_realloc(void *pointer, size_t size);
+
+void *malloc(size_t size) noexcept
+{
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size) noexcept
+{
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    return __libc_calloc(count, size);
+}
+
+void *realloc(void *pointer, size_t size) noexcept
+{
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    return __libc_realloc(pointer, size);
+}
+}
+#else
+// Only new is seen : Qt containers are not counted
+#define ALLOCATOR "operator new"
+
+void *operator new(size_t size)
+{
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void *pointer = std::malloc(size ? size : 1)) return pointer;
+    throw std::bad_alloc();
+}
+
+void operator delete(void *pointer) noexcept
+{
+    std::free(pointer);
+}
+#endif
+
+// Peak resident memory of the process, in kB
+static qint64 peakRss()
+{
+#if defined(Q_OS_WIN)
+    PROCESS_MEMORY_COUNTERS counters;
+    if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) return -1;
+    return qint64(counters.PeakWorkingSetSize / 1024);
+#else
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage)) return -1;
+#if defined(Q_OS_MACOS)
+    return qint64(usage.ru_maxrss / 1024);  // Bytes on macOS
+#else
+    return qint64(usage.ru_maxrss);
+#endif
+#endif
+}
+
+//----------------------------------------------------------------------------------------------------
+
+static bool verbose = false;
+
+static void messageHandler(QtMsgType type, const QMessageLogContext &, const QString &message)
+{
+    // The parser logs each parse
+    if ((type == QtDebugMsg) && !verbose) return;
+    QTextStream(stderr) << message << "\n";
+}
+
+struct StageResult
+{
+    QString name;
+    int items;              // Points, arcs... made or read by the stage
+    double seconds;         // Best run
+    quint64 allocations;    // Of one run
+};
+
+// A stage over all the files it was run on
+struct StageTotal
+{
+    StageResult result;
+    qint64 bytes;
+    qint64 lines;
+};
+
+// Best time of repeats runs, with the allocations of the first one
+static StageResult runStage(const QString &name, int repeats, const std::function<int()> &stage)
+{
+    StageResult result;
+    result.name = name;
+
+    quint64 before = allocations.load();
+    result.items = stage();
+    result.allocations = allocations.load() - before;
+    result.seconds = 0;
+
+    for (int run = 0; run < repeats; run++)
+    {
+        QElapsedTimer timer;
+        int loops = 0;
+        timer.start();
+        do
+        {
+            stage();
+            loops++;
+        }
+        while (timer.nsecsElapsed() < MIN_SAMPLE_NS);
+
+        double seconds = double(timer.nsecsElapsed()) * 1e-9 / loops;
+        if ((run == 0) || (seconds < result.seconds)) result.seconds = seconds;
+    }
+    return result;
+}
+
+static QJsonObject stageJson(const StageResult &stage, qint64 bytes, qint64 lines)
+{
+    QJsonObject json;
+    json["items"] = stage.items;
+    json["seconds"] = stage.seconds;
+    json["mbPerSecond"] = stage.seconds > 0 ? double(bytes) / 1e6 / stage.seconds : 0.0;
+    json["linesPerSecond"] = stage.seconds > 0 ? double(lines) / stage.seconds : 0.0;
+    json["itemsPerSecond"] = stage.seconds > 0 ? double(stage.items) / stage.seconds : 0.0;
+    json["allocationsPerLine"] = lines > 0 ? double(stage.allocations) / double(lines) : 0.0;
+    return json;
+}
+
+// What mc_arc needs to draw again an arc of a tool path
+struct ArcInput
+{
+    QVector3D target;
+    QVector3D position;
+    QVector3D offset;
+    double radius;
+    int motion;
+    int line;
+};
+
+static QVector<ArcInput> arcInputs(const GCode &gcode)
+{
+    QVector<ArcInput> inputs;
+    const ToolpathBuffer &points = gcode.getPoints();
+
+    for (const ToolpathArc &arc : points.arcs())
+    {
+        if (arc.point < 1) continue;
+
+        ArcInput input;
+        input.target = points.coords(arc.point);
+        input.position = points.coords(arc.point - 1);
+        input.offset = QVector3D(arc.centerX - input.position.x(), arc.centerY - input.position.y(), 0);
+        input.radius = double(arc.radius);
+        input.motion = points.motion(arc.point);
+        input.line = points.line(arc.point);
+        inputs.append(input);
+    }
+    return inputs;
+}
+
+// Box and statistics of all points, block by block
+static int toolpathStats(const GCode &gcode, ToolpathStats &stats)
+{
+    stats.clear();
+    ToolpathReader reader = gcode.getReader();
+    while (reader.next())
+        stats.add(reader.points(), reader.firstPoint(), gcode.getFeeds());
+    return stats.getPointCount();
+}
+
+// Points as the visualizer draws them : arcs in segments
+static int extractPoints(const GCode &gcode, QVector<QVector3D> &extracted)
+{
+    extracted.clear();
+    extracted.reserve(gcode.getPointCount());
+
+    ToolpathReader reader = gcode.getReader();
+    while (reader.next())
+    {
+        const ToolpathBuffer &points = reader.points();
+        // Arcs give the index of their point in the block, as in the visualizer
+        Span<ToolpathArc> arcs = points.arcs();
+        int arc = 0;
+
+        for (int i = 0; i < points.size(); i++)
+        {
+            if ((arc < arcs.size()) && (arcs[arc].point == i))
+            {
+                float startZ = extracted.isEmpty() ? 0 : extracted.last().z();
+                arcs[arc].tessellate(arcs[arc].segments(EXTRACT_TOLERANCE), startZ, extracted);
+                arc++;
+            }
+            extracted.append(points.coords(i));
+        }
+    }
+    return extracted.size();
+}
+
+static QStringList benchFiles(const QStringList &paths)
+{
+    QStringList files;
+    for (const QString &path : paths)
+    {
+        QFileInfo info(path);
+        if (info.isDir())
+        {
+            QDir dir(path);
+            for (const QString &name : dir.entryList(QStringList() << "*.gcode" << "*.nc" << "*.ngc", QDir::Files, QDir::Name))
+                files.append(dir.filePath(name));
+        }
+        else if (info.isFile())
+            files.append(path);
+        else
+            qWarning() << "bench: no file" << path;
+    }
+    return files;
+}
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+    QCoreApplication::setApplicationName("cncbench");
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription("Parser and tool path benchmark");
+    parser.addHelpOption();
+    parser.addPositionalArgument("paths", "G-code files or directories (Exemples by default)", "[paths...]");
+
+    QCommandLineOption outputOption(QStringList() << "o" << "output", "JSON report file.", "file", "bench.json");
+    QCommandLineOption repeatOption(QStringList() << "r" << "repeat", "Runs of each stage, the best is kept.", "count", "5");
+    QCommandLineOption stepsOption(QStringList() << "s" << "steps", "Steps per millimeter of the compact tool path.",
+                                   "steps", QString::number(DEFAULT_STEPS_PER_MILLIMETER));
+    QCommandLineOption verboseOption(QStringList() << "v" << "verbose", "Show the parser logs.");
+    parser.addOption(outputOption);
+    parser.addOption(repeatOption);
+    parser.addOption(stepsOption);
+    parser.addOption(verboseOption);
+    parser.process(app);
+
+    verbose = parser.isSet(verboseOption);
+    qInstallMessageHandler(messageHandler);
+
+    int repeats = qMax(1, parser.value(repeatOption).toInt());
+    float steps = parser.value(stepsOption).toFloat();
+    if (steps <= 0) steps = float(DEFAULT_STEPS_PER_MILLIMETER);
+
+    QStringList paths = parser.positionalArguments();
+    if (paths.isEmpty()) paths << EXEMPLES_DIR;
+
+    QStringList files = benchFiles(paths);
+    if (files.isEmpty())
+    {
+        qWarning() << "bench: nothing to bench";
+        return 1;
+    }
+
+    QTextStream out(stdout);
+    out << QString("%1 %2 %3 %4 %5 %6 %7\n")
+           .arg("file / stage", -28).arg("ms", 10).arg("MB/s", 9).arg("Mlines/s", 9)
+           .arg("Mitems/s", 9).arg("alloc/line", 11).arg("peak kB", 9);
+
+    QJsonArray filesJson;
+    QMap<QString, StageTotal> totals;
+    QStringList stageOrder;
+    qint64 totalBytes = 0;
+    qint64 totalLines = 0;
+
+    for (const QString &fileName : files)
+    {
+        GCodeSource source;
+        if (!source.open(fileName))
+        {
+            qWarning() << "bench: can't open" << fileName;
+            continue;
+        }
+
+        qint64 bytes = source.size();
+        int lines = source.lineCount();
+        totalBytes += bytes;
+        totalLines += lines;
+
+        GCode gcode;
+        GCode compactGcode;
+        compactGcode.setCompact(true, QVector3D(steps, steps, steps));
+        QVector<StageResult> stages;
+
+        stages << runStage("parse", repeats, [&]() {
+            gcode.parse(source);
+            return gcode.getPointCount();
+        });
+
+        stages << runStage("parseCompact", repeats, [&]() {
+            compactGcode.parse(source);
+            return compactGcode.getPointCount();
+        });
+
+        // Arcs of the program drawn again, when there are some
+        QVector<ArcInput> arcs = arcInputs(gcode);
+        ToolpathBuffer arcPoints;
+        if (!arcs.isEmpty())
+            stages << runStage("mc_arc", repeats, [&]() {
+                arcPoints.clear();
+                for (const ArcInput &arc : arcs)
+                {
+                    QVector3D target = arc.target;
+                    QVector3D position = arc.position;
+                    QVector3D offset = arc.offset;
+                    gcode.mc_arc(arcPoints, target, position, offset, arc.radius, arc.motion, arc.line);
+                }
+                return arcs.size();
+            });
+
+        ToolpathStats stats;
+        stages << runStage("stats", repeats, [&]() {
+            return toolpathStats(gcode, stats);
+        });
+
+        QVector<QVector3D> extracted;
+        stages << runStage("points", repeats, [&]() {
+            return extractPoints(gcode, extracted);
+        });
+
+        stages << runStage("pointsCompact", repeats, [&]() {
+            return extractPoints(compactGcode, extracted);
+        });
+
+        qint64 peak = peakRss();
+
+        QJsonObject fileJson;
+        QJsonObject stagesJson;
+        fileJson["file"] = QFileInfo(fileName).fileName();
+        fileJson["bytes"] = double(bytes);
+        fileJson["lines"] = lines;
+        fileJson["points"] = gcode.getPointCount();
+        fileJson["arcs"] = arcs.size();
+        fileJson["peakRssKb"] = double(peak);
+
+        out << QString("%1 %2 bytes, %3 lines, %4 points, %5 arcs\n")
+               .arg(QFileInfo(fileName).fileName()).arg(bytes).arg(lines).arg(gcode.getPointCount()).arg(arcs.size());
+
+        for (const StageResult &stage : stages)
+        {
+            QJsonObject json = stageJson(stage, bytes, lines);
+            stagesJson[stage.name] = json;
+
+            out << QString("  %1 %2 %3 %4 %5 %6 %7\n")
+                   .arg(stage.name, -26)
+                   .arg(stage.seconds * 1e3, 10, 'f', 3)
+                   .arg(json["mbPerSecond"].toDouble(), 9, 'f', 1)
+                   .arg(json["linesPerSecond"].toDouble() / 1e6, 9, 'f', 2)
+                   .arg(json["itemsPerSecond"].toDouble() / 1e6, 9, 'f', 2)
+                   .arg(json["allocationsPerLine"].toDouble(), 11, 'f', 3)
+                   .arg(peak, 9);
+
+            if (!totals.contains(stage.name))
+            {
+                stageOrder << stage.name;
+                totals[stage.name] = StageTotal{StageResult{stage.name, 0, 0, 0}, 0, 0};
+            }
+            StageTotal &total = totals[stage.name];
+            total.result.items += stage.items;
+            total.result.seconds += stage.seconds;
+            total.result.allocations += stage.allocations;
+            total.bytes += bytes;
+            total.lines += lines;
+        }
+        out.flush();
+
+        fileJson["stages"] = stagesJson;
+        filesJson.append(fileJson);
+    }
+
+    // Whole corpus, as if it was one file
+    QJsonObject totalJson;
+    out << QString("total %1 bytes, %2 lines\n").arg(totalBytes).arg(totalLines);
+    for (const QString &name : stageOrder)
+    {
+        const StageTotal &total = totals[name];
+        const StageResult &stage = total.result;
+        QJsonObject json = stageJson(stage, total.bytes, total.lines);
+        totalJson[name] = json;
+
+        out << QString("  %1 %2 %3 %4 %5 %6\n")
+               .arg(name, -26)
+               .arg(stage.seconds * 1e3, 10, 'f', 3)
+               .arg(json["mbPerSecond"].toDouble(), 9, 'f', 1)
+               .arg(json["linesPerSecond"].toDouble() / 1e6, 9, 'f', 2)
+               .arg(json["itemsPerSecond"].toDouble() / 1e6, 9, 'f', 2)
+               .arg(json["allocationsPerLine"].toDouble(), 11, 'f', 3);
+    }
+    out << QString("peak RSS %1 kB\n").arg(peakRss());
+
+    QJsonObject report;
+    report["parserVersion"] = GCODE_PARSER_VERSION;
+    report["qtVersion"] = QString(qVersion());
+    report["threads"] = QThread::idealThreadCount();
+    report["repeats"] = repeats;
+    report["stepsPerMillimeter"] = double(steps);
+    report["allocator"] = QString(ALLOCATOR);
+    report["bytes"] = double(totalBytes);
+    report["lines"] = double(totalLines);
+    report["peakRssKb"] = double(peakRss());
+    report["files"] = filesJson;
+    report["total"] = totalJson;
+
+    QSaveFile file(parser.value(outputOption));
+    if (!file.open(QIODevice::WriteOnly) ||
+        (file.write(QJsonDocument(report).toJson()) < 0) || !file.commit())
+    {
+        qWarning() << "bench: can't write" << parser.value(outputOption);
+        return 1;
+    }
+    out << "report written to " << file.fileName() << "\n";
+    return 0;
+}
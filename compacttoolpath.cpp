@@ -0,0 +1,280 @@
+#include "compacttoolpath.h"
+
+#include <cmath>
+#include <algorithm>
+
+// Grbl default resolution ($100, $101, $102)
+#define DEFAULT_STEPS_PER_MILLIMETER 250.0f
+
+// Largest encoded point : 3 coordinates of 5 bytes and a line/motion of 5 bytes
+#define MAX_POINT_BYTES 20
+
+static inline quint32 zigzag(qint32 value) { return (quint32(value) << 1) ^ quint32(value >> 31); }
+static inline qint32 unzigzag(quint32 value) { return qint32(value >> 1) ^ -qint32(value & 1); }
+
+static inline uchar *writeVarint(uchar *p, quint32 value)
+{
+    while (value >= 0x80)
+    {
+        *p++ = uchar(value | 0x80);
+        value >>= 7;
+    }
+    *p++ = uchar(value);
+    return p;
+}
+
+static inline const uchar *readVarint(const uchar *p, quint32 &value)
+{
+    quint32 result = 0;
+    int shift = 0;
+    while (*p & 0x80)
+    {
+        result |= quint32(*p++ & 0x7F) << shift;
+        shift += 7;
+    }
+    value = result | (quint32(*p++) << shift);
+    return p;
+}
+
+CompactToolpath::CompactToolpath()
+{
+    count = 0;
+    setResolution(QVector3D(DEFAULT_STEPS_PER_MILLIMETER, DEFAULT_STEPS_PER_MILLIMETER, DEFAULT_STEPS_PER_MILLIMETER));
+}
+
+void CompactToolpath::setResolution(const QVector3D &stepsPerMillimeter)
+{
+    // Content is lost : the steps don't mean the same any more
+    clear();
+
+    for (int axis = 0; axis < 3; axis++)
+    {
+        float steps = stepsPerMillimeter[axis];
+        this->stepsPerMillimeter[axis] = (steps > 0) ? steps : DEFAULT_STEPS_PER_MILLIMETER;
+        millimetersPerStep[axis] = 1.0f / this->stepsPerMillimeter[axis];
+    }
+}
+
+void CompactToolpath::clear()
+{
+    blocks.clear();
+    bytes.clear();
+    arcs.clear();
+    count = 0;
+}
+
+void CompactToolpath::squeeze()
+{
+    blocks.squeeze();
+    bytes.squeeze();
+    arcs.squeeze();
+}
+
+qint64 CompactToolpath::memorySize() const
+{
+    return qint64(blocks.capacity()) * qint64(sizeof(Block)) + bytes.capacity() +
+           qint64(arcs.capacity()) * qint64(sizeof(ToolpathArc));
+}
+
+void CompactToolpath::append(const ToolpathBuffer &points)
+{
+    Span<float> x = points.x();
+    Span<float> y = points.y();
+    Span<float> z = points.z();
+    Span<quint8> motions = points.motions();
+    Span<qint32> lines = points.lines();
+
+    double steps[3] = { double(stepsPerMillimeter.x()), double(stepsPerMillimeter.y()), double(stepsPerMillimeter.z()) };
+    uchar encoded[BlockSize * MAX_POINT_BYTES];
+
+    blocks.reserve(blocks.size() + points.size() / BlockSize + 1);
+
+    for (int start = 0; start < points.size(); start += BlockSize)
+    {
+        int end = qMin(start + BlockSize, points.size());
+
+        Block block;
+        block.x = qint32(lround(double(x[start]) * steps[0]));
+        block.y = qint32(lround(double(y[start]) * steps[1]));
+        block.z = qint32(lround(double(z[start]) * steps[2]));
+        block.line = lines[start];
+        block.firstPoint = count + start;
+        block.offset = quint32(bytes.size());
+        blocks.append(block);
+
+        qint32 lastX = block.x, lastY = block.y, lastZ = block.z, lastLine = block.line;
+        uchar *p = encoded;
+
+        for (int i = start; i < end; i++)
+        {
+            qint32 stepX = qint32(lround(double(x[i]) * steps[0]));
+            qint32 stepY = qint32(lround(double(y[i]) * steps[1]));
+            qint32 stepZ = qint32(lround(double(z[i]) * steps[2]));
+
+            p = writeVarint(p, zigzag(stepX - lastX));
+            p = writeVarint(p, zigzag(stepY - lastY));
+            p = writeVarint(p, zigzag(stepZ - lastZ));
+
+            // Points come in line order, motion fits in 3 bits
+            p = writeVarint(p, (quint32(lines[i] - lastLine) << 3) | motions[i]);
+
+            lastX = stepX;
+            lastY = stepY;
+            lastZ = stepZ;
+            lastLine = lines[i];
+        }
+
+        bytes.append(reinterpret_cast<const char *>(encoded), int(p - encoded));
+    }
+
+    for (ToolpathArc arc : points.arcs())
+    {
+        arc.point += count;
+        arcs.append(arc);
+    }
+
+    count += points.size();
+}
+
+void CompactToolpath::append(const CompactToolpath &other)
+{
+    quint32 offset = quint32(bytes.size());
+
+    blocks.reserve(blocks.size() + other.blocks.size());
+    for (Block block : other.blocks)
+    {
+        block.firstPoint += count;
+        block.offset += offset;
+        blocks.append(block);
+    }
+
+    bytes.append(other.bytes);
+
+    arcs.reserve(arcs.size() + other.arcs.size());
+    for (ToolpathArc arc : other.arcs)
+    {
+        arc.point += count;
+        arcs.append(arc);
+    }
+
+    count += other.count;
+}
+
+int CompactToolpath::blockOf(int point) const
+{
+    // Last block starting at or before the point
+    int low = 0, high = blocks.size() - 1;
+    while (low < high)
+    {
+        int middle = (low + high + 1) / 2;
+        if (blocks.at(middle).firstPoint <= point)
+            low = middle;
+        else
+            high = middle - 1;
+    }
+    return low;
+}
+
+int CompactToolpath::firstPointOfLine(int line) const
+{
+    // Last block starting before the line, the line starts in it or at the next block
+    int low = -1, high = blocks.size() - 1;
+    while (low < high)
+    {
+        int middle = (low + high + 1) / 2;
+        if (blocks.at(middle).line < line)
+            low = middle;
+        else
+            high = middle - 1;
+    }
+    if (low < 0) return 0;
+
+    ToolpathBuffer points;
+    decodeBlock(low, points);
+
+    Span<qint32> lines = points.lines();
+    const qint32 *found = std::lower_bound(lines.begin(), lines.end(), line);
+    if (found != lines.end())
+        return blocks.at(low).firstPoint + int(found - lines.begin());
+
+    return (low + 1 < blocks.size()) ? blocks.at(low + 1).firstPoint : count;
+}
+
+int CompactToolpath::lineOf(int point) const
+{
+    int block = blockOf(point);
+
+    ToolpathBuffer points;
+    decodeBlock(block, points);
+    return points.line(point - blocks.at(block).firstPoint);
+}
+
+QVector3D CompactToolpath::coords(int point) const
+{
+    int block = blockOf(point);
+
+    ToolpathBuffer points;
+    decodeBlock(block, points);
+    return points.coords(point - blocks.at(block).firstPoint);
+}
+
+void CompactToolpath::decodeBlock(int index, ToolpathBuffer &points) const
+{
+    const Block &block = blocks.at(index);
+    int size = ((index + 1 < blocks.size()) ? blocks.at(index + 1).firstPoint : count) - block.firstPoint;
+
+    points.clear();
+    points.reserve(size);
+
+    const uchar *p = reinterpret_cast<const uchar *>(bytes.constData()) + block.offset;
+    qint32 stepX = block.x, stepY = block.y, stepZ = block.z, line = block.line;
+    quint32 value;
+
+    // First arc of the block
+    const ToolpathArc *arc = std::lower_bound(arcs.constBegin(), arcs.constEnd(), block.firstPoint,
+                                              [](const ToolpathArc &arc, int point) { return arc.point < point; });
+
+    for (int i = 0; i < size; i++)
+    {
+        p = readVarint(p, value); stepX += unzigzag(value);
+        p = readVarint(p, value); stepY += unzigzag(value);
+        p = readVarint(p, value); stepZ += unzigzag(value);
+        p = readVarint(p, value); line += qint32(value >> 3);
+
+        QVector3D coords(float(stepX) * millimetersPerStep.x(),
+                         float(stepY) * millimetersPerStep.y(),
+                         float(stepZ) * millimetersPerStep.z());
+
+        if ((arc != arcs.constEnd()) && (arc->point == block.firstPoint + i))
+            points.appendArc(coords, int(value & 7), line, *arc++);
+        else
+            points.append(coords, int(value & 7), line);
+    }
+}
+
+ToolpathReader::ToolpathReader(const ToolpathBuffer &points, const CompactToolpath &compact, bool isCompact) :
+    buffer(points), compact(compact), isCompact(isCompact)
+{
+    current = &decoded;
+    block = -1;
+    first = 0;
+}
+
+bool ToolpathReader::next()
+{
+    block++;
+
+    if (!isCompact)
+    {
+        current = &buffer;
+        first = 0;
+        return block == 0;
+    }
+
+    if (block >= compact.blockCount()) return false;
+
+    compact.decodeBlock(block, decoded);
+    current = &decoded;
+    first = compact.blockFirstPoint(block);
+    return true;
+}
@@ -0,0 +1,94 @@
+#ifndef COMPACTTOOLPATH_H
+#define COMPACTTOOLPATH_H
+
+#include <QByteArray>
+#include <QVector>
+#include <QVector3D>
+#include "toolpathbuffer.h"
+
+// Tool path stored for very large jobs.
+// Coordinates are quantized to the machine resolution (one step), and kept
+// as zigzag varint deltas from the previous point. Points are grouped in
+// blocks starting from absolute values, so any block can be decoded alone.
+// A point costs about 4 to 8 bytes instead of 17. Arcs are kept as they are.
+
+class CompactToolpath
+{
+public:
+    enum { BlockSize = 256 };
+
+    CompactToolpath();
+
+    void setResolution(const QVector3D &stepsPerMillimeter);
+    QVector3D getResolution() const { return stepsPerMillimeter; }
+
+    void clear();
+    void squeeze();
+
+    int size() const { return count; }
+    bool isEmpty() const { return !count; }
+    qint64 memorySize() const;
+
+    // Encode points in new blocks
+    void append(const ToolpathBuffer &points);
+    // Blocks of other are moved as is, resolution must be the same
+    void append(const CompactToolpath &other);
+
+    int blockCount() const { return blocks.size(); }
+    int blockFirstPoint(int block) const { return blocks.at(block).firstPoint; }
+    int blockOf(int point) const;
+
+    // First point of line or after it, line and coordinates of a point : a block is decoded
+    int firstPointOfLine(int line) const;
+    int lineOf(int point) const;
+    QVector3D coords(int point) const;
+
+    // Decode one block, points replaces the content of the buffer
+    void decodeBlock(int block, ToolpathBuffer &points) const;
+
+private:
+    friend class GCodeCache;
+
+    struct Block
+    {
+        qint32 x, y, z;     // Steps of the first point
+        qint32 line;        // Line of the first point
+        qint32 firstPoint;
+        quint32 offset;     // Start of the block in bytes
+    };
+
+    QVector3D stepsPerMillimeter;
+    QVector3D millimetersPerStep;
+
+    QVector<Block> blocks;
+    QByteArray bytes;
+    QVector<ToolpathArc> arcs;
+    int count;
+};
+
+// Reads the points of a GCode by blocks, whatever the storage.
+// Without compact storage, there is one block with all points.
+
+class ToolpathReader
+{
+public:
+    ToolpathReader(const ToolpathBuffer &points, const CompactToolpath &compact, bool isCompact);
+
+    // Go to next block, returns false after the last one
+    bool next();
+
+    const ToolpathBuffer &points() const { return *current; }
+    int firstPoint() const { return first; }
+
+private:
+    const ToolpathBuffer &buffer;
+    const CompactToolpath &compact;
+    bool isCompact;
+
+    ToolpathBuffer decoded;
+    const ToolpathBuffer *current;
+    int block;
+    int first;
+};
+
+#endif // COMPACTTOOLPATH_H
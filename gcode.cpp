@@ -1,293 +1,808 @@
 #include "gcode.h"
 
 #include <QDebug>
+#include <QThread>
+#include <QtConcurrent>
+#include <algorithm>
 
 GCode::GCode()
 {
+    source = nullptr;
+    lineCount = 0;
+    compact = false;
 }
 
-#include <cmath>
-double hypot_f(double x, double y) { return double(sqrt(x*x + y*y)); };
-#define MAX_INT_DIGITS 8
+void GCode::setCompact(bool compact, const QVector3D &stepsPerMillimeter)
+{
+    this->compact = compact;
+    compactPoints.setResolution(stepsPerMillimeter);
+    points.clear();
+}
 
-bool GCode::parse(QString &gcode)
+GCode::ModalState::ModalState()
 {
-    QStringList lines = gcode.split("\n", QString::KeepEmptyParts, Qt::CaseInsensitive);
-    return parse(lines);
+    // Program starts in G90 G21, at zero for each coordinates
+    mode = ModeType::absolute;
+    unit = UnitType::millimeters;
+    motion = MotionType::noMove;
+    position = {0, 0, 0};
+    feed = 0;
+    spindle = SpindleType::off;
+    spindleSpeed = 0;
+    coolant = 0;
+    wcs = 0;
+    plane = PlaneType::xy;
 }
 
-bool GCode::parse(QStringList &gcode)
+bool GCode::ModalState::operator==(const ModalState &other) const
 {
-    int unit = UnitType::millimeters;
-    int mode = ModeType::absolute;
+    return (mode == other.mode) && (unit == other.unit) && (motion == other.motion) &&
+           (position == other.position) && (feed == other.feed) &&
+           (spindle == other.spindle) && (spindleSpeed == other.spindleSpeed) &&
+           (coolant == other.coolant) && (wcs == other.wcs) && (plane == other.plane);
+}
 
-    this->gcode = gcode;
+#include <cmath>
+#include "gcodetokenizer.h"
 
-    // We start at zero for each coordinates
-    Point point;
-    point.coords = {0, 0, 0};
-    point.motion = MotionType::noMove;
+// Programs smaller than this are parsed in one chunk.
+// Chunks are also the checkpoints of incremental updates, hence a maximum size.
+#define PARSE_CHUNK_MIN_LINES 4096
+#define PARSE_CHUNK_MAX_LINES 16384
 
-    //QVector3D point {0,0,0};
-    QVector3D lastPoint = {0,0,0};
-    quint64 words = 0;
-    quint64 features = 0;
-    int motion;
-    bool inComment = false;
+// In compact mode, points of a chunk are encoded by groups of this size
+#define COMPACT_FLUSH_POINTS (16 * CompactToolpath::BlockSize)
 
-    QString row;
-    QChar letter;
+// Seconds the preamble waits for the spindle speed before plunging
+#define SPINDLE_SPIN_UP 2
 
-    points.clear();
-    //motions.clear();
+double hypot_f(double x, double y) { return double(sqrt(x*x + y*y)); };
 
-    // Prévoir une maniere de sortir de la boucle en cas de commande M2 ou M30
-    for (int nRow = 0; nRow < gcode.size(); ++nRow)
+bool GCode::parse(const GCodeSource &source, GCodeParseListener *listener)
+{
+    clear();
+    this->source = &source;
+
+    // Split the program at line boundaries, a few chunks per core to balance the load
+    int nbThreads = QThread::idealThreadCount();
+    int nbLines = source.lineCount();
+    int chunkLines = qBound(PARSE_CHUNK_MIN_LINES, nbLines / (4 * nbThreads) + 1, PARSE_CHUNK_MAX_LINES);
+
+    QVector<Chunk> chunks;
+    for (int first = 0; first < nbLines; first += chunkLines)
     {
-        row =  gcode.at(nRow).trimmed();
-        inComment = false;
+        Chunk chunk;
+        chunk.firstLine = first;
+        chunk.lastLine = qMin(first + chunkLines, nbLines);
+        chunks.append(chunk);
+    }
 
-        motion = MotionType::noMove;
-        words = 0;
+    // Chunks are parsed by waves of one chunk per core : the result of a wave
+    // is complete and can be shown while next ones are parsed
+    int waveSize = nbThreads;
+    ModalState state;
+    int nbPoints = 0;
+    int waveFirstPoint = 0;
 
-        // qDebug() << "Line:" << nRow;
+    checkpoints.reserve(chunks.size());
 
-        while (!row.isEmpty())
+    for (int wave = 0; wave < chunks.size(); wave += waveSize)
+    {
+        if (listener && listener->isParseCanceled())
         {
-            letter = row.at(0).toUpper();
-            row = row.right( row.size()-1 );
+            clear();
+            return false;
+        }
+
+        QVector<int> indexes;
+        for (int i = wave; i < qMin(wave + waveSize, chunks.size()); i++) indexes.append(i);
+
+        // Only the first chunk of the wave knows its entry state
+        if (indexes.size() > 1)
+            QtConcurrent::blockingMap(indexes, [this, &chunks, &state, wave](int i) {
+                parseChunk(chunks[i], (i == wave) ? &state : nullptr);
+            });
+        else
+            parseChunk(chunks[wave], &state);
+
+        // Prefix pass : the exit state of a chunk is the entry state of the next one.
+        // Chunks whose guess was wrong are parsed again from the real state.
+        QVector<ModalState> entries;
+        entries.reserve(indexes.size());
+
+        for (int i : indexes)
+        {
+            Chunk &chunk = chunks[i];
+            bool linear = (state.motion == MotionType::rapidMove) || (state.motion == MotionType::feedMove);
+            if (chunk.failed || (chunk.assumedAbsolute && (state.mode != ModeType::absolute)) ||
+                (chunk.assumedLinear && !linear))
+                parseChunk(chunk, &state);
 
-            if (inComment)
-            {
-                if (letter == ')')
-                    inComment=false;
-            }
-            else if (letter.isSpace())
-            {
-                // Ignore spaces
-            }
-            else if (letter == '(')
+            entries.append(state);
+            checkpoints.append( checkpoint(chunk, state, nbPoints) );
+
+            // Feed of the points before the first F is the entry one
+            for (ToolpathFeed run : chunk.feeds)
             {
-                inComment = true;
+                if (run.feed < 0) run.feed = state.feed;
+                run.point += nbPoints;
+                feeds.append(run);
             }
-            else if (letter == ';')
+            nbPoints += chunk.head.size() + chunk.compact.size() + chunk.points.size();
+
+            state = exitState(chunk, state);
+        }
+
+        // Give the entry position to axis not yet set when points were read, and the entry motion
+        if (indexes.size() > 1)
+            QtConcurrent::blockingMap(indexes, [&chunks, &entries, wave](int i) {
+                resolveChunk(chunks[i], entries.at(i - wave));
+            });
+
+        lineCount = chunks.at(indexes.last()).lastLine;
+
+        ToolpathBuffer partPoints;
+        CompactToolpath partCompact;
+        partCompact.setResolution(compactPoints.getResolution());
+
+        for (int i : indexes)
+        {
+            Chunk &chunk = chunks[i];
+            if (compact)
             {
-                row = "";
+                partCompact.append(chunk.head);
+                partCompact.append(chunk.compact);
+                partCompact.append(chunk.points);
             }
-            else if ((letter >= 'A') && (letter <= 'Z'))
-            {
-                QString valueRow;
-                valueRow.clear();
+            else
+                partPoints.append(chunk.points);
+            chunk = Chunk();
+        }
+
+        // Statistics of the part, while it is still in cache
+        ToolpathReader reader(partPoints, partCompact, compact);
+        while (reader.next())
+            stats.add(reader.points(), waveFirstPoint + reader.firstPoint(), feeds);
+        waveFirstPoint = nbPoints;
+
+        points.append(partPoints);
+        compactPoints.append(partCompact);
+
+        if (listener)
+            listener->partParsed(lineCount, partPoints, partCompact);
+    }
+
+    lineCount = nbLines;
+    points.squeeze();
+    compactPoints.squeeze();
+
+    if (compact)
+        qDebug() << "GCode::parse: Compact tool path of" << compactPoints.size() << "points,"
+                 << compactPoints.memorySize() << "bytes";
+
+    qDebug() << "Min  : " << getBoxMin();
+    qDebug() << "Max  : " << getBoxMax();
+    qDebug() << "Size : " << getBoxSize();
+    return true;
+};
+
+void GCode::clear()
+{
+    source = nullptr;
+    lineCount = 0;
+    points.clear();
+    points.squeeze();
+    compactPoints.clear();
+    mappedFile.clear();
+    feeds.clear();
+    checkpoints.clear();
+    stats.clear();
+}
+
+void GCode::appendPart(int lines, const ToolpathBuffer &points, const CompactToolpath &compactPoints)
+{
+    // Feeds are not given, the box and lengths are enough for a preview
+    ToolpathReader reader(points, compactPoints, compact);
+    while (reader.next())
+        stats.add(reader.points(), getPointCount() + reader.firstPoint(), QVector<ToolpathFeed>());
+
+    this->points.append(points);
+    this->compactPoints.append(compactPoints);
+    lineCount = lines;
+}
+
+int GCode::firstPoint(int line) const
+{
+    if (compact) return compactPoints.firstPointOfLine(line);
+
+    Span<qint32> lines = points.lines();
+    return int(std::lower_bound(lines.begin(), lines.end(), line) - lines.begin());
+}
+
+int GCode::lineOf(int point) const
+{
+    if ((point < 0) || (point >= getPointCount())) return -1;
+
+    return compact ? compactPoints.lineOf(point) : points.line(point);
+}
+
+QVector3D GCode::pointCoords(int point) const
+{
+    return compact ? compactPoints.coords(point) : points.coords(point);
+}
 
-                // Get numerical value
-                int nChar=0;
-                while ( (nChar < row.size()) && (nChar < MAX_INT_DIGITS) &&
-                        (row.at(nChar).isDigit() || row.at(nChar) == '-' || row.at(nChar) == '.'))
-                    valueRow += row.at(nChar++);
+void GCode::chunkBounds(int chunk, int &firstLine, int &lastLine, int &firstPoint, int &lastPoint) const
+{
+    bool isLast = (chunk + 1 == checkpoints.size());
+    firstLine = checkpoints.at(chunk).line;
+    lastLine = isLast ? lineCount : checkpoints.at(chunk + 1).line;
+    firstPoint = checkpoints.at(chunk).point;
+    lastPoint = isLast ? getPointCount() : checkpoints.at(chunk + 1).point;
+}
+
+const ToolpathBuffer &GCode::chunkPoints(int firstPoint, int lastPoint, ToolpathBuffer &decoded, int &offset) const
+{
+    offset = 0;
+    if (!compact || (firstPoint >= lastPoint)) return points;
+
+    ToolpathBuffer part;
+    int block = compactPoints.blockOf(firstPoint);
+    offset = compactPoints.blockFirstPoint(block);
+    for (; (block < compactPoints.blockCount()) && (compactPoints.blockFirstPoint(block) < lastPoint); block++)
+    {
+        compactPoints.decodeBlock(block, part);
+        decoded.append(part);
+    }
+    return decoded;
+}
+
+GCode::ModalState GCode::stateAt(int line)
+{
+    if (!source || checkpoints.isEmpty()) return ModalState();
+
+    line = qBound(0, line, lineCount);
+
+    // Last checkpoint at or before the line
+    const Checkpoint *checkpoint = std::upper_bound(checkpoints.constBegin(), checkpoints.constEnd(), line,
+                                                    [](int line, const Checkpoint &checkpoint) { return line < checkpoint.line; }) - 1;
+    if (checkpoint->line == line) return checkpoint->state;
+
+    Chunk chunk;
+    chunk.firstLine = checkpoint->line;
+    chunk.lastLine = line;
+    parseChunk(chunk, &checkpoint->state);
+    return chunk.state;
+}
+
+static QByteArray number(float value)
+{
+    return QByteArray::number(double(value), 'f', 4);
+}
+
+QList<QByteArray> GCode::preamble(int line)
+{
+    ModalState state = stateAt(line);
+    QList<QByteArray> commands;
+
+    // Units, absolute moves, work coordinates and plane first : next commands depend on them
+    commands << QByteArray(state.unit == UnitType::inches ? "G20" : "G21") + " G90 G" + QByteArray::number(54 + state.wcs) +
+                " G" + QByteArray::number(17 + state.plane);
+
+    // Spindle and coolant before the tool gets back to the material
+    if (state.spindle == SpindleType::off)
+        commands << "M5";
+    else
+        commands << "S" + number(state.spindleSpeed) + ((state.spindle == SpindleType::clockwise) ? " M3" : " M4");
+
+    if (!state.coolant)
+        commands << "M9";
+    if (bitIsSet(state.coolant, CoolantFlags::flagMist))
+        commands << "M7";
+    if (bitIsSet(state.coolant, CoolantFlags::flagFlood))
+        commands << "M8";
+
+    // Rapid above the whole program, then down to the position at feed rate
+    float safeZ = qMax(getBoxMax().z(), state.position.z());
+    commands << "G0 Z" + number(safeZ);
+    commands << "G0 X" + number(state.position.x()) + " Y" + number(state.position.y());
+    if (state.spindle != SpindleType::off)
+        commands << "G4 P" + QByteArray::number(SPINDLE_SPIN_UP);
+    if (state.feed > 0)
+        commands << "G1 Z" + number(state.position.z()) + " F" + number(state.feed);
+    else
+        commands << "G0 Z" + number(state.position.z());
+
+    // Modal motion and distance mode of the line. Arcs can't be set without moving :
+    // resumeMotion() gives the G2/G3 of the first move.
+    if (state.motion == MotionType::rapidMove)
+        commands << "G0";
+    if (state.mode == ModeType::incremental)
+        commands << "G91";
+
+    return commands;
+}
+
+QByteArray GCode::resumeMotion(int line)
+{
+    ModalState state = stateAt(line);
+    if (state.motion == MotionType::clockwiseArcMove)
+        return "G2";
+    if (state.motion == MotionType::counterClockwiseArcMove)
+        return "G3";
+    return QByteArray();
+}
+
+bool GCode::update(int firstLine, int removedLines, int addedLines)
+{
+    // Compact tool path can't be patched
+    if (!source || compact || checkpoints.isEmpty()) return false;
+
+    int delta = addedLines - removedLines;
+    if (lineCount + delta != source->lineCount()) return false;
+
+    // Parse again from the last checkpoint before the change...
+    int first = checkpoints.size() - 1;
+    while (checkpoints.at(first).line > firstLine) first--;
+
+    // ...up to a checkpoint after the change where the modal state is the same as before
+    int next = first + 1;
+    while ((next < checkpoints.size()) && (checkpoints.at(next).line < firstLine + removedLines)) next++;
+
+    QVector<Checkpoint> updated = checkpoints.mid(0, first);
+    ToolpathBuffer updatedPoints;
+    QVector<ToolpathFeed> updatedFeeds;
 
-                float value = valueRow.toFloat();
-                int intValue = valueRow.toInt();
+    ModalState state = checkpoints.at(first).state;
+    int startLine = checkpoints.at(first).line;
+    int line = startLine;
+    int firstPoint = checkpoints.at(first).point;
+    int nbPoints = firstPoint;
+
+    for (;;)
+    {
+        Chunk chunk;
+        chunk.firstLine = line;
+        chunk.lastLine = (next < checkpoints.size()) ? checkpoints.at(next).line + delta : source->lineCount();
+        parseChunk(chunk, &state);
+
+        updated.append( checkpoint(chunk, state, nbPoints) );
+        updatedPoints.append(chunk.points);
+        for (ToolpathFeed run : chunk.feeds)
+        {
+            run.point += nbPoints;
+            updatedFeeds.append(run);
+        }
+        nbPoints += chunk.points.size();
+
+        state = chunk.state;
+        line = chunk.lastLine;
+
+        if ((next >= checkpoints.size()) || (checkpoints.at(next).state == state))
+            break; // Following lines give the same points as before
+        next++;
+    }
+
+    // Points and checkpoints after are only shifted
+    int lastPoint = (next < checkpoints.size()) ? checkpoints.at(next).point : points.size();
+    int pointDelta = nbPoints - lastPoint;
+
+    for (int i = next; i < checkpoints.size(); i++)
+    {
+        Checkpoint shifted = checkpoints.at(i);
+        shifted.line += delta;
+        shifted.point += pointDelta;
+        updated.append(shifted);
+    }
+
+    // Statistics : the points replaced and the move to the next one are taken out
+    int following = (lastPoint < points.size()) ? 1 : 0;
+    QVector3D start = firstPoint ? points.coords(firstPoint - 1) : QVector3D();
+    ToolpathBuffer removedPoints = points.mid(firstPoint, lastPoint - firstPoint + following);
+
+    points.replace(firstPoint, lastPoint - firstPoint, updatedPoints);
+    points.shiftLines(nbPoints, delta);
+
+    // Feed changes of the replaced points are replaced, next ones follow their points
+    QVector<ToolpathFeed> shiftedFeeds;
+    for (const ToolpathFeed &run : feeds)
+        if (run.point < firstPoint) shiftedFeeds.append(run);
+    shiftedFeeds += updatedFeeds;
+    for (ToolpathFeed run : feeds)
+    {
+        if (run.point < lastPoint) continue;
+        run.point += pointDelta;
+        shiftedFeeds.append(run);
+    }
+    // ...and put back with the points parsed again. A box edge removed needs all points.
+    if (!stats.replace(firstPoint, removedPoints, feeds, points.mid(firstPoint, nbPoints - firstPoint + following),
+                       shiftedFeeds, start))
+        updateStats();
+    feeds = shiftedFeeds;
+
+    checkpoints = updated;
+    lineCount = source->lineCount();
+
+    qDebug() << "GCode::update:" << line - startLine << "lines parsed again,"
+             << updatedPoints.size() << "points replaced" << lastPoint - firstPoint;
+    return true;
+}
+
+GCode::Checkpoint GCode::checkpoint(const Chunk &chunk, const ModalState &entry, int point)
+{
+    Checkpoint checkpoint;
+    checkpoint.line = chunk.firstLine;
+    checkpoint.point = point;
+    checkpoint.state = entry;
+    return checkpoint;
+}
+
+void GCode::updateStats()
+{
+    stats.clear();
+
+    ToolpathReader reader = getReader();
+    while (reader.next())
+        stats.add(reader.points(), reader.firstPoint(), feeds);
+}
+
+GCode::ModalState GCode::exitState(const Chunk &chunk, const ModalState &entry)
+{
+    ModalState exit = chunk.state;
 
-                row = row.right( row.size() - valueRow.size() );
+    if (bitIsClear(chunk.known, KnownFlags::flagKnownMode)) exit.mode = entry.mode;
+    if (bitIsClear(chunk.known, KnownFlags::flagKnownUnit)) exit.unit = entry.unit;
+    if (bitIsClear(chunk.known, KnownFlags::flagKnownMotion)) exit.motion = entry.motion;
+    if (bitIsClear(chunk.known, KnownFlags::flagKnownFeed)) exit.feed = entry.feed;
+    if (bitIsClear(chunk.known, KnownFlags::flagKnownSpindle)) exit.spindle = entry.spindle;
+    if (bitIsClear(chunk.known, KnownFlags::flagKnownSpindleSpeed)) exit.spindleSpeed = entry.spindleSpeed;
+    if (bitIsClear(chunk.known, KnownFlags::flagKnownWcs)) exit.wcs = entry.wcs;
+    if (bitIsClear(chunk.known, KnownFlags::flagKnownPlane)) exit.plane = entry.plane;
 
-                switch (letter.toLatin1())
+    // Without M9, M7 and M8 add to the entry coolant
+    if (bitIsClear(chunk.known, KnownFlags::flagKnownCoolant)) exit.coolant |= entry.coolant;
+
+    for (int axis = 0; axis < 3; axis++)
+        if (bitIsClear(chunk.known, KnownFlags::flagKnownX + axis))
+            exit.position[axis] = entry.position[axis];
+
+    return exit;
+}
+
+void GCode::resolveChunk(Chunk &chunk, const ModalState &entry)
+{
+    // Compact mode encodes once all axes are known : the points to fix are in head
+    ToolpathBuffer &points = chunk.hasHead ? chunk.head : chunk.points;
+
+    for (int axis = 0; axis < 3; axis++)
+    {
+        int last = chunk.firstKnownPoint[axis];
+        if (last < 0) last = points.size();
+
+        float *coords = points.axisData(axis);
+        for (int i = 0; i < last; i++)
+            coords[i] = entry.position[axis];
+    }
+
+    // G0 or G1, checked by the prefix pass
+    if (chunk.assumedLinear)
+    {
+        int last = (chunk.firstKnownMotion < 0) ? points.size() : chunk.firstKnownMotion;
+        quint8 *motions = points.motionData();
+        for (int i = 0; i < last; i++)
+            motions[i] = quint8(entry.motion);
+    }
+}
+
+void GCode::parseChunk(Chunk &chunk, const ModalState *entry)
+{
+    ModalState &state = chunk.state;
+
+    chunk.failed = false;
+    chunk.assumedAbsolute = false;
+    chunk.assumedLinear = false;
+    chunk.points.clear();
+    chunk.feeds.clear();
+    chunk.hasHead = false;
+    chunk.head.clear();
+    chunk.compact.setResolution(compactPoints.getResolution());
+
+    // One point per line, arcs included
+    chunk.points.reserve(compact ? COMPACT_FLUSH_POINTS : chunk.lastLine - chunk.firstLine);
+
+    if (entry)
+    {
+        state = *entry;
+        chunk.known = bit(KnownFlags::Last) - 1;
+        for (int axis = 0; axis < 3; axis++) chunk.firstKnownPoint[axis] = 0;
+        chunk.firstKnownMotion = 0;
+    }
+    else
+    {
+        state = ModalState();
+        chunk.known = 0;
+        for (int axis = 0; axis < 3; axis++) chunk.firstKnownPoint[axis] = -1;
+        chunk.firstKnownMotion = -1;
+    }
+
+    QVector3D lastPoint = state.position;
+    QVector3D center = {0, 0, 0};
+    quint64 words = 0;
+
+    char letter;
+    double value;
+
+    // Prévoir une maniere de sortir de la boucle en cas de commande M2 ou M30
+    for (int nRow = chunk.firstLine; nRow < chunk.lastLine; ++nRow)
+    {
+        GCodeTokenizer tokenizer(source->lineStart(nRow), source->lineEnd(nRow));
+
+        quint64 knownAtStart = chunk.known;
+        words = 0;
+        center = {0, 0, 0}; // I, J, K are not modal
+
+        while (tokenizer.next(letter, value))
+        {
+            int intValue = int(value);
+            bool isInteger = (double(intValue) == value);
+            int axis;
+
+            switch (letter)
+            {
+            case 'G':
+                if (!isInteger)
                 {
-                case 'G':
-                    switch (intValue)
-                    {
-                    case 0:
-                        motion = MotionType::rapidMove;
-                        break;
-                    case 1:
-                        motion = MotionType::feedMove;
-                        break;
-                    case 2:
-                        motion = MotionType::clockwiseArcMove;
-                        break;
-                    case 3:
-                        motion = MotionType::counterClockwiseArcMove;
-                        break;
-                    case 17:
-                        // Plane XY : The only one we handle !!!
-                        break;
-                    case 20:
-                        unit = UnitType::inches;
-                        break;
-                    case 21:
-                        unit = UnitType::millimeters;
-                        break;
-                    case 90:
-                        mode = ModeType::absolute;
-                        break;
-                    case 91:
-                        mode = ModeType::incremental;
-                        break;
-                    case 94:
-                        // Mode unités par minute. The only one we handle
-                        break;
-
-                    default:
-                        qDebug() << "G" << intValue << " command not supported.";
-                    }
+                    qDebug() << "G" << value << " command not supported.";
                     break;
-                case 'M':
-                    switch (intValue)
-                    {
-                    case 2:
-                    case 30:
-                        // End program
-                        // Prévoir une manière de sortir...
-                        break;
-                    default:
-                        qDebug() << "M" << intValue << " command not supported.";
-                    }
+                }
+                switch (intValue)
+                {
+                case 0:
+                    state.motion = MotionType::rapidMove;
+                    bitSet(chunk.known, KnownFlags::flagKnownMotion);
+                    break;
+                case 1:
+                    state.motion = MotionType::feedMove;
+                    bitSet(chunk.known, KnownFlags::flagKnownMotion);
+                    break;
+                case 2:
+                    state.motion = MotionType::clockwiseArcMove;
+                    bitSet(chunk.known, KnownFlags::flagKnownMotion);
+                    break;
+                case 3:
+                    state.motion = MotionType::counterClockwiseArcMove;
+                    bitSet(chunk.known, KnownFlags::flagKnownMotion);
+                    break;
+                case 17:
+                case 18:
+                case 19:
+                    // Kept for the state, arcs are drawn in XY
+                    state.plane = intValue - 17;
+                    bitSet(chunk.known, KnownFlags::flagKnownPlane);
                     break;
+                case 20:
+                    state.unit = UnitType::inches;
+                    bitSet(chunk.known, KnownFlags::flagKnownUnit);
+                    break;
+                case 21:
+                    state.unit = UnitType::millimeters;
+                    bitSet(chunk.known, KnownFlags::flagKnownUnit);
+                    break;
+                case 90:
+                    state.mode = ModeType::absolute;
+                    bitSet(chunk.known, KnownFlags::flagKnownMode);
+                    break;
+                case 91:
+                    state.mode = ModeType::incremental;
+                    bitSet(chunk.known, KnownFlags::flagKnownMode);
+                    break;
+                case 54: case 55: case 56: case 57: case 58: case 59:
+                    state.wcs = intValue - 54;
+                    bitSet(chunk.known, KnownFlags::flagKnownWcs);
+                    break;
+                case 94:
+                    // Mode unités par minute. The only one we handle
+                    break;
+
                 default:
-                    if (motion>=0)
-                    {
-                        switch (letter.toLatin1())
-                        {
-
-                        case 'X':
-                            if (mode == ModeType::absolute) point.coords.setX(0);
-                            point.coords.setX ( point.coords.x() + value );
-                            bitSet(words, WordFlags::flagHasX);
-
-                            if (!bitIsSet(features, FeatureFlags::flagHasMinX) || (minPoint.x() > point.coords.x()))
-                            {
-                                minPoint.setX( point.coords.x() );
-                                bitSet(features, FeatureFlags::flagHasMinX);
-                            }
-                            if (!bitIsSet(features, FeatureFlags::flagHasMaxX) || (maxPoint.x() < point.coords.x()))
-                            {
-                                maxPoint.setX( point.coords.x() );
-                                bitSet(features, FeatureFlags::flagHasMaxX);
-                            }
-                            break;
-
-                        case 'Y':
-                            if (mode == ModeType::absolute) point.coords.setY(0);
-                            point.coords.setY( point.coords.y() + value);
-                            bitSet(words, WordFlags::flagHasY);
-
-                            if (!bitIsSet(features, FeatureFlags::flagHasMinY) || (minPoint.y() > point.coords.y()))
-                            {
-                                minPoint.setY( point.coords.y() );
-                                bitSet(features, FeatureFlags::flagHasMinY);
-                            }
-                            if (!bitIsSet(features, FeatureFlags::flagHasMaxY) || (maxPoint.y() < point.coords.y()))
-                            {
-                                maxPoint.setY( point.coords.y() );
-                                bitSet(features, FeatureFlags::flagHasMaxY);
-                            }
-                            break;
-
-                        case 'Z':
-                            if (mode == ModeType::absolute) point.coords.setZ(0);
-                            point.coords.setZ( point.coords.z() + value);
-                            bitSet(words, WordFlags::flagHasZ);
-
-                            if (!bitIsSet(features, FeatureFlags::flagHasMinZ) || (minPoint.z() > point.coords.z()))
-                            {
-                                minPoint.setZ( point.coords.z() );
-                                bitSet(features, FeatureFlags::flagHasMinZ);
-                            }
-                            if (!bitIsSet(features, FeatureFlags::flagHasMaxZ) || (maxPoint.z() < point.coords.z()))
-                            {
-                                maxPoint.setZ( point.coords.z() );
-                                bitSet(features, FeatureFlags::flagHasMaxZ);
-                            }
-                            break;
-
-                        case 'I':
-                            // Not sure that mode tell if center is absolute
-                            //if (mode == ModeType::absolute)
-                                center.setX( value );
-                            //else
-                            //    center.setX( lastPoint.x() - value );
-
-                            bitSet(words, WordFlags::flagHasI);
-                            break;
-
-                        case 'J':
-                            // Not sure that mode tell if center is absolute
-                            //if (mode == ModeType::absolute)
-                                center.setY( value );
-                            //else
-                            //    center.setY( lastPoint.y() - value );
-
-                            bitSet(words, WordFlags::flagHasJ);
-                            break;
-
-                        case 'K':
-                            // Not sure that mode tell if center is absolute
-                            //if (mode == ModeType::absolute)
-                                center.setZ( value );
-                            //else
-                            //    center.setZ( lastPoint.z() - value );
-
-                            bitSet(words, WordFlags::flagHasK);
-                            break;
-                        }
+                    qDebug() << "G" << intValue << " command not supported.";
+                }
+                break;
+            case 'M':
+                switch (intValue)
+                {
+                case 2:
+                case 30:
+                    // End program
+                    // Prévoir une manière de sortir...
+                    break;
+                case 3:
+                    state.spindle = SpindleType::clockwise;
+                    bitSet(chunk.known, KnownFlags::flagKnownSpindle);
+                    break;
+                case 4:
+                    state.spindle = SpindleType::counterClockwise;
+                    bitSet(chunk.known, KnownFlags::flagKnownSpindle);
+                    break;
+                case 5:
+                    state.spindle = SpindleType::off;
+                    bitSet(chunk.known, KnownFlags::flagKnownSpindle);
+                    break;
+                case 7:
+                    bitSet(state.coolant, CoolantFlags::flagMist);
+                    break;
+                case 8:
+                    bitSet(state.coolant, CoolantFlags::flagFlood);
+                    break;
+                case 9:
+                    state.coolant = 0;
+                    bitSet(chunk.known, KnownFlags::flagKnownCoolant);
+                    break;
+                default:
+                    qDebug() << "M" << intValue << " command not supported.";
+                }
+                break;
+
+            case 'X':
+            case 'Y':
+            case 'Z':
+                axis = letter - 'X';
+                bitSet(words, WordFlags::flagHasX + axis);
+
+                if (bitIsClear(chunk.known, KnownFlags::flagKnownMode))
+                    chunk.assumedAbsolute = true;
 
+                if (state.mode == ModeType::absolute)
+                {
+                    state.position[axis] = float(value);
+                    if (bitIsClear(chunk.known, KnownFlags::flagKnownX + axis))
+                    {
+                        bitSet(chunk.known, KnownFlags::flagKnownX + axis);
+                        chunk.firstKnownPoint[axis] = chunk.points.size();
                     }
-                    else
-                        qDebug() << letter.toLatin1() << intValue << " command not supported.";
-                } // switch
-            } // if
+                }
+                else if (bitIsSet(chunk.known, KnownFlags::flagKnownX + axis))
+                    state.position[axis] += float(value);
+                else
+                {
+                    // Adding to the entry position later would not round the same way
+                    chunk.failed = true;
+                    return;
+                }
+                break;
+
+            case 'F':
+                state.feed = float(value);
+                bitSet(chunk.known, KnownFlags::flagKnownFeed);
+                break;
+
+            case 'S':
+                state.spindleSpeed = float(value);
+                bitSet(chunk.known, KnownFlags::flagKnownSpindleSpeed);
+                break;
+
+            case 'I':
+                // Not sure that mode tell if center is absolute
+                center.setX( float(value) );
+                bitSet(words, WordFlags::flagHasI);
+                break;
+
+            case 'J':
+                // Not sure that mode tell if center is absolute
+                center.setY( float(value) );
+                bitSet(words, WordFlags::flagHasJ);
+                break;
+
+            case 'K':
+                // Not sure that mode tell if center is absolute
+                center.setZ( float(value) );
+                bitSet(words, WordFlags::flagHasK);
+                break;
+            } // switch
         } // while - End of row parsing
 
-        if (motion>=0)
+        // Motion is modal : a line moves as soon as it has coordinates
+        if (words & (bit(WordFlags::flagHasX) | bit(WordFlags::flagHasY) | bit(WordFlags::flagHasZ)))
         {
+            // Motion of the previous chunk : a G0 or G1 is given by resolveChunk,
+            // an arc needs the real entry state
+            int motion = state.motion;
+            if (bitIsClear(chunk.known, KnownFlags::flagKnownMotion))
+            {
+                if (words & (bit(WordFlags::flagHasI) | bit(WordFlags::flagHasJ) | bit(WordFlags::flagHasK)))
+                {
+                    chunk.failed = true;
+                    return;
+                }
+                chunk.assumedLinear = true;
+                motion = MotionType::feedMove;
+            }
+            else if (chunk.firstKnownMotion < 0)
+                chunk.firstKnownMotion = chunk.points.size();
+
+            // Points keep the modal motion, the visualizer draws plunges as rapid moves
+            int point = chunk.head.size() + chunk.compact.size() + chunk.points.size();
             double radius;
 
             switch(motion)
             {
             case MotionType::feedMove:
-
-                if (bitIsClear(words, WordFlags::flagHasX) &&
-                    bitIsClear(words, WordFlags::flagHasY))
-                    // This is a move in Z only, make it a rapid move
-                    motion = MotionType::rapidMove;
-                if (point.coords.z() > 0)
-                    // When z is above zero, make it a rapidMove
-                    motion = MotionType::rapidMove;
-
-                point.motion = motion;
-                points.append( point );
-                break;
-
             case MotionType::rapidMove:
 
-                point.motion = motion;
-                points.append( point );
+                chunk.points.append( state.position, motion, nRow );
                 break;
 
             case MotionType::clockwiseArcMove:
             case MotionType::counterClockwiseArcMove:
 
-//                qDebug() << "center: " << center;
+                if (bitIsClear(knownAtStart, KnownFlags::flagKnownX) ||
+                    bitIsClear(knownAtStart, KnownFlags::flagKnownY) ||
+                    bitIsClear(knownAtStart, KnownFlags::flagKnownZ))
+                {
+                    // Arc needs the real start position
+                    chunk.failed = true;
+                    return;
+                }
 
                 radius = hypot_f(double(center.x()), double(center.y()));
-                mc_arc( point.coords, lastPoint, center, radius, motion, nRow);
+                mc_arc( chunk.points, state.position, lastPoint, center, radius, state.motion, nRow);
 
                 break;
             }
 
-            lastPoint = point.coords;
-        } // End of row
-    } // End of gCode
+            // Feed is kept when it changes, unknown until an F is read
+            float feed = bitIsSet(chunk.known, KnownFlags::flagKnownFeed) ? state.feed : -1;
+            if ((chunk.head.size() + chunk.compact.size() + chunk.points.size() > point) &&
+                (chunk.feeds.isEmpty() || (chunk.feeds.last().feed != feed)))
+            {
+                ToolpathFeed run;
+                run.point = point;
+                run.feed = feed;
+                chunk.feeds.append(run);
+            }
+        }
 
-    qDebug() << "Min  : " << getBoxMin();
-    qDebug() << "Max  : " << getBoxMax();
-    qDebug() << "Size : " << getBoxSize();
-    //assert( motions.size() == points.size() );
-    return true;
-};
+        lastPoint = state.position;
+
+        if (compact && (chunk.points.size() >= COMPACT_FLUSH_POINTS))
+            flushChunk(chunk);
+    } // End of chunk
+}
+
+void GCode::flushChunk(Chunk &chunk)
+{
+    int unknown = 0;
+    for (int axis = 0; axis < 3; axis++)
+    {
+        // Wait for all axes to be known
+        if (chunk.firstKnownPoint[axis] < 0) return;
+        unknown = qMax(unknown, chunk.firstKnownPoint[axis]);
+    }
+
+    // And the motion, when it was assumed
+    if (chunk.assumedLinear)
+    {
+        if (chunk.firstKnownMotion < 0) return;
+        unknown = qMax(unknown, chunk.firstKnownMotion);
+    }
+
+    if (!chunk.hasHead)
+    {
+        chunk.hasHead = true;
+        if (unknown)
+        {
+            // Keep the points waiting for the entry state out of the encoded data
+            chunk.head = chunk.points;
+            chunk.points.clear();
+            return;
+        }
+    }
+
+    chunk.compact.append(chunk.points);
+    chunk.points.clear();
+}
 
 #include <cmath>
 
-#define N_ARC_CORRECTION 12
 #define ARC_ANGULAR_TRAVEL_EPSILON 5E-7
 #define ARC_TOLERANCE 0.002
 
@@ -312,13 +827,9 @@ bool GCode::parse(QStringList &gcode)
   You should have received a copy of the GNU General Public License
   along with Grbl.  If not, see <http://www.gnu.org/licenses/>.
 */
-void GCode::mc_arc(QVector3D &target, QVector3D &position, QVector3D &offset,
+void GCode::mc_arc(ToolpathBuffer &points, QVector3D &target, QVector3D &position, QVector3D &offset,
                    double radius, int motion, int nRow)
 {
-  Point point;
-  point.motion = motion;
-  point.line = nRow;
-
   double center_axis0 = double(position.x()) + double(offset.x());
   double center_axis1 = double(position.y()) + double(offset.y());
 
@@ -340,90 +851,16 @@ void GCode::mc_arc(QVector3D &target, QVector3D &position, QVector3D &offset,
     if (angular_travel <= ARC_ANGULAR_TRAVEL_EPSILON) { angular_travel += 2.0*M_PI; }
   }
 
-  // NOTE: Segment end points are on the arc, which can lead to the arc diameter being smaller by up to
-  // (2x) settings.arc_tolerance. For 99% of users, this is just fine. If a different arc segment fit
-  // is desired, i.e. least-squares, midpoint on arc, just change the mm_per_arc_segment calculation.
-  // For the intended uses of Grbl, this value shouldn't exceed 2000 for the strictest of cases.
-  uint segments = uint(floor(fabs(0.5*angular_travel*radius)/
-                          sqrt(ARC_TOLERANCE*(2*radius - ARC_TOLERANCE)) ));
-
-  if (segments) {
-    // Multiply inverse feed_rate to compensate for the fact that this movement is approximated
-    // by a number of discrete segments. The inverse feed_rate should be correct for the sum of
-    // all segments.
-//    if (pl_data->condition & PL_COND_FLAG_INVERSE_TIME) {
-//      pl_data->feed_rate *= segments;
-//      bit_false(pl_data->condition,PL_COND_FLAG_INVERSE_TIME); // Force as feed absolute mode over arc segments.
-//    }
-
-    double theta_per_segment = angular_travel / segments;
-    double linear_per_segment = ( double(target.z()) - double(position.z()) ) / segments;
-
-    /* Vector rotation by transformation matrix: r is the original vector, r_T is the rotated vector,
-       and phi is the angle of rotation. Solution approach by Jens Geisler.
-           r_T = [cos(phi) -sin(phi);
-                  sin(phi)  cos(phi] * r ;
-
-       For arc generation, the center of the circle is the axis of rotation and the radius vector is
-       defined from the circle center to the initial position. Each line segment is formed by successive
-       vector rotations. Single precision values can accumulate error greater than tool precision in rare
-       cases. So, exact arc path correction is implemented. This approach avoids the problem of too many very
-       expensive trig operations [sin(),cos(),tan()] which can take 100-200 usec each to compute.
-
-       Small angle approximation may be used to reduce computation overhead further. A third-order approximation
-       (second order sin() has too much error) holds for most, if not, all CNC applications. Note that this
-       approximation will begin to accumulate a numerical drift error when theta_per_segment is greater than
-       ~0.25 rad(14 deg) AND the approximation is successively used without correction several dozen times. This
-       scenario is extremely unlikely, since segment lengths and theta_per_segment are automatically generated
-       and scaled by the arc tolerance setting. Only a very large arc tolerance setting, unrealistic for CNC
-       applications, would cause this numerical drift error. However, it is best to set N_ARC_CORRECTION from a
-       low of ~4 to a high of ~20 or so to avoid trig operations while keeping arc generation accurate.
-
-       This approximation also allows mc_arc to immediately insert a line segment into the planner
-       without the initial overhead of computing cos() or sin(). By the time the arc needs to be applied
-       a correction, the planner should have caught up to the lag caused by the initial mc_arc overhead.
-       This is important when there are successive arc motions.
-    */
-    // Computes: cos_T = 1 - theta_per_segment^2/2, sin_T = theta_per_segment - theta_per_segment^3/6) in ~52usec
-    double cos_T = 2.0 - theta_per_segment * theta_per_segment;
-    double sin_T = theta_per_segment * 0.16666667 * (cos_T + 4.0);
-    cos_T *= 0.5;
-
-    double sin_Ti;
-    double cos_Ti;
-    double r_axisi;
-    uint16_t i;
-    uint8_t count = 0;
-
-    for (i = 1; i < segments; i++) { // Increment (segments-1).
-
-      if (count < N_ARC_CORRECTION) {
-        // Apply vector rotation matrix. ~40 usec
-        r_axisi = r_axis0 * sin_T + r_axis1 * cos_T;
-        r_axis0 = r_axis0 * cos_T - r_axis1 * sin_T;
-        r_axis1 = r_axisi;
-        count++;
-      } else {
-        // Arc correction to radius vector. Computed only every N_ARC_CORRECTION increments. ~375 usec
-        // Compute exact location by applying transformation matrix from initial radius vector(=-offset).
-        cos_Ti = cos(i * theta_per_segment);
-        sin_Ti = sin(i * theta_per_segment);
-        r_axis0 = -double(offset.x()) * cos_Ti + double(offset.y()) * sin_Ti;
-        r_axis1 = -double(offset.x()) * sin_Ti - double(offset.y()) * cos_Ti;
-        count = 0;
-      }
-
-      // Update arc_target location
-      point.coords.setX( float(center_axis0 + r_axis0) );
-      point.coords.setY( float(center_axis1 + r_axis1) );
-      point.coords.setZ( position.z() + float(linear_per_segment));
-
-      // Add point to our list
-      points.append(point);
-    }
-  }
+  // The arc is kept as is, it is cut in segments when drawn (ToolpathArc::tessellate)
+  double start_angle = atan2(r_axis1, r_axis0);
+
+  ToolpathArc arc;
+  arc.centerX = float(center_axis0);
+  arc.centerY = float(center_axis1);
+  arc.radius = float(radius);
+  arc.startAngle = float(start_angle);
+  arc.endAngle = float(start_angle + angular_travel);
+  arc.pitch = float( (double(target.z()) - double(position.z())) / angular_travel );
 
-  // Ensure last segment arrives at target location.
-  point.coords = target;
-  points.append(point);
+  points.appendArc(target, motion, nRow, arc);
 }
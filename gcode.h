@@ -3,24 +3,21 @@
 
 #include <QStringList>
 #include <QVector3D>
+#include <QSharedPointer>
 #include "bits.h"
+#include "gcodesource.h"
+#include "toolpathbuffer.h"
+#include "compacttoolpath.h"
+#include "toolpathstats.h"
+
+// Increment when parse results change : cached tool paths are parsed again
+#define GCODE_PARSER_VERSION 6
+
+class GCodeParseListener;
+class QFile;
 
 class GCode
 {
-    class FeatureFlags
-    {
-    public:
-        enum {
-            flagHasMinX,
-            flagHasMaxX,
-            flagHasMinY,
-            flagHasMaxY,
-            flagHasMinZ,
-            flagHasMaxZ,
-            Last
-        };
-    };
-
     class WordFlags
     {
     public:
@@ -35,6 +32,28 @@ class GCode
         };
     };
 
+    // What a chunk parsed on its own has learnt about the modal state.
+    // Axis flags have the same index as the QVector3D coordinates.
+    class KnownFlags
+    {
+    public:
+        enum {
+            flagKnownX,
+            flagKnownY,
+            flagKnownZ,
+            flagKnownMode,
+            flagKnownUnit,
+            flagKnownMotion,
+            flagKnownFeed,
+            flagKnownSpindle,
+            flagKnownSpindleSpeed,
+            flagKnownCoolant,       // M9 read : coolant no more depends on the entry state
+            flagKnownWcs,
+            flagKnownPlane,
+            Last
+        };
+    };
+
     class ModeType
     {
     public:
@@ -54,6 +73,18 @@ class GCode
             Last
         };
     };
+
+    // Plane of arcs, in the order of G17, G18, G19
+    class PlaneType
+    {
+    public:
+        enum {
+            xy,
+            zx,
+            yz,
+            Last
+        };
+    };
 public:
     class MotionType
     {
@@ -69,37 +100,181 @@ public:
         };
     };
 
-    struct Point
+    class SpindleType
+    {
+    public:
+        enum {
+            off,
+            clockwise,
+            counterClockwise,
+            Last
+        };
+    };
+
+    class CoolantFlags
     {
-        QVector3D coords;
+    public:
+        enum {
+            flagMist,
+            flagFlood,
+            Last
+        };
+    };
+
+    // Modal state carried from one line to the next
+    struct ModalState
+    {
+        int mode;
+        int unit;
         int motion;
-        int line;
+        QVector3D position;
+        float feed;             // F, in program unit
+        int spindle;            // SpindleType
+        float spindleSpeed;     // S
+        quint32 coolant;        // CoolantFlags
+        int wcs;                // Work coordinate system, 0 for G54 to 5 for G59
+        int plane;              // PlaneType. Arcs are drawn in XY whatever the plane.
+
+        ModalState();
+        bool operator==(const ModalState &other) const;
     };
 
 public:
     GCode();
 
-    bool parse(QString &gcode);
-    bool parse(QStringList &gcode);
+    // Parse whole source. A listener receives the result by parts, and can stop it.
+    bool parse(const GCodeSource &source, GCodeParseListener *listener = nullptr);
+    void clear();
+
+    // Adds a part given by a listener, to show a parse in progress
+    void appendPart(int lines, const ToolpathBuffer &points, const CompactToolpath &compactPoints);
+
+    // Source lines from firstLine have been replaced : removedLines by addedLines.
+    // Parses again from the previous checkpoint until modal state is the same as
+    // before, and patches points and box. Returns false if a full parse is needed.
+    bool update(int firstLine, int removedLines, int addedLines);
 
-    QVector3D getBoxMin() { return minPoint; }
-    QVector3D getBoxMax() { return maxPoint; }
-    QVector3D getBoxSize() { return maxPoint - minPoint; }
+    QVector3D getBoxMin() const { return stats.getMin(); }
+    QVector3D getBoxMax() const { return stats.getMax(); }
+    QVector3D getBoxSize() const { return stats.getSize(); }
 
-    QStringList getLines() { return gcode; }
-    int getSize() {return gcode.size(); }
+    // Box, lengths, cut heights and feeds of the tool path
+    const ToolpathStats &getStats() const { return stats; }
+
+    const GCodeSource *getSource() const { return source; }
+    int getSize() { return lineCount; }
 
     // This method is inspired from Grbl 1.1h mc_arc function from motion_control.c
     // Many thanks to the Grbl team.
-    void mc_arc(QVector3D &target, QVector3D &position, QVector3D &offset,
+    // Adds the arc to points as one point with its ToolpathArc.
+    void mc_arc(ToolpathBuffer &points, QVector3D &target, QVector3D &position, QVector3D &offset,
                        double radius, int motion, int nRow);
 
-    QList<Point> &getPoints()  { return points; }
+    // Compact storage quantizes points to the machine resolution, for very large jobs.
+    // Takes effect on next parse.
+    void setCompact(bool compact, const QVector3D &stepsPerMillimeter);
+    bool isCompact() const { return compact; }
+
+    int getPointCount() const { return compact ? compactPoints.size() : points.size(); }
+    // Empty in compact mode, use a reader
+    const ToolpathBuffer &getPoints() const { return points; }
+    const CompactToolpath &getCompactPoints() const { return compactPoints; }
+    ToolpathReader getReader() const { return ToolpathReader(points, compactPoints, compact); }
+    // Feed changes, in point order
+    const QVector<ToolpathFeed> &getFeeds() const { return feeds; }
+
+    // Index between source lines and points : the points of a line are
+    // [firstPoint(line), firstPoint(line + 1)). Points are in line order, so
+    // a line is found by binary search, and a point has its line.
+    int firstPoint(int line) const;
+    int lineOf(int point) const;
+    // Point must exist, a block is decoded in compact mode
+    QVector3D pointCoords(int point) const;
+
+    // Modal state at the start of line, parsed from the previous checkpoint
+    ModalState stateAt(int line);
+    // Commands bringing the machine in the state of line, to start the program there
+    QList<QByteArray> preamble(int line);
+    // Modal arc motion (G2/G3) of line, the first move from there must give, empty when none
+    QByteArray resumeMotion(int line);
 protected:
-    QVector3D center, minPoint, maxPoint;
+    friend class GCodeCache;
+    friend class GCodeEstimator;
+    friend class GCodeSimplifier;
+
+    // Range of lines parsed by one thread.
+    // Without an entry state, the chunk assumes G90 and takes the points of axis not
+    // yet set as unknown : they get the real entry position later. Anything needing
+    // more (modal motion, arc or G91 move from an unknown position) fails the chunk,
+    // which is then parsed again once its entry state is known.
+    struct Chunk
+    {
+        int firstLine;
+        int lastLine;
+
+        bool failed;            // Needs the real entry state (modal motion, arc...)
+        bool assumedAbsolute;   // A coordinate was read before any G90/G91
+
+        ModalState state;       // State at the end of the chunk
+        quint64 known;          // KnownFlags
+        int firstKnownPoint[3]; // First point with an absolute value, per axis
+        int firstKnownMotion;   // First point moved by a motion read in the chunk
+        bool assumedLinear;     // Points moved before, by the G0 or G1 of the entry state
+
+        ToolpathBuffer points;
+        // From the first point of the chunk, negative feed until an F is read
+        QVector<ToolpathFeed> feeds;
+
+        // Compact mode : points are encoded while parsing, except the first ones
+        // waiting for the entry state (head)
+        bool hasHead;
+        ToolpathBuffer head;
+        CompactToolpath compact;
+    };
+
+    // Modal state at the start of each chunk
+    struct Checkpoint
+    {
+        int line;
+        int point;
+        ModalState state;
+    };
+
+    static Checkpoint checkpoint(const Chunk &chunk, const ModalState &entry, int point);
+    void chunkBounds(int chunk, int &firstLine, int &lastLine, int &firstPoint, int &lastPoint) const;
+    // Points of a chunk, decoded in compact mode : point i is at i - offset
+    const ToolpathBuffer &chunkPoints(int firstPoint, int lastPoint, ToolpathBuffer &decoded, int &offset) const;
+    void updateStats();
+
+    void parseChunk(Chunk &chunk, const ModalState *entry);
+    void flushChunk(Chunk &chunk);
+    static ModalState exitState(const Chunk &chunk, const ModalState &entry);
+    static void resolveChunk(Chunk &chunk, const ModalState &entry);
+
+    const GCodeSource *source;
+    int lineCount;
+    ToolpathBuffer points;
+    QVector<ToolpathFeed> feeds;
+    QVector<Checkpoint> checkpoints;
+    ToolpathStats stats;
+
+    bool compact;
+    CompactToolpath compactPoints;
+    // Cache file the compact bytes are read from, mapped until clear()
+    QSharedPointer<QFile> mappedFile;
+};
+
+// Follows a parse, from the parsing thread
+class GCodeParseListener
+{
+public:
+    virtual ~GCodeParseListener() {}
+
+    // Checked between parts, parse stops and returns false when true
+    virtual bool isParseCanceled() = 0;
 
-    QStringList gcode;
-    QList<Point> points;
+    // Points of the lines parsed since last part (in compactPoints for a compact tool path)
+    virtual void partParsed(int lines, const ToolpathBuffer &points, const CompactToolpath &compactPoints) = 0;
 };
 
 #endif // GCODE_H
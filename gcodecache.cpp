@@ -0,0 +1,356 @@
+#include "gcodecache.h"
+
+#include <QDebug>
+#include <QDir>
+#include <QFile>
+#include <QSaveFile>
+#include <QDateTime>
+#include <QStandardPaths>
+#include <cstring>
+
+// Changes with the layout of the file
+#define CACHE_MAGIC "CNCPTH3"
+#define CACHE_MAX_FILES 64
+
+struct CacheHeader
+{
+    char magic[8];
+    quint32 version;
+    quint32 compact;
+    quint64 key;
+    qint64 sourceSize;
+    float resolution[3];
+    qint32 lineCount;
+    qint32 pointCount;
+    qint32 checkpointCount;
+    qint32 blockCount;
+    qint32 byteCount;
+    qint32 arcCount;
+    qint32 feedCount;
+    qint32 zLevelCount;
+    qint32 feedBinCount;
+};
+
+// Statistics but their bins
+struct CacheStats
+{
+    float min[3], max[3], last[3];
+    qint32 pointCount;
+    qint32 moves[ToolpathStats::MotionTypes];
+    double lengths[ToolpathStats::MotionTypes];
+};
+
+struct CacheZLevel
+{
+    qint32 key;
+    ToolpathStats::Bin bin;
+};
+
+struct CacheFeedBin
+{
+    float key;
+    ToolpathStats::Bin bin;
+};
+
+qint64 GCodeCache::fileSize(const CacheHeader &header)
+{
+    qint64 size = qint64(sizeof(CacheHeader)) + qint64(sizeof(CacheStats)) +
+                  qint64(header.zLevelCount) * qint64(sizeof(CacheZLevel)) +
+                  qint64(header.feedBinCount) * qint64(sizeof(CacheFeedBin)) +
+                  qint64(header.checkpointCount) * qint64(sizeof(GCode::Checkpoint)) +
+                  qint64(header.arcCount) * qint64(sizeof(ToolpathArc)) +
+                  qint64(header.feedCount) * qint64(sizeof(ToolpathFeed));
+
+    if (header.compact)
+        size += qint64(header.blockCount) * qint64(sizeof(CompactToolpath::Block)) + header.byteCount;
+    else
+        size += qint64(header.pointCount) * (3 * sizeof(float) + sizeof(quint8) + sizeof(qint32));
+
+    return size;
+}
+
+void GCodeCache::writeStats(QIODevice &file, const ToolpathStats &stats)
+{
+    CacheStats fixed;
+    memset(&fixed, 0, sizeof(CacheStats));
+    for (int axis = 0; axis < 3; axis++)
+    {
+        fixed.min[axis] = stats.minPoint[axis];
+        fixed.max[axis] = stats.maxPoint[axis];
+        fixed.last[axis] = stats.lastPoint[axis];
+    }
+    fixed.pointCount = stats.pointCount;
+    for (int motion = 0; motion < ToolpathStats::MotionTypes; motion++)
+    {
+        fixed.moves[motion] = stats.moves[motion];
+        fixed.lengths[motion] = stats.lengths[motion];
+    }
+    file.write(reinterpret_cast<const char *>(&fixed), sizeof(CacheStats));
+
+    for (auto i = stats.zLevels.constBegin(); i != stats.zLevels.constEnd(); ++i)
+    {
+        CacheZLevel level;
+        memset(&level, 0, sizeof(CacheZLevel));
+        level.key = i.key();
+        level.bin = i.value();
+        file.write(reinterpret_cast<const char *>(&level), sizeof(CacheZLevel));
+    }
+    for (auto i = stats.feedBins.constBegin(); i != stats.feedBins.constEnd(); ++i)
+    {
+        CacheFeedBin feed;
+        memset(&feed, 0, sizeof(CacheFeedBin));
+        feed.key = i.key();
+        feed.bin = i.value();
+        file.write(reinterpret_cast<const char *>(&feed), sizeof(CacheFeedBin));
+    }
+}
+
+const uchar *GCodeCache::readStats(const uchar *p, const CacheHeader &header, ToolpathStats &stats)
+{
+    stats.clear();
+
+    CacheStats fixed;
+    memcpy(&fixed, p, sizeof(CacheStats));
+    p += sizeof(CacheStats);
+
+    stats.minPoint = QVector3D(fixed.min[0], fixed.min[1], fixed.min[2]);
+    stats.maxPoint = QVector3D(fixed.max[0], fixed.max[1], fixed.max[2]);
+    stats.lastPoint = QVector3D(fixed.last[0], fixed.last[1], fixed.last[2]);
+    stats.pointCount = fixed.pointCount;
+    for (int motion = 0; motion < ToolpathStats::MotionTypes; motion++)
+    {
+        stats.moves[motion] = fixed.moves[motion];
+        stats.lengths[motion] = fixed.lengths[motion];
+    }
+
+    for (int i = 0; i < header.zLevelCount; i++)
+    {
+        CacheZLevel level;
+        memcpy(&level, p, sizeof(CacheZLevel));
+        p += sizeof(CacheZLevel);
+        stats.zLevels.insert(level.key, level.bin);
+    }
+    for (int i = 0; i < header.feedBinCount; i++)
+    {
+        CacheFeedBin feed;
+        memcpy(&feed, p, sizeof(CacheFeedBin));
+        p += sizeof(CacheFeedBin);
+        stats.feedBins.insert(feed.key, feed.bin);
+    }
+
+    return p;
+}
+
+static inline quint64 rotate(quint64 value, int bits) { return (value << bits) | (value >> (64 - bits)); }
+
+GCodeCache::GCodeCache()
+{
+    directory = QStandardPaths::writableLocation(QStandardPaths::CacheLocation) + "/toolpaths";
+    maxFiles = CACHE_MAX_FILES;
+}
+
+quint64 GCodeCache::hash(const GCodeSource &source)
+{
+    // Eight bytes at a time : a 2 MB program is hashed in well under a millisecond
+    const quint64 k1 = 0x87C37B91114253D5ULL, k2 = 0x4CF5AD432745937FULL;
+    const char *p = source.data();
+    qint64 size = source.size();
+    quint64 h = 0x9E3779B97F4A7C15ULL ^ quint64(size);
+    quint64 word;
+
+    qint64 i = 0;
+    for (; i + 8 <= size; i += 8)
+    {
+        memcpy(&word, p + i, 8);
+        h = rotate(h ^ (rotate(word * k1, 31) * k2), 27) * 5 + 0x52DCE729;
+    }
+
+    word = 0;
+    memcpy(&word, p + i, size_t(size - i));
+    h ^= rotate(word * k1, 31) * k2;
+
+    // Final avalanche
+    h ^= h >> 33; h *= 0xFF51AFD7ED558CCDULL;
+    h ^= h >> 33; h *= 0xC4CEB9FE1A85EC53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+QString GCodeCache::fileName(quint64 key, bool compact) const
+{
+    return QString("%1/%2%3.toolpath").arg(directory).arg(key, 16, 16, QChar('0')).arg(compact ? "c" : "");
+}
+
+bool GCodeCache::load(GCode &gcode, const GCodeSource &source, quint64 key)
+{
+    // Kept by gcode while its compact bytes are in the map
+    QSharedPointer<QFile> mapped(new QFile( fileName(key, gcode.compact) ));
+    QFile &file = *mapped;
+    if (!file.open(QIODevice::ReadOnly)) return false;
+
+    qint64 size = file.size();
+    if (size < qint64(sizeof(CacheHeader))) return false;
+
+    const uchar *data = file.map(0, size);
+    if (!data) return false;
+
+    CacheHeader header;
+    memcpy(&header, data, sizeof(CacheHeader));
+
+    QVector3D resolution = gcode.compactPoints.getResolution();
+    bool valid = !memcmp(header.magic, CACHE_MAGIC, sizeof(header.magic)) &&
+                 (header.version == GCODE_PARSER_VERSION) &&
+                 (header.key == key) && (header.sourceSize == source.size()) &&
+                 (header.lineCount == source.lineCount()) &&
+                 (bool(header.compact) == gcode.compact) &&
+                 (!header.compact || (QVector3D(header.resolution[0], header.resolution[1], header.resolution[2]) == resolution)) &&
+                 (fileSize(header) == size);
+
+    if (!valid)
+    {
+        qDebug() << "GCodeCache::load: Obsolete cache file" << file.fileName();
+        return false;
+    }
+
+    const uchar *p = data + sizeof(CacheHeader);
+
+    gcode.clear();
+    gcode.source = &source;
+    gcode.lineCount = header.lineCount;
+
+    p = readStats(p, header, gcode.stats);
+
+    gcode.checkpoints.resize(header.checkpointCount);
+    memcpy(gcode.checkpoints.data(), p, size_t(header.checkpointCount) * sizeof(GCode::Checkpoint));
+    p += size_t(header.checkpointCount) * sizeof(GCode::Checkpoint);
+
+    const uchar *arcs = p;
+    p += size_t(header.arcCount) * sizeof(ToolpathArc);
+
+    gcode.feeds.resize(header.feedCount);
+    memcpy(gcode.feeds.data(), p, size_t(header.feedCount) * sizeof(ToolpathFeed));
+    p += size_t(header.feedCount) * sizeof(ToolpathFeed);
+
+    if (header.compact)
+    {
+        CompactToolpath &compact = gcode.compactPoints;
+        compact.blocks.resize(header.blockCount);
+        memcpy(compact.blocks.data(), p, size_t(header.blockCount) * sizeof(CompactToolpath::Block));
+        p += size_t(header.blockCount) * sizeof(CompactToolpath::Block);
+
+        compact.bytes = QByteArray::fromRawData(reinterpret_cast<const char *>(p), header.byteCount);
+        compact.count = header.pointCount;
+        gcode.mappedFile = mapped;
+
+        compact.arcs.resize(header.arcCount);
+        memcpy(compact.arcs.data(), arcs, size_t(header.arcCount) * sizeof(ToolpathArc));
+    }
+    else
+    {
+        ToolpathBuffer &points = gcode.points;
+        int count = header.pointCount;
+        points.resize(count);
+
+        for (int axis = 0; axis < 3; axis++)
+        {
+            memcpy(points.axisData(axis), p, size_t(count) * sizeof(float));
+            p += size_t(count) * sizeof(float);
+        }
+        memcpy(points.motionData(), p, size_t(count) * sizeof(quint8));
+        p += size_t(count) * sizeof(quint8);
+        memcpy(points.lineData(), p, size_t(count) * sizeof(qint32));
+
+        points.resizeArcs(header.arcCount);
+        memcpy(points.arcData(), arcs, size_t(header.arcCount) * sizeof(ToolpathArc));
+    }
+
+    if (!header.compact)
+        file.unmap(const_cast<uchar *>(data));
+
+    // Most recently used files are kept
+    file.setFileTime(QDateTime::currentDateTime(), QFileDevice::FileModificationTime);
+    file.close();
+    return true;
+}
+
+bool GCodeCache::save(const GCode &gcode, quint64 key)
+{
+    if (!gcode.source) return false;
+
+    CacheHeader header;
+    memset(&header, 0, sizeof(CacheHeader));
+    memcpy(header.magic, CACHE_MAGIC, sizeof(header.magic));
+    header.version = GCODE_PARSER_VERSION;
+    header.compact = gcode.compact;
+    header.key = key;
+    header.sourceSize = gcode.source->size();
+    header.lineCount = gcode.lineCount;
+    header.pointCount = gcode.getPointCount();
+    header.checkpointCount = gcode.checkpoints.size();
+    header.blockCount = gcode.compact ? gcode.compactPoints.blocks.size() : 0;
+    header.byteCount = gcode.compact ? gcode.compactPoints.bytes.size() : 0;
+
+    Span<ToolpathArc> arcs = gcode.compact ? Span<ToolpathArc>(gcode.compactPoints.arcs.constData(), gcode.compactPoints.arcs.size())
+                                           : gcode.points.arcs();
+    header.arcCount = arcs.size();
+    header.feedCount = gcode.feeds.size();
+    header.zLevelCount = gcode.stats.zLevels.size();
+    header.feedBinCount = gcode.stats.feedBins.size();
+
+    QVector3D resolution = gcode.compactPoints.getResolution();
+    for (int axis = 0; axis < 3; axis++)
+    {
+        header.resolution[axis] = gcode.compact ? resolution[axis] : 0;
+    }
+
+    if (!QDir().mkpath(directory)) return false;
+
+    // Written aside and renamed : a reader never sees half a file
+    QSaveFile file( fileName(key, gcode.compact) );
+    if (!file.open(QIODevice::WriteOnly))
+    {
+        qWarning() << "GCodeCache::save: Can't write" << file.fileName();
+        return false;
+    }
+
+    file.write(reinterpret_cast<const char *>(&header), sizeof(CacheHeader));
+    writeStats(file, gcode.stats);
+    file.write(reinterpret_cast<const char *>(gcode.checkpoints.constData()),
+               qint64(gcode.checkpoints.size()) * qint64(sizeof(GCode::Checkpoint)));
+    file.write(reinterpret_cast<const char *>(arcs.data), qint64(arcs.size()) * qint64(sizeof(ToolpathArc)));
+    file.write(reinterpret_cast<const char *>(gcode.feeds.constData()), qint64(gcode.feeds.size()) * qint64(sizeof(ToolpathFeed)));
+
+    if (gcode.compact)
+    {
+        const CompactToolpath &compact = gcode.compactPoints;
+        file.write(reinterpret_cast<const char *>(compact.blocks.constData()),
+                   qint64(compact.blocks.size()) * qint64(sizeof(CompactToolpath::Block)));
+        file.write(compact.bytes);
+    }
+    else
+    {
+        const ToolpathBuffer &points = gcode.points;
+        for (int axis = 0; axis < 3; axis++)
+            file.write(reinterpret_cast<const char *>(points.axis(axis).data), qint64(points.size()) * qint64(sizeof(float)));
+        file.write(reinterpret_cast<const char *>(points.motions().data), qint64(points.size()) * qint64(sizeof(quint8)));
+        file.write(reinterpret_cast<const char *>(points.lines().data), qint64(points.size()) * qint64(sizeof(qint32)));
+    }
+
+    if (!file.commit())
+    {
+        qWarning() << "GCodeCache::save: Can't write" << file.fileName();
+        return false;
+    }
+
+    prune();
+    return true;
+}
+
+void GCodeCache::prune()
+{
+    QDir dir(directory);
+    QFileInfoList files = dir.entryInfoList(QStringList() << "*.toolpath", QDir::Files, QDir::Time);
+
+    for (int i = maxFiles; i < files.size(); i++)
+        QFile::remove(files.at(i).absoluteFilePath());
+}
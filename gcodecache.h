@@ -0,0 +1,43 @@
+#ifndef GCODECACHE_H
+#define GCODECACHE_H
+
+#include <QString>
+#include "gcode.h"
+
+// Parse results saved on disk, to open again a known program without parsing it.
+// A file is named after a hash of the source text, and holds the parser version,
+// the storage (compact and its resolution), the statistics, the checkpoints, the
+// arcs, the feed changes and the point arrays as they are in memory. It is read
+// through a memory map : the compact bytes stay there until the tool path is
+// cleared, other arrays are copied (a QVector can't use memory it doesn't own).
+
+struct CacheHeader;
+
+class GCodeCache
+{
+public:
+    GCodeCache();
+
+    void setDirectory(const QString &directory) { this->directory = directory; }
+    const QString &getDirectory() const { return directory; }
+    // Least recently used files are removed above this count
+    void setMaxFiles(int maxFiles) { this->maxFiles = maxFiles; }
+
+    static quint64 hash(const GCodeSource &source);
+
+    // Storage of gcode must be set (setCompact). False when nothing valid is cached.
+    bool load(GCode &gcode, const GCodeSource &source, quint64 key);
+    bool save(const GCode &gcode, quint64 key);
+
+private:
+    QString fileName(quint64 key, bool compact) const;
+    static qint64 fileSize(const CacheHeader &header);
+    static void writeStats(QIODevice &file, const ToolpathStats &stats);
+    static const uchar *readStats(const uchar *p, const CacheHeader &header, ToolpathStats &stats);
+    void prune();
+
+    QString directory;
+    int maxFiles;
+};
+
+#endif // GCODECACHE_H
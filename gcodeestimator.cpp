@@ -0,0 +1,426 @@
+#include "gcodeestimator.h"
+
+#include <QDebug>
+#include <QElapsedTimer>
+#include <QtConcurrent>
+#include <cmath>
+#include <limits>
+#include "gcodetokenizer.h"
+
+// Grbl defaults (defaults.h)
+#define DEFAULT_MAX_RATE 500.0f             // mm/min
+#define DEFAULT_ACCELERATION 10.0f          // mm/s²
+#define DEFAULT_JUNCTION_DEVIATION 0.01     // mm
+#define DEFAULT_ARC_TOLERANCE 0.002         // mm
+#define DEFAULT_BLOCK_BUFFER_SIZE 15        // [OPT:] of a 16 blocks buffer
+
+// As Grbl planner.c
+#define MINIMUM_JUNCTION_SPEED 0.0f
+#define SOME_LARGE_VALUE 1.0e38f
+
+#define MM_PER_INCH 25.4f
+
+// A move as the planner sees it. Arcs are one block, their speed is
+// limited by the junctions of the segments Grbl cuts them in.
+struct GCodeEstimator::Block
+{
+    float length;               // mm
+    float entryUnit[3];         // Direction at the start and at the end
+    float exitUnit[3];
+    float nominalSpeed;         // mm/s
+    float acceleration;         // mm/s²
+    float maxEntrySpeedSqr;     // Junction with the previous block
+    double exitLimitSqr;        // Planned back from the last block of the buffer
+    qint32 line;
+    bool rapid;
+    bool stop;                  // Planner synchronized before it (dwell, spindle, coolant...)
+};
+
+PlannerSettings::PlannerSettings()
+{
+    junctionDeviation = 0;
+    arcTolerance = 0;
+    blockBufferSize = 0;
+}
+
+PlannerSettings PlannerSettings::resolved() const
+{
+    PlannerSettings settings = *this;
+    for (int axis = 0; axis < 3; axis++)
+    {
+        if (settings.maxRate[axis] <= 0) settings.maxRate[axis] = DEFAULT_MAX_RATE;
+        if (settings.acceleration[axis] <= 0) settings.acceleration[axis] = DEFAULT_ACCELERATION;
+    }
+    if (settings.junctionDeviation <= 0) settings.junctionDeviation = DEFAULT_JUNCTION_DEVIATION;
+    if (settings.arcTolerance <= 0) settings.arcTolerance = DEFAULT_ARC_TOLERANCE;
+    if (settings.blockBufferSize <= 0) settings.blockBufferSize = DEFAULT_BLOCK_BUFFER_SIZE;
+    return settings;
+}
+
+GCodeEstimator::GCodeEstimator(QObject *parent) : QThread(parent)
+{
+    estimated = false;
+    totalTime = 0;
+}
+
+GCodeEstimator::~GCodeEstimator()
+{
+    cancel();
+}
+
+void GCodeEstimator::estimate(const GCode &gcode, const PlannerSettings &settings)
+{
+    cancel();
+
+    this->gcode = gcode;
+    this->settings = settings;
+    canceled.storeRelease(0);
+    estimated = false;
+
+    start();
+}
+
+void GCodeEstimator::cancel()
+{
+    if (!isRunning()) return;
+
+    canceled.storeRelease(1);
+    wait();
+    qDebug() << "GCodeEstimator::cancel: Estimation canceled";
+}
+
+void GCodeEstimator::run()
+{
+    QElapsedTimer timer;
+    timer.start();
+
+    estimated = estimate(gcode, settings, lineTimes, rapidLineTimes, totalTime, &canceled);
+    gcode.clear();
+
+    if (estimated)
+        qDebug() << "GCodeEstimator::run:" << totalTime << "s estimated in" << timer.elapsed() << "ms";
+}
+
+// As Grbl limit_value_by_axis_maximum
+static inline float limitByAxis(const QVector3D &limits, const float unit[3])
+{
+    float limit = SOME_LARGE_VALUE;
+    for (int axis = 0; axis < 3; axis++)
+        if (unit[axis] != 0)
+            limit = qMin(limit, fabsf(limits[axis] / unit[axis]));
+    return limit;
+}
+
+static inline float junctionSpeedSqr(const float exitUnit[3], const float entryUnit[3],
+                                     const QVector3D &acceleration, float junctionDeviation)
+{
+    float cosTheta = -(exitUnit[0] * entryUnit[0] + exitUnit[1] * entryUnit[1] + exitUnit[2] * entryUnit[2]);
+
+    // Straight line : no limit. Reversal : stop.
+    if (cosTheta < -0.999999f) return SOME_LARGE_VALUE;
+    if (cosTheta > 0.999999f) return MINIMUM_JUNCTION_SPEED * MINIMUM_JUNCTION_SPEED;
+
+    float junctionUnit[3];
+    float norm = 0;
+    for (int axis = 0; axis < 3; axis++)
+    {
+        junctionUnit[axis] = entryUnit[axis] - exitUnit[axis];
+        norm += junctionUnit[axis] * junctionUnit[axis];
+    }
+    norm = sqrtf(norm);
+    for (int axis = 0; axis < 3; axis++) junctionUnit[axis] /= norm;
+
+    float junctionAcceleration = limitByAxis(acceleration, junctionUnit);
+    float sinThetaD2 = sqrtf(0.5f * (1.0f - cosTheta));
+    return qMax(MINIMUM_JUNCTION_SPEED * MINIMUM_JUNCTION_SPEED,
+                junctionAcceleration * junctionDeviation * sinThetaD2 / (1.0f - sinThetaD2));
+}
+
+// Trapezoid profile, or triangle when the nominal speed is not reached
+static double blockTime(double entrySqr, double exitSqr, double nominal, double acceleration, double length)
+{
+    double nominalSqr = nominal * nominal;
+    double accelerate = (nominalSqr - entrySqr) / (2.0 * acceleration);
+    double decelerate = (nominalSqr - exitSqr) / (2.0 * acceleration);
+
+    if (accelerate + decelerate <= length)
+        return (2.0 * nominal - sqrt(entrySqr) - sqrt(exitSqr)) / acceleration +
+               (length - accelerate - decelerate) / nominal;
+
+    double peak = sqrt(qMax(0.5 * (2.0 * acceleration * length + entrySqr + exitSqr), qMax(entrySqr, exitSqr)));
+    return (2.0 * peak - sqrt(entrySqr) - sqrt(exitSqr)) / acceleration;
+}
+
+void GCodeEstimator::buildBlocks(const GCode &gcode, const PlannerSettings &settings, int chunk,
+                                 QVector<Block> &blocks, float *lineTimes)
+{
+    const GCode::Checkpoint &checkpoint = gcode.checkpoints.at(chunk);
+    int firstLine, lastLine, firstPoint, lastPoint;
+    gcode.chunkBounds(chunk, firstLine, lastLine, firstPoint, lastPoint);
+
+    // Compact points are decoded for the chunk only
+    ToolpathBuffer decoded;
+    int offset;
+    const ToolpathBuffer *points = &gcode.chunkPoints(firstPoint, lastPoint, decoded, offset);
+
+    Span<float> x = points->x(), y = points->y(), z = points->z();
+    Span<qint32> lines = points->lines();
+    Span<ToolpathArc> arcs = points->arcs();
+    int arc = points->arcIndex(firstPoint - offset);
+
+    // Motion is read again from the source : the tool path shows some feed moves as rapid ones
+    GCode::ModalState state = checkpoint.state;
+    bool rapid = (state.motion == GCode::MotionType::rapidMove);
+    float scale = (state.unit == GCode::UnitType::inches) ? MM_PER_INCH : 1.0f;
+    float feed = state.feed;
+    QVector3D last = state.position * scale;
+    bool stop = false;
+
+    float tolerance = float(settings.arcTolerance);
+    float junctionDeviation = float(settings.junctionDeviation);
+    float arcAcceleration = qMin(settings.acceleration.x(), settings.acceleration.y());
+
+    blocks.reserve(lastPoint - firstPoint);
+
+    char letter;
+    double value;
+    int point = firstPoint - offset;
+    int end = lastPoint - offset;
+
+    for (int line = firstLine; line < lastLine; line++)
+    {
+        GCodeTokenizer tokenizer(gcode.source->lineStart(line), gcode.source->lineEnd(line));
+        bool dwell = false;
+        double seconds = 0;
+
+        while (tokenizer.next(letter, value))
+        {
+            int intValue = int(value);
+            switch (letter)
+            {
+            case 'G':
+                if (double(intValue) != value) break;
+                switch (intValue)
+                {
+                case 0: rapid = true; break;
+                case 1: case 2: case 3: rapid = false; break;
+                case 4: dwell = true; break;
+                case 20: scale = MM_PER_INCH; break;
+                case 21: scale = 1.0f; break;
+                }
+                break;
+            case 'M':
+                switch (intValue)
+                {
+                // Grbl waits for the buffer to be empty
+                case 0: case 1: case 2: case 30:
+                case 3: case 4: case 5:
+                case 7: case 8: case 9:
+                    stop = true;
+                    break;
+                }
+                break;
+            case 'F':
+                feed = float(value);
+                break;
+            case 'P':
+                seconds = value;
+                break;
+            }
+        }
+
+        if (dwell)
+        {
+            stop = true;
+            lineTimes[line] += float(seconds);
+        }
+
+        for (; (point < end) && (lines[point] == line); point++)
+        {
+            QVector3D target(x[point] * scale, y[point] * scale, z[point] * scale);
+            Block block;
+            block.line = line;
+            float arcSpeed = SOME_LARGE_VALUE;
+
+            if ((arc < arcs.size()) && (arcs[arc].point == point))
+            {
+                const ToolpathArc &geometry = arcs[arc++];
+                float travel = geometry.endAngle - geometry.startAngle;
+                float radius = geometry.radius * scale;
+                float pitch = geometry.pitch * scale;
+                float sign = (travel < 0) ? -1.0f : 1.0f;
+                float norm = sqrtf(radius * radius + pitch * pitch);
+
+                block.length = fabsf(travel) * norm;
+                block.entryUnit[0] = -sign * radius * sinf(geometry.startAngle) / norm;
+                block.entryUnit[1] = sign * radius * cosf(geometry.startAngle) / norm;
+                block.entryUnit[2] = sign * pitch / norm;
+                block.exitUnit[0] = -sign * radius * sinf(geometry.endAngle) / norm;
+                block.exitUnit[1] = sign * radius * cosf(geometry.endAngle) / norm;
+                block.exitUnit[2] = block.entryUnit[2];
+
+                // Junctions between the segments of the arc
+                int segments = geometry.segments(double(tolerance / scale));
+                if (segments > 1)
+                {
+                    float cosHalfTheta = cosf(0.5f * fabsf(travel) / segments);
+                    if (cosHalfTheta < 1.0f)
+                        arcSpeed = sqrtf(arcAcceleration * junctionDeviation * cosHalfTheta / (1.0f - cosHalfTheta));
+                }
+            }
+            else
+            {
+                QVector3D delta = target - last;
+                block.length = delta.length();
+                for (int axis = 0; axis < 3; axis++)
+                    block.entryUnit[axis] = block.exitUnit[axis] = (block.length > 0) ? delta[axis] / block.length : 0;
+            }
+
+            last = target;
+
+            // Grbl drops moves without steps
+            if (block.length < 1e-6f) continue;
+
+            float maxSpeed = qMin(limitByAxis(settings.maxRate, block.entryUnit),
+                                  limitByAxis(settings.maxRate, block.exitUnit)) / 60.0f;
+            block.nominalSpeed = (rapid || (feed <= 0)) ? maxSpeed : qMin(feed * scale / 60.0f, maxSpeed);
+            block.nominalSpeed = qMin(block.nominalSpeed, arcSpeed);
+            block.acceleration = qMin(limitByAxis(settings.acceleration, block.entryUnit),
+                                      limitByAxis(settings.acceleration, block.exitUnit));
+            block.maxEntrySpeedSqr = 0;
+            block.rapid = rapid;
+            block.stop = stop;
+            stop = false;
+
+            blocks.append(block);
+        }
+    }
+}
+
+void GCodeEstimator::limitBlocks(QVector<Block> &blocks, int first, int last, int bufferSize,
+                                 double &limitSqr, double &gainSqr)
+{
+    Block *data = blocks.data();
+    int count = blocks.size();
+
+    // Exit of each block is min(exitLimitSqr, entry + 2 a l) : composed, so is the chunk exit
+    limitSqr = std::numeric_limits<double>::infinity();
+    gainSqr = 0;
+    for (int i = first; i < last; i++)
+    {
+        Block &block = data[i];
+
+        // The last block of the buffer has to stop, speeds are planned back from it
+        double exitSqr = 0;
+        for (int k = qMin(i + bufferSize, count) - 1; k > i; k--)
+            exitSqr = qMin(double(data[k].maxEntrySpeedSqr),
+                           exitSqr + 2.0 * double(data[k].acceleration) * double(data[k].length));
+        block.exitLimitSqr = exitSqr;
+
+        double gain = 2.0 * double(block.acceleration) * double(block.length);
+        limitSqr = qMin(exitSqr, limitSqr + gain);
+        gainSqr += gain;
+    }
+}
+
+void GCodeEstimator::planBlocks(const QVector<Block> &blocks, int first, int last, double entrySqr,
+                                float *lineTimes, float *rapidLineTimes)
+{
+    const Block *data = blocks.constData();
+
+    for (int i = first; i < last; i++)
+    {
+        const Block &block = data[i];
+        double exitSqr = qMin(block.exitLimitSqr, entrySqr + 2.0 * double(block.acceleration) * double(block.length));
+
+        float time = float(blockTime(entrySqr, exitSqr, double(block.nominalSpeed),
+                                     double(block.acceleration), double(block.length)));
+        lineTimes[block.line] += time;
+        if (block.rapid) rapidLineTimes[block.line] += time;
+        entrySqr = exitSqr;
+    }
+}
+
+bool GCodeEstimator::estimate(const GCode &gcode, const PlannerSettings &plannerSettings, QVector<float> &lineTimes,
+                              QVector<float> &rapidLineTimes, double &totalTime, const QAtomicInt *canceled)
+{
+    PlannerSettings settings = plannerSettings.resolved();
+    int nbChunks = gcode.checkpoints.size();
+
+    lineTimes.fill(0.0f, gcode.lineCount);
+    rapidLineTimes.fill(0.0f, gcode.lineCount);
+    totalTime = 0;
+    if (!gcode.source || !nbChunks) return true;
+
+    QVector<int> indexes;
+    for (int i = 0; i < nbChunks; i++) indexes.append(i);
+
+    // Blocks of each chunk, with the dwells
+    QVector< QVector<Block> > chunkBlocks(nbChunks);
+    QVector<Block> *chunkData = chunkBlocks.data();
+    float *times = lineTimes.data();
+    float *rapidTimes = rapidLineTimes.data();
+
+    QtConcurrent::blockingMap(indexes, [&gcode, &settings, chunkData, times, canceled](int i) {
+        if (canceled && canceled->loadAcquire()) return;
+        buildBlocks(gcode, settings, i, chunkData[i], times);
+    });
+    if (canceled && canceled->loadAcquire()) return false;
+
+    QVector<int> starts;
+    QVector<Block> blocks;
+    for (const QVector<Block> &chunk : chunkBlocks)
+    {
+        starts.append(blocks.size());
+        blocks += chunk;
+    }
+    starts.append(blocks.size());
+    chunkBlocks.clear();
+
+    // Entry speed limits, from the previous block
+    Block *blockData = blocks.data();
+    QVector3D acceleration = settings.acceleration;
+    float junctionDeviation = float(settings.junctionDeviation);
+
+    QtConcurrent::blockingMap(indexes, [blockData, &starts, acceleration, junctionDeviation](int i) {
+        for (int k = starts.at(i); k < starts.at(i + 1); k++)
+        {
+            Block &block = blockData[k];
+            if (!k || block.stop) continue;
+
+            const Block &previous = blockData[k - 1];
+            float nominal = qMin(previous.nominalSpeed, block.nominalSpeed);
+            block.maxEntrySpeedSqr = qMin(junctionSpeedSqr(previous.exitUnit, block.entryUnit, acceleration, junctionDeviation),
+                                          nominal * nominal);
+        }
+    });
+    if (canceled && canceled->loadAcquire()) return false;
+
+    int bufferSize = settings.blockBufferSize;
+    QVector<double> limits(nbChunks), gains(nbChunks);
+    double *limitData = limits.data();
+    double *gainData = gains.data();
+    QtConcurrent::blockingMap(indexes, [&blocks, &starts, bufferSize, limitData, gainData, canceled](int i) {
+        if (canceled && canceled->loadAcquire()) return;
+        limitBlocks(blocks, starts.at(i), starts.at(i + 1), bufferSize, limitData[i], gainData[i]);
+    });
+    if (canceled && canceled->loadAcquire()) return false;
+
+    // Entry speed of each chunk, in order : the one of a sequential plan, up to rounding
+    QVector<double> entries(nbChunks);
+    double entrySqr = 0;
+    for (int i = 0; i < nbChunks; i++)
+    {
+        entries[i] = entrySqr;
+        entrySqr = qMin(limits.at(i), entrySqr + gains.at(i));
+    }
+
+    QtConcurrent::blockingMap(indexes, [&blocks, &starts, &entries, times, rapidTimes, canceled](int i) {
+        if (canceled && canceled->loadAcquire()) return;
+        planBlocks(blocks, starts.at(i), starts.at(i + 1), entries.at(i), times, rapidTimes);
+    });
+    if (canceled && canceled->loadAcquire()) return false;
+
+    for (float time : lineTimes) totalTime += double(time);
+    return true;
+}
@@ -0,0 +1,81 @@
+#ifndef GCODEESTIMATOR_H
+#define GCODEESTIMATOR_H
+
+#include <QThread>
+#include <QAtomicInt>
+#include <QVector>
+#include <QVector3D>
+
+#include "gcode.h"
+
+// Machine limits of the planner model, as Grbl settings.
+// Zero values take Grbl defaults.
+
+struct PlannerSettings
+{
+    QVector3D maxRate;          // $110 - $112, mm/min
+    QVector3D acceleration;     // $120 - $122, mm/s²
+    double junctionDeviation;   // $11, mm
+    double arcTolerance;        // $12, mm
+    int blockBufferSize;        // Planner blocks, from [OPT:]
+
+    PlannerSettings();
+    // Defaults in place of unknown values
+    PlannerSettings resolved() const;
+};
+
+// Estimates the run time of a parsed program with a model of Grbl planner :
+// moves are blocks with a trapezoid speed profile, junction speeds follow the
+// junction deviation, and the lookahead only sees the blocks of the planner
+// buffer (the last one must stop). The sender keeps the buffer full.
+// Chunks of the program (checkpoints) are planned in parallel. The exit speed
+// of a chunk is min(limit, entry + gain) of its entry speed : these are
+// chained in order to give each chunk the entry speed of a sequential plan.
+
+class GCodeEstimator : public QThread
+{
+    Q_OBJECT
+
+public:
+    explicit GCodeEstimator(QObject *parent = nullptr);
+    virtual ~GCodeEstimator();
+
+    // The source of gcode must not change until finished
+    void estimate(const GCode &gcode, const PlannerSettings &settings);
+    // Stops the estimation, returns when the thread is done
+    void cancel();
+
+    bool isEstimated() { return estimated; }
+    // Seconds, total and by source line, with the part of rapid moves
+    double getTotalTime() { return totalTime; }
+    const QVector<float> &getLineTimes() { return lineTimes; }
+    const QVector<float> &getRapidLineTimes() { return rapidLineTimes; }
+
+    // Same estimation in the calling thread, false when canceled
+    static bool estimate(const GCode &gcode, const PlannerSettings &settings, QVector<float> &lineTimes,
+                         QVector<float> &rapidLineTimes, double &totalTime, const QAtomicInt *canceled = nullptr);
+
+protected:
+    virtual void run();
+
+private:
+    struct Block;
+
+    static void buildBlocks(const GCode &gcode, const PlannerSettings &settings, int chunk,
+                            QVector<Block> &blocks, float *lineTimes);
+    static void limitBlocks(QVector<Block> &blocks, int first, int last, int bufferSize,
+                            double &limitSqr, double &gainSqr);
+    static void planBlocks(const QVector<Block> &blocks, int first, int last, double entrySqr,
+                           float *lineTimes, float *rapidLineTimes);
+
+    GCode gcode;
+    PlannerSettings settings;
+    QAtomicInt canceled;
+    bool estimated;
+
+    QVector<float> lineTimes;
+    QVector<float> rapidLineTimes;
+    double totalTime;
+};
+
+#endif // GCODEESTIMATOR_H
@@ -0,0 +1,110 @@
+#include "gcodeloader.h"
+
+#include <QDebug>
+#include <QElapsedTimer>
+
+GCodeLoader::GCodeLoader(QObject *parent) : QThread(parent)
+{
+    source = nullptr;
+    parsed = false;
+}
+
+GCodeLoader::~GCodeLoader()
+{
+    cancel();
+}
+
+void GCodeLoader::load(const GCodeSource *source, bool compact, const QVector3D &stepsPerMillimeter)
+{
+    cancel();
+
+    this->source = source;
+    gcode.setCompact(compact, stepsPerMillimeter);
+    canceled.storeRelease(0);
+    parsed = false;
+    clearParts();
+
+    start();
+}
+
+void GCodeLoader::cancel()
+{
+    if (!isRunning()) return;
+
+    canceled.storeRelease(1);
+    wait();
+    qDebug() << "GCodeLoader::cancel: Parse canceled";
+}
+
+void GCodeLoader::run()
+{
+    QElapsedTimer timer;
+    timer.start();
+
+    quint64 key = GCodeCache::hash(*source);
+
+    if (cache.load(gcode, *source, key))
+    {
+        parsed = true;
+        qDebug() << "GCodeLoader::run:" << gcode.getSize() << "lines read from cache in" << timer.elapsed() << "ms";
+        return;
+    }
+
+    parsed = gcode.parse(*source, this);
+
+    if (parsed)
+    {
+        qDebug() << "GCodeLoader::run:" << gcode.getSize() << "lines parsed in" << timer.elapsed() << "ms";
+        cache.save(gcode, key);
+    }
+}
+
+GCode GCodeLoader::takeGCode()
+{
+    GCode result = gcode;
+    gcode.clear();
+    parsed = false;
+    return result;
+}
+
+bool GCodeLoader::isParseCanceled()
+{
+    return canceled.loadAcquire();
+}
+
+void GCodeLoader::partParsed(int lines, const ToolpathBuffer &points, const CompactToolpath &compactPoints)
+{
+    // Buffers are shared, not copied
+    Part part;
+    part.lines = lines;
+    part.points = points;
+    part.compactPoints = compactPoints;
+
+    partsMutex.lock();
+    bool first = parts.isEmpty();
+    parts.append(part);
+    partsMutex.unlock();
+
+    // One signal until parts are taken
+    if (first) emit partsAvailable();
+}
+
+bool GCodeLoader::takeParts(GCode &preview)
+{
+    partsMutex.lock();
+    QVector<Part> taken;
+    taken.swap(parts);
+    partsMutex.unlock();
+
+    for (const Part &part : taken)
+        preview.appendPart(part.lines, part.points, part.compactPoints);
+
+    return !taken.isEmpty();
+}
+
+void GCodeLoader::clearParts()
+{
+    partsMutex.lock();
+    parts.clear();
+    partsMutex.unlock();
+}
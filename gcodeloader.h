@@ -0,0 +1,64 @@
+#ifndef GCODELOADER_H
+#define GCODELOADER_H
+
+#include <QThread>
+#include <QMutex>
+#include <QAtomicInt>
+
+#include "gcode.h"
+#include "gcodecache.h"
+
+// Parses a source in a background thread.
+// Parsed parts are queued for a preview while the next ones are parsed,
+// finished() is emitted at the end, canceled or not.
+// A program already parsed is read from the cache instead.
+
+class GCodeLoader : public QThread, public GCodeParseListener
+{
+    Q_OBJECT
+
+public:
+    explicit GCodeLoader(QObject *parent = nullptr);
+    virtual ~GCodeLoader();
+
+    // Source must not change until finished
+    void load(const GCodeSource *source, bool compact, const QVector3D &stepsPerMillimeter);
+    // Stops the parse, returns when the thread is done
+    void cancel();
+
+    bool isParsed() { return parsed; }
+    // Result of the parse, the loader keeps nothing
+    GCode takeGCode();
+
+    // Appends parts parsed since last call to preview, returns false without new part
+    bool takeParts(GCode &preview);
+    void clearParts();
+
+signals:
+    void partsAvailable();
+
+protected:
+    virtual void run();
+
+    virtual bool isParseCanceled();
+    virtual void partParsed(int lines, const ToolpathBuffer &points, const CompactToolpath &compactPoints);
+
+private:
+    struct Part
+    {
+        int lines;
+        ToolpathBuffer points;
+        CompactToolpath compactPoints;
+    };
+
+    const GCodeSource *source;
+    GCode gcode;
+    GCodeCache cache;
+    QAtomicInt canceled;
+    bool parsed;
+
+    QMutex partsMutex;
+    QVector<Part> parts;
+};
+
+#endif // GCODELOADER_H
@@ -0,0 +1,199 @@
+#include "gcodeminimizer.h"
+
+#include <cmath>
+#include "gcodetokenizer.h"
+
+#define MM_PER_INCH 25.4
+
+// Longer lines are sent as they are
+#define MAX_WORDS 32
+
+// Fixed point, without trailing zeros
+static QByteArray compact(double value, int decimals = 6)
+{
+    QByteArray text = QByteArray::number(value, 'f', decimals);
+    if (decimals > 0)
+    {
+        int size = text.size();
+        while (text.at(size - 1) == '0') size--;
+        if (text.at(size - 1) == '.') size--;
+        text.truncate(size);
+    }
+    if (text == "-0") text = "0";
+    return text;
+}
+
+GCodeMinimizer::GCodeMinimizer()
+{
+    start(QVector3D());
+}
+
+void GCodeMinimizer::start(const QVector3D &stepsPerMillimeter)
+{
+    steps = stepsPerMillimeter;
+    forget();
+    lines = 0;
+    bytesIn = bytesOut = 0;
+}
+
+void GCodeMinimizer::forget()
+{
+    motion = distance = units = plane = wcs = feedMode = -1;
+    feed = speed = -1;
+}
+
+// Nearest step, with the fewest decimals still on it
+QByteArray GCodeMinimizer::coordinate(int axis, double value) const
+{
+    // Incremental moves would add the rounding errors
+    double perUnit = double(steps[axis]);
+    if ((perUnit <= 0) || (distance != 90)) return compact(value);
+
+    // Units unknown : inches have the finer steps
+    if (units != 21) perUnit *= MM_PER_INCH;
+
+    double step = std::round(value * perUnit);
+    for (int decimals = 0; decimals < 6; decimals++)
+    {
+        QByteArray text = compact(step / perUnit, decimals);
+        if (std::round(text.toDouble() * perUnit) == step) return text;
+    }
+    return compact(step / perUnit);
+}
+
+QByteArray GCodeMinimizer::minimize(const QByteArray &line)
+{
+    lines++;
+    bytesIn += line.size() + 1;
+
+    struct Word
+    {
+        char letter;
+        double value;
+    };
+    Word words[MAX_WORDS];
+    int count = 0;
+    bool tooLong = false;
+
+    GCodeTokenizer tokenizer(line.constData(), line.constData() + line.size());
+    char letter;
+    double value;
+    while (tokenizer.next(letter, value))
+    {
+        if (count == MAX_WORDS)
+        {
+            tooLong = true;
+            break;
+        }
+        words[count].letter = letter;
+        words[count].value = value;
+        count++;
+    }
+
+    // System commands and what the tokenizer can't hold are sent as they are
+    if (tooLong || line.contains('$') || line.contains('%'))
+    {
+        forget();
+        QByteArray text = line.trimmed();
+        bytesOut += text.size() + 1;
+        return text;
+    }
+
+    // Units, distance mode and motion of the line apply to all its coordinates
+    int previousUnits = units;
+    int previousDistance = distance;
+    int lineMotion = motion;
+    bool axesAreOffsets = false;
+    for (int i = 0; i < count; i++)
+    {
+        if (words[i].letter != 'G') continue;
+
+        int code = qRound(words[i].value * 10);
+        if ((code == 200) || (code == 210)) units = code / 10;
+        if ((code == 900) || (code == 910)) distance = code / 10;
+        if ((code == 0) || (code == 10) || (code == 20) || (code == 30)) lineMotion = code / 10;
+        if ((code == 100) || (code == 280) || (code == 300) || (code == 431) || (code == 920)) axesAreOffsets = true;
+    }
+    if (units != previousUnits) feed = -1;
+
+    // Arc ends stay where they are, the machine checks them against the radius
+    bool roundAxes = ((lineMotion == 0) || (lineMotion == 1)) && !axesAreOffsets;
+
+    QByteArray text;
+    bool programEnd = false;
+
+    for (int i = 0; i < count; i++)
+    {
+        letter = words[i].letter;
+        value = words[i].value;
+        bool keep = true;
+
+        switch (letter)
+        {
+        case 'N':
+            keep = false;
+            break;
+        case 'G':
+        {
+            int code = qRound(value * 10);
+            switch (code)
+            {
+            case 0: case 10: case 20: case 30:
+                keep = (code / 10 != motion);
+                motion = code / 10;
+                break;
+            case 382: case 383: case 384: case 385: case 800:
+                motion = -1;
+                break;
+            case 200: case 210:
+                keep = (code / 10 != previousUnits);
+                break;
+            case 900: case 910:
+                keep = (code / 10 != previousDistance);
+                break;
+            case 170: case 180: case 190:
+                keep = (code / 10 != plane);
+                plane = code / 10;
+                break;
+            case 930: case 940:
+                keep = (code / 10 != feedMode);
+                if (keep) feed = -1;
+                feedMode = code / 10;
+                break;
+            default:
+                if ((code >= 540) && (code <= 593))
+                {
+                    keep = (code != wcs);
+                    wcs = code;
+                }
+            }
+            break;
+        }
+        case 'F':
+            // Inverse time needs F on each move
+            keep = (feedMode == 93) || (value != feed);
+            feed = value;
+            break;
+        case 'S':
+            keep = (value != speed);
+            speed = value;
+            break;
+        case 'M':
+            if ((value == 2) || (value == 30)) programEnd = true;
+            break;
+        }
+
+        if (!keep) continue;
+
+        text += letter;
+        if (roundAxes && (letter >= 'X') && (letter <= 'Z'))
+            text += coordinate(letter - 'X', value);
+        else
+            text += compact(value);
+    }
+
+    if (programEnd) forget();
+
+    bytesOut += text.size() + 1;
+    return text;
+}
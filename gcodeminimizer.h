@@ -0,0 +1,55 @@
+#ifndef GCODEMINIMIZER_H
+#define GCODEMINIMIZER_H
+
+#include <QByteArray>
+#include <QVector3D>
+
+// Shortest text of the lines streamed : at 115200 baud a short move takes
+// longer to send than to run. Comments, spaces and N words are removed, and
+// so are the modal words repeating the state left by the previous lines
+// (motion, feed, spindle speed, distance mode, units, plane, work coordinates).
+// X, Y, Z of absolute G0, G1 moves are rounded to the machine steps and written
+// with the fewest decimals giving the same step : the machine goes to the same
+// step (one step away at most when a work offset is not on a step). Arcs,
+// incremental moves and offsets (G10, G28, G30, G43.1, G92) are not rounded.
+// Lines must be given in the order they are sent, $ lines and M2, M30 make
+// the state unknown again.
+
+class GCodeMinimizer
+{
+public:
+    GCodeMinimizer();
+
+    // New stream. Steps per millimeter of X, Y, Z, none : coordinates are not rounded.
+    void start(const QVector3D &stepsPerMillimeter);
+
+    QByteArray minimize(const QByteArray &line);
+    // State unknown : next lines are written whole
+    void forget();
+
+    // Bytes of the lines given and returned, with their line feed
+    int getLines() const { return lines; }
+    qint64 getBytesIn() const { return bytesIn; }
+    qint64 getBytesOut() const { return bytesOut; }
+
+private:
+    QByteArray coordinate(int axis, double value) const;
+
+    QVector3D steps;
+
+    // Modal state, -1 when unknown
+    int motion;
+    int distance;
+    int units;
+    int plane;
+    int wcs;            // G54 to G59.3, times 10
+    int feedMode;
+    double feed;
+    double speed;
+
+    int lines;
+    qint64 bytesIn;
+    qint64 bytesOut;
+};
+
+#endif // GCODEMINIMIZER_H
@@ -0,0 +1,116 @@
+#include "gcodeprogramsource.h"
+
+#include "gcodetokenizer.h"
+
+class LineMotionType
+{
+public:
+    enum {
+        none,       // No move with the modal motion
+        given,      // G0 to G3
+        modal
+    };
+};
+
+// How the motion of a line is set. Commands with axis words of their own
+// (G10, G28, G30, G43.1, G53, G92) don't take the modal motion.
+static int lineMotion(const QByteArray &line)
+{
+    GCodeTokenizer tokenizer(line.constData(), line.constData() + line.size());
+    bool hasAxis = false;
+    char letter;
+    double value;
+
+    while (tokenizer.next(letter, value))
+    {
+        switch (letter)
+        {
+        case 'G':
+            switch (qRound(value * 10))
+            {
+            case 0: case 10: case 20: case 30:
+                return LineMotionType::given;
+            case 100: case 280: case 300: case 431: case 530: case 920:
+                return LineMotionType::none;
+            }
+            break;
+        case 'X': case 'Y': case 'Z':
+        case 'I': case 'J': case 'K': case 'R':
+            hasAxis = true;
+            break;
+        }
+    }
+
+    return hasAxis ? LineMotionType::modal : LineMotionType::none;
+}
+
+GCodeProgramSource::GCodeProgramSource()
+{
+    source = nullptr;
+    simplifier = nullptr;
+    index = 0;
+    preambleIndex = 0;
+    motionLine = -1;
+    minimize = false;
+}
+
+void GCodeProgramSource::start(const GCodeSource *source, const GCodeSimplifier *simplifier, int firstLine,
+                               const QList<QByteArray> &preamble, const QByteArray &motion,
+                               bool minimize, const QVector3D &stepsPerMillimeter)
+{
+    this->source = source;
+    this->simplifier = simplifier;
+    index = firstLine;
+    this->preamble = preamble;
+    preambleIndex = 0;
+    this->motion = motion;
+    motionLine = -1;
+    this->minimize = minimize;
+    minimizer.start(stepsPerMillimeter);
+}
+
+bool GCodeProgramSource::next(QByteArray &line, int &sourceLine)
+{
+    if (preambleIndex < preamble.size())
+    {
+        const QByteArray &command = preamble.at(preambleIndex++);
+        line = minimize ? minimizer.minimize(command) : command;
+        sourceLine = -1;
+        return true;
+    }
+
+    // Lines of a simplified tool path are skipped, the line number tells where we are
+    int nbLines = source->lineCount();
+    while ((index < nbLines) && simplifier->isDropped(index))
+        index++;
+
+    if (index >= nbLines) return false;
+
+    // Line is a view on the source, only the N prefix is built
+    QByteArray text = simplifier->line(*source, index);
+    if (!motion.isEmpty() && ((motionLine < 0) || (index <= motionLine)))
+    {
+        int lineMotionType = lineMotion(text);
+        if (lineMotionType == LineMotionType::modal)
+            text = motion + ' ' + text;
+        if (lineMotionType != LineMotionType::none)
+            motionLine = index;
+    }
+
+    line = QByteArray("N").append( QByteArray::number(index+1) );
+    if (minimize)
+        line.append( minimizer.minimize(text) );
+    else
+        line.append( text );
+    sourceLine = index++;
+    return true;
+}
+
+void GCodeProgramSource::restart(int sourceLine, int linesWithout)
+{
+    // Lines without source line are the preamble
+    preambleIndex = qMax(0, preambleIndex - linesWithout);
+    if (sourceLine >= 0)
+        index = sourceLine;
+    minimizer.forget();
+}
@@ -0,0 +1,46 @@
+#ifndef GCODEPROGRAMSOURCE_H
+#define GCODEPROGRAMSOURCE_H
+
+#include <QList>
+#include <QByteArray>
+#include <QVector3D>
+
+#include "gcodestreamer.h"
+#include "gcodesource.h"
+#include "gcodesimplifier.h"
+#include "gcodeminimizer.h"
+
+// Lines of a program to stream : the preamble of the first line, then the lines
+// kept by the simplifier, numbered (N) and minimized. The first move not giving
+// its motion gets the modal arc of the first line, which the preamble can't set. Read in the streamer thread,
+// the source and the simplifier must not change until the stream is idle.
+
+class GCodeProgramSource : public GCodeStreamSource
+{
+public:
+    GCodeProgramSource();
+
+    void start(const GCodeSource *source, const GCodeSimplifier *simplifier, int firstLine,
+               const QList<QByteArray> &preamble, const QByteArray &motion,
+               bool minimize, const QVector3D &stepsPerMillimeter);
+
+    virtual bool next(QByteArray &line, int &sourceLine);
+    virtual void restart(int sourceLine, int linesWithout);
+
+    bool isMinimized() const { return minimize; }
+    const GCodeMinimizer &getMinimizer() const { return minimizer; }
+
+private:
+    const GCodeSource *source;
+    const GCodeSimplifier *simplifier;
+    int index;
+    QList<QByteArray> preamble;
+    int preambleIndex;
+    QByteArray motion;
+    int motionLine;     // First line moving, -1 until read
+
+    bool minimize;
+    GCodeMinimizer minimizer;
+};
+
+#endif // GCODEPROGRAMSOURCE_H
@@ -0,0 +1,916 @@
+#include "gcodereorderer.h"
+
+#include <QDebug>
+#include <QElapsedTimer>
+#include <QMap>
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <cstring>
+#include "gcodetokenizer.h"
+
+// Points at clearance height, program units
+#define UP_TOLERANCE 0.01f
+// Travels shorter than this are not written
+#define SAME_POINT 0.0001
+
+// Island ends tried by 2-opt after each island
+#define NEIGHBOURS 8
+#define MAX_PASSES 50
+
+static QByteArray number(double value)
+{
+    return QByteArray::number(value, 'f', 4);
+}
+
+static QPointF xy(const QVector3D &point)
+{
+    return QPointF(double(point.x()), double(point.y()));
+}
+
+static double distance(const QPointF &a, const QPointF &b)
+{
+    return hypot(a.x() - b.x(), a.y() - b.y());
+}
+
+// System commands ($) and % are not G-code
+static bool isCommand(const GCodeSource &source, int line)
+{
+    const char *start = source.lineStart(line);
+    size_t size = size_t(source.lineEnd(line) - start);
+    return memchr(start, '$', size) || memchr(start, '%', size);
+}
+
+static bool isComment(const GCodeSource &source, int line)
+{
+    char letter;
+    double value;
+    GCodeTokenizer tokenizer(source.lineStart(line), source.lineEnd(line));
+    return !tokenizer.next(letter, value) && !isCommand(source, line);
+}
+
+// Points in buckets of a regular grid, for nearest point queries
+class PointGrid
+{
+public:
+    explicit PointGrid(const QVector<QPointF> &points);
+
+    // Nearest point not removed, -1 when there is none left
+    int nearest(const QPointF &point);
+    void remove(int index) { active[index] = false; }
+
+    // The count nearest points, removed ones too, nearest first
+    void nearest(const QPointF &point, int count, QVector<int> &result) const;
+
+private:
+    int cell(double value, double min, int size) const { return qBound(0, int((value - min) / cellSize), size - 1); }
+
+    // Cells at distance ring (in cells) of a cell
+    template <typename Visit>
+    void forRing(int x, int y, int ring, Visit visit) const;
+    // Distance from point, in cell (x, y), to the cells after ring : infinite when none
+    double reach(const QPointF &point, int x, int y, int ring) const;
+
+    const QVector<QPointF> &points;
+    QVector<bool> active;
+    QVector< QVector<int> > cells;
+    double minX, minY;
+    double cellSize;
+    int columns, rows;
+};
+
+PointGrid::PointGrid(const QVector<QPointF> &points) :
+    points(points), active(points.size(), true)
+{
+    minX = minY = 0;
+    double maxX = 0, maxY = 0;
+    for (int i = 0; i < points.size(); i++)
+    {
+        const QPointF &point = points.at(i);
+        minX = i ? qMin(minX, point.x()) : point.x();
+        minY = i ? qMin(minY, point.y()) : point.y();
+        maxX = i ? qMax(maxX, point.x()) : point.x();
+        maxY = i ? qMax(maxY, point.y()) : point.y();
+    }
+
+    // About one point per cell
+    double area = (maxX - minX) * (maxY - minY);
+    cellSize = (area > 0) ? sqrt(area / qMax(1, points.size())) : qMax(1.0, qMax(maxX - minX, maxY - minY));
+    columns = qBound(1, int((maxX - minX) / cellSize) + 1, 4096);
+    rows = qBound(1, int((maxY - minY) / cellSize) + 1, 4096);
+
+    cells.resize(columns * rows);
+    for (int i = 0; i < points.size(); i++)
+        cells[cell(points.at(i).y(), minY, rows) * columns + cell(points.at(i).x(), minX, columns)].append(i);
+}
+
+template <typename Visit>
+void PointGrid::forRing(int x, int y, int ring, Visit visit) const
+{
+    for (int row = y - ring; row <= y + ring; row++)
+    {
+        if ((row < 0) || (row >= rows)) continue;
+
+        // Whole first and last rows, the two ends of the others
+        int step = ((row == y - ring) || (row == y + ring)) ? 1 : 2 * ring;
+        for (int column = x - ring; column <= x + ring; column += step)
+            if ((column >= 0) && (column < columns))
+                visit(row * columns + column);
+    }
+}
+
+double PointGrid::reach(const QPointF &point, int x, int y, int ring) const
+{
+    // Rings reaching a side of the grid have nothing beyond it : points out of
+    // the grid, as the start point, are in the first or last cells
+    double result = std::numeric_limits<double>::infinity();
+    if (x - ring > 0) result = qMin(result, point.x() - (minX + (x - ring) * cellSize));
+    if (x + ring < columns - 1) result = qMin(result, minX + (x + ring + 1) * cellSize - point.x());
+    if (y - ring > 0) result = qMin(result, point.y() - (minY + (y - ring) * cellSize));
+    if (y + ring < rows - 1) result = qMin(result, minY + (y + ring + 1) * cellSize - point.y());
+    return result;
+}
+
+int PointGrid::nearest(const QPointF &point)
+{
+    int x = cell(point.x(), minX, columns), y = cell(point.y(), minY, rows);
+    int best = -1;
+    double bestDistance = 0;
+
+    for (int ring = 0; ring <= qMax(columns, rows); ring++)
+    {
+        forRing(x, y, ring, [&](int index) {
+            QVector<int> &bucket = cells[index];
+            for (int i = 0; i < bucket.size(); )
+            {
+                int candidate = bucket.at(i);
+                if (!active.at(candidate))
+                {
+                    // Removed for good
+                    bucket[i] = bucket.last();
+                    bucket.removeLast();
+                    continue;
+                }
+
+                double d = distance(point, points.at(candidate));
+                if ((best < 0) || (d < bestDistance))
+                {
+                    best = candidate;
+                    bestDistance = d;
+                }
+                i++;
+            }
+        });
+
+        // Points of the next rings are farther
+        if ((best >= 0) && (bestDistance <= reach(point, x, y, ring))) break;
+    }
+    return best;
+}
+
+void PointGrid::nearest(const QPointF &point, int count, QVector<int> &result) const
+{
+    int x = cell(point.x(), minX, columns), y = cell(point.y(), minY, rows);
+    QVector<double> distances;
+    result.clear();
+
+    for (int ring = 0; ring <= qMax(columns, rows); ring++)
+    {
+        forRing(x, y, ring, [&](int index) {
+            for (int candidate : cells.at(index))
+            {
+                double d = distance(point, points.at(candidate));
+                if ((result.size() == count) && (d >= distances.last())) continue;
+
+                // Sorted insertion, the list is short
+                int i = result.size();
+                while ((i > 0) && (distances.at(i - 1) > d)) i--;
+                result.insert(i, candidate);
+                distances.insert(i, d);
+                if (result.size() > count)
+                {
+                    result.removeLast();
+                    distances.removeLast();
+                }
+            }
+        });
+
+        if ((result.size() == count) && (distances.last() <= reach(point, x, y, ring))) break;
+    }
+}
+
+GCodeReorderer::GCodeReorderer()
+{
+    clear();
+}
+
+void GCodeReorderer::clear()
+{
+    safeZ = 0;
+    islands.clear();
+    gaps.clear();
+    program.clear();
+    reversedIslands = rotatedIslands = 0;
+    distanceBefore = distanceAfter = 0;
+}
+
+bool GCodeReorderer::reorder(const GCode &gcode, bool reshapePaths)
+{
+    clear();
+
+    const GCodeSource *source = gcode.getSource();
+    if (!source || !gcode.getPointCount()) return false;
+
+    QElapsedTimer timer;
+    timer.start();
+
+    safeZ = clearanceHeight(gcode);
+    scan(gcode, reshapePaths);
+
+    int line = 0;   // Next source line to copy
+    for (int first = 0; first < islands.size(); )
+    {
+        // Movable islands joined by moves at clearance height
+        int last = first;
+        if (islands.at(first).movable)
+            while ((last + 1 < islands.size()) && islands.at(last + 1).movable && gaps.at(last + 1).pure)
+                last++;
+
+        if (last == first)
+        {
+            first++;
+            continue;
+        }
+
+        // What follows may move from where the last island ended : come back to it
+        const Gap &after = gaps.at(last + 1);
+        bool backToEnd = !after.absoluteXY && (after.usesXY || (last + 1 < islands.size()));
+        bool hasEnd = backToEnd || after.absoluteXY;
+        QPointF endPoint = xy(backToEnd ? islands.at(last).exit : after.target);
+
+        // From where the travel to the first island starts
+        const Gap &lead = gaps.at(first);
+        const Island &start = islands.at(first);
+        bool hasLead = (lead.travelLine >= 0);
+        QPointF startPoint = xy(hasLead ? lead.travelStart : start.entry);
+
+        double before = distance(startPoint, xy(start.entry));
+        for (int i = first; i < last; i++)
+            before += distance(xy(islands.at(i).exit), xy(islands.at(i + 1).entry));
+        if (hasEnd) before += distance(xy(islands.at(last).exit), endPoint);
+
+        QVector<int> order;
+        QVector<bool> flipped;
+        QVector<int> rotations;
+        double travel = optimize(first, last, startPoint, hasEnd, endPoint, reshapePaths, order, flipped, rotations);
+
+        distanceBefore += before;
+        if (travel >= before - SAME_POINT)
+        {
+            distanceAfter += before;
+            first = last + 1;
+            continue;
+        }
+        distanceAfter += travel;
+
+        int leadLine = hasLead ? lead.travelLine : start.firstLine;
+        appendLines(*source, line, leadLine);
+
+        QPointF position = startPoint;
+        int motion = hasLead ? lead.travelMotion : start.entryMotion;
+        double feed = hasLead ? lead.travelFeed : start.entryFeed;
+
+        for (int i = 0; i < order.size(); i++)
+        {
+            // Comments between two islands belong to the next one
+            int island = order.at(i);
+            int commentLine = (island > first) ? islands.at(island - 1).lastLine + 1 : leadLine;
+            appendIsland(*source, islands.at(island), flipped.at(i), rotations.at(i), commentLine, position, motion, feed);
+            if (flipped.at(i)) reversedIslands++;
+            if (rotations.at(i)) rotatedIslands++;
+        }
+
+        // Back where and how the source was after the islands
+        const Island &end = islands.at(last);
+        if (backToEnd) appendTravel(position, motion, xy(end.exit));
+        appendState(motion, feed, end.exitMotion, end.exitFeed);
+
+        line = end.lastLine + 1;
+        first = last + 1;
+    }
+
+    if (!line)
+    {
+        program.clear();
+        return false;
+    }
+    appendLines(*source, line, source->lineCount());
+
+    qDebug() << "GCodeReorderer::reorder:" << islands.size() << "islands, rapid distance" << distanceBefore
+             << "->" << distanceAfter << "in" << timer.elapsed() << "ms";
+    return true;
+}
+
+// Level of the Z only moves up to above every feed move in XY, the most common
+// one (the highest of equals) : retracts between cuts. Highest Z without any.
+float GCodeReorderer::clearanceHeight(const GCode &gcode)
+{
+    QMap<float, int> levels;
+    float highestCut = -std::numeric_limits<float>::max();
+
+    ToolpathReader reader = gcode.getReader();
+    bool hasPrevious = false;
+    QVector3D previous;
+    while (reader.next())
+    {
+        const ToolpathBuffer &points = reader.points();
+        for (int i = 0; i < points.size(); i++)
+        {
+            QVector3D point = points.coords(i);
+            if (hasPrevious)
+            {
+                if ((point.x() != previous.x()) || (point.y() != previous.y()))
+                {
+                    if (points.motion(i) != GCode::MotionType::rapidMove)
+                        highestCut = qMax(highestCut, qMax(point.z(), previous.z()));
+                }
+                else if (point.z() > previous.z())
+                    levels[point.z()]++;
+            }
+            previous = point;
+            hasPrevious = true;
+        }
+    }
+
+    float level = gcode.getBoxMax().z();
+    int count = 0;
+    for (auto i = levels.constBegin(); i != levels.constEnd(); ++i)
+        if ((i.key() >= highestCut - UP_TOLERANCE) && (i.value() >= count))
+        {
+            level = i.key();
+            count = i.value();
+        }
+
+    return level;
+}
+
+GCodeReorderer::Gap GCodeReorderer::newGap()
+{
+    Gap gap = Gap();
+    gap.pure = true;
+    gap.travelLine = -1;
+    return gap;
+}
+
+// Passes over one closed loop, vertex by vertex the same at each depth
+bool GCodeReorderer::isLoop(const QVector<Pass> &passes)
+{
+    const Pass &loop = passes.first();
+    if ((loop.cuts.size() < 2) || (distance(xy(loop.start), xy(loop.cuts.last().end)) > SAME_POINT)) return false;
+
+    for (const Pass &pass : passes)
+    {
+        if ((pass.cuts.size() != loop.cuts.size()) || (distance(xy(pass.start), xy(loop.start)) > SAME_POINT))
+            return false;
+
+        for (int i = 0; i < pass.cuts.size(); i++)
+        {
+            const CutMove &move = pass.cuts.at(i), &model = loop.cuts.at(i);
+            if ((distance(xy(move.end), xy(model.end)) > SAME_POINT) || (move.isArc != model.isArc)) return false;
+            if (move.isArc && ((move.clockwise != model.clockwise) || (distance(move.center, model.center) > SAME_POINT)))
+                return false;
+        }
+    }
+
+    return true;
+}
+
+void GCodeReorderer::scan(const GCode &gcode, bool keepCuts)
+{
+    enum { descent, cut, retract };
+
+    const GCodeSource &source = *gcode.getSource();
+    int lineCount = source.lineCount();
+
+    ToolpathReader reader = gcode.getReader();
+    bool hasPoints = reader.next();
+    int point = 0, arc = 0;
+
+    // Modal state, as far as moving lines is concerned
+    int motion = -1;
+    double feed = -1;
+    bool absolute = true;
+
+    // Unknown until the first move
+    QVector3D position;
+    bool isUp = false;
+
+    Island island = Island();
+    bool inIsland = false;
+    bool keep = false;
+    int phase = descent;
+    Gap gap = newGap();
+
+    char letter;
+    double value;
+
+    for (int line = 0; line < lineCount; line++)
+    {
+        int motionBefore = motion;
+        double feedBefore = feed;
+        bool absoluteBefore = absolute;
+        QVector3D start = position;
+        bool startIsUp = isUp;
+
+        GCodeTokenizer tokenizer(source.lineStart(line), source.lineEnd(line));
+        bool onlyMoves = !isCommand(source, line);
+        bool hasX = false, hasY = false;
+        bool hasPlaneWords = false;
+
+        while (tokenizer.next(letter, value))
+        {
+            switch (letter)
+            {
+            case 'X':
+                hasX = true;
+                hasPlaneWords = true;
+                break;
+            case 'Y':
+                hasY = true;
+                hasPlaneWords = true;
+                break;
+            case 'I':
+            case 'J':
+            case 'R':
+                hasPlaneWords = true;
+                break;
+            case 'Z':
+            case 'K':
+            case 'N':
+                break;
+            case 'F':
+                feed = value;
+                break;
+            case 'G':
+                if ((value == 0) || (value == 1) || (value == 2) || (value == 3))
+                {
+                    motion = int(value);
+                    break;
+                }
+                if (value == 90) absolute = true;
+                if (value == 91) absolute = false;
+                onlyMoves = false;
+                break;
+            default:
+                onlyMoves = false;
+            }
+        }
+
+        // Points of the line
+        int count = 0;
+        bool isArc = false;
+        bool allUp = true;
+        bool movesXY = false;
+        ToolpathArc geometry = ToolpathArc();
+        while (hasPoints)
+        {
+            const ToolpathBuffer &points = reader.points();
+            if (point >= points.size())
+            {
+                hasPoints = reader.next();
+                point = arc = 0;
+                continue;
+            }
+            if (points.line(point) > line) break;
+
+            Span<ToolpathArc> arcs = points.arcs();
+            while ((arc < arcs.size()) && (arcs[arc].point < point)) arc++;
+            if ((arc < arcs.size()) && (arcs[arc].point == point))
+            {
+                isArc = true;
+                geometry = arcs[arc];
+            }
+
+            position = points.coords(point);
+            if (position.z() < safeZ - UP_TOLERANCE) allUp = false;
+            if ((position.x() != start.x()) || (position.y() != start.y())) movesXY = true;
+            count++;
+            point++;
+        }
+        if (count) isUp = allUp;
+
+        if (!inIsland)
+        {
+            if (!count || allUp)
+            {
+                if (!onlyMoves) gap.pure = false;
+                bool goesTo = onlyMoves && hasX && hasY && absolute && ((motion == 0) || (motion == 1));
+                if (!gap.absoluteXY && hasPlaneWords && !goesTo) gap.usesXY = true;
+                if (goesTo && !gap.absoluteXY)
+                {
+                    gap.absoluteXY = true;
+                    gap.target = position;
+                }
+
+                bool travels = onlyMoves && absolute && ((motion == 0) || (motion == 1)) && !isArc &&
+                               (position.z() == start.z());
+                if (!travels)
+                    gap.travelLine = -1;
+                else if (movesXY && (gap.travelLine < 0))
+                {
+                    gap.travelLine = line;
+                    gap.travelStart = start;
+                    gap.travelMotion = motionBefore;
+                    gap.travelFeed = feedBefore;
+                }
+                continue;
+            }
+
+            // Leaving clearance height
+            gaps.append(gap);
+            gap = newGap();
+
+            island = Island();
+            island.firstLine = line;
+            island.entry = start;
+            island.entryMotion = motionBefore;
+            island.entryFeed = feedBefore;
+            island.movable = startIsUp && absoluteBefore && ((motionBefore == 0) || (motionBefore == 1));
+            keep = keepCuts;
+            inIsland = true;
+            phase = descent;
+        }
+
+        if (!onlyMoves || !absolute) island.movable = false;
+
+        // Descent and retract lines are kept as they are : Z only. Lines
+        // between them are kept as passes, Z steps and feed moves at one depth.
+        if (count && keep)
+        {
+            bool zOnly = !movesXY && !isArc && !hasPlaneWords;
+            bool step = (count == 1) && !movesXY && !isArc;
+
+            if ((phase == descent) && !zOnly)
+            {
+                phase = cut;
+                island.cutLine = line;
+                island.passes.append(Pass());
+                island.passes.last().start = start;
+            }
+
+            if (phase == cut)
+            {
+                Pass &pass = island.passes.last();
+
+                CutMove move;
+                move.end = position;
+                move.motion = motion;
+                move.feed = feed;
+                move.isArc = isArc;
+                move.clockwise = (geometry.endAngle < geometry.startAngle);
+                move.center = QPointF(double(geometry.centerX), double(geometry.centerY));
+
+                if ((count == 1) && movesXY && (!isArc || (geometry.pitch == 0.0f)))
+                {
+                    if (pass.cuts.isEmpty()) pass.start = start;
+                    if ((start.z() == pass.start.z()) && (position.z() == pass.start.z()))
+                        pass.cuts.append(move);
+                    else
+                        keep = false;
+                }
+                else if (zOnly && !pass.cuts.isEmpty() && (position.z() > pass.start.z()))
+                {
+                    phase = retract;
+                    island.retractLine = line;
+                    island.retractMotion = motionBefore;
+                    island.retractFeed = feedBefore;
+                }
+                else if (step)
+                {
+                    if (!pass.cuts.isEmpty())
+                    {
+                        island.passes.append(Pass());
+                        island.passes.last().start = start;
+                    }
+                    island.passes.last().steps.append(move);
+                }
+                else
+                    keep = false;
+            }
+            else if ((phase == retract) && (!zOnly || (position.z() < start.z())))
+                keep = false;
+        }
+
+        // Back at clearance height
+        if (count && isUp)
+        {
+            island.lastLine = line;
+            island.exit = position;
+            island.exitMotion = motion;
+            island.exitFeed = feed;
+            if ((motion != 0) && (motion != 1)) island.movable = false;
+            keep = keep && island.movable && (phase == retract);
+            for (const Pass &pass : island.passes)
+                if (pass.cuts.isEmpty()) keep = false;
+
+            const Pass *pass = keep ? &island.passes.first() : nullptr;
+            island.reversible = pass && (island.passes.size() == 1) && pass->steps.isEmpty() &&
+                                (distance(xy(pass->start), xy(pass->cuts.last().end)) > SAME_POINT);
+            island.closed = keep && isLoop(island.passes);
+            if (!island.reversible && !island.closed) island.passes.clear();
+
+            islands.append(island);
+            inIsland = false;
+        }
+    }
+
+    // Program ends below clearance height
+    if (inIsland)
+    {
+        island.lastLine = lineCount - 1;
+        island.exit = position;
+        island.exitMotion = motion;
+        island.exitFeed = feed;
+        island.movable = island.reversible = island.closed = false;
+        island.passes.clear();
+        islands.append(island);
+    }
+    gaps.append(gap);
+}
+
+// Order of islands first to last, from the start point, and to the end point
+// when there is one. Rotations are the vertices closed islands start at, 0 where
+// they did. Returns the length of the travels.
+double GCodeReorderer::optimize(int first, int last, const QPointF &startPoint, bool hasEnd, const QPointF &endPoint, bool reshapePaths,
+                                QVector<int> &order, QVector<bool> &flipped, QVector<int> &rotations) const
+{
+    int count = last - first + 1;
+
+    // Entry and exit of each island
+    QVector<QPointF> ends;
+    QVector<bool> canFlip;
+    for (int i = first; i <= last; i++)
+    {
+        ends << xy(islands.at(i).entry) << xy(islands.at(i).exit);
+        canFlip << (reshapePaths && islands.at(i).reversible);
+    }
+
+    QVector<int> tour;
+    QVector<bool> flip(count, false);
+
+    // Nearest neighbour : nearest end of the islands left, exits of reversible ones too
+    PointGrid grid(ends);
+    for (int i = 0; i < count; i++)
+        if (!canFlip.at(i)) grid.remove(2 * i + 1);
+
+    QPointF position = startPoint;
+    for (int i = 0; i < count; i++)
+    {
+        int end = grid.nearest(position);
+        int island = end / 2;
+        tour.append(island);
+        flip[island] = (end % 2 == 1);
+        grid.remove(2 * island);
+        grid.remove(2 * island + 1);
+        position = ends.at(flip.at(island) ? 2 * island : 2 * island + 1);
+    }
+
+    auto entryOf = [&](int island) { return ends.at(2 * island + (flip.at(island) ? 1 : 0)); };
+    auto exitOf = [&](int island) { return ends.at(2 * island + (flip.at(island) ? 0 : 1)); };
+    // Ends once in a reversed part of the tour
+    auto reversedEntryOf = [&](int island) { return canFlip.at(island) ? exitOf(island) : entryOf(island); };
+    auto reversedExitOf = [&](int island) { return canFlip.at(island) ? entryOf(island) : exitOf(island); };
+
+    // Travels between the islands of the tour, in order and reversed, summed from the start
+    QVector<int> place(count);
+    QVector<double> forward(count), backward(count);
+    auto sumTravels = [&]() {
+        forward[0] = backward[0] = 0;
+        for (int i = 0; i < count; i++)
+        {
+            place[tour.at(i)] = i;
+            if (i + 1 == count) break;
+            forward[i + 1] = forward.at(i) + distance(exitOf(tour.at(i)), entryOf(tour.at(i + 1)));
+            backward[i + 1] = backward.at(i) + distance(reversedExitOf(tour.at(i + 1)), reversedEntryOf(tour.at(i)));
+        }
+    };
+    auto travelAfter = [&](int i) {
+        if (i + 1 < count) return distance(exitOf(tour.at(i)), entryOf(tour.at(i + 1)));
+        return hasEnd ? distance(exitOf(tour.at(i)), endPoint) : 0.0;
+    };
+    sumTravels();
+
+    // 2-opt : reversing the islands i + 1 to j, j near the end of i
+    PointGrid neighbourGrid(ends);
+    QVector<int> neighbours;
+    for (int pass = 0; pass < MAX_PASSES; pass++)
+    {
+        bool improved = false;
+        for (int i = -1; i < count - 1; i++)
+        {
+            QPointF from = (i < 0) ? startPoint : exitOf(tour.at(i));
+            neighbourGrid.nearest(from, NEIGHBOURS, neighbours);
+
+            for (int end : neighbours)
+            {
+                int j = place.at(end / 2);
+                if ((j <= i) || ((j == i + 1) && !canFlip.at(tour.at(j)))) continue;
+
+                int next = tour.at(i + 1);
+                double before = distance(from, entryOf(next)) + travelAfter(j) + forward.at(j) - forward.at(i + 1);
+                double after = distance(from, reversedEntryOf(tour.at(j))) + backward.at(j) - backward.at(i + 1);
+                if (j + 1 < count)
+                    after += distance(reversedExitOf(next), entryOf(tour.at(j + 1)));
+                else if (hasEnd)
+                    after += distance(reversedExitOf(next), endPoint);
+
+                if (after < before - SAME_POINT)
+                {
+                    std::reverse(tour.begin() + i + 1, tour.begin() + j + 1);
+                    for (int k = i + 1; k <= j; k++)
+                        if (canFlip.at(tour.at(k))) flip[tour.at(k)] = !flip.at(tour.at(k));
+                    sumTravels();
+                    improved = true;
+                    break;
+                }
+            }
+        }
+        if (!improved) break;
+    }
+
+    // Closed islands entered at the vertex nearest the travel coming in, and leading to the next island
+    QVector<int> rotation(count, 0);
+    auto vertexOf = [&](int island) {
+        if (!rotation.at(island)) return entryOf(island);
+        return xy(islands.at(first + island).passes.first().cuts.at(rotation.at(island) - 1).end);
+    };
+
+    double travel = 0;
+    position = startPoint;
+    for (int i = 0; i < count; i++)
+    {
+        int island = tour.at(i);
+        if (reshapePaths && islands.at(first + island).closed)
+        {
+            bool hasNext = (i + 1 < count) || hasEnd;
+            QPointF next = (i + 1 < count) ? entryOf(tour.at(i + 1)) : endPoint;
+            auto length = [&](const QPointF &vertex) {
+                return distance(position, vertex) + (hasNext ? distance(vertex, next) : 0.0);
+            };
+
+            const Pass &loop = islands.at(first + island).passes.first();
+            double shortest = length(entryOf(island));
+            for (int k = 1; k < loop.cuts.size(); k++)
+            {
+                double candidate = length(xy(loop.cuts.at(k - 1).end));
+                if (candidate < shortest - SAME_POINT)
+                {
+                    shortest = candidate;
+                    rotation[island] = k;
+                }
+            }
+        }
+
+        travel += distance(position, vertexOf(island));
+        position = rotation.at(island) ? vertexOf(island) : exitOf(island);
+    }
+    if (hasEnd) travel += distance(position, endPoint);
+
+    order.clear();
+    flipped.clear();
+    rotations.clear();
+    for (int island : tour)
+    {
+        order.append(first + island);
+        flipped.append(flip.at(island));
+        rotations.append(rotation.at(island));
+    }
+
+    return travel;
+}
+
+void GCodeReorderer::appendLines(const GCodeSource &source, int first, int end)
+{
+    for (int line = first; line < end; line++)
+    {
+        program.append(source.lineStart(line), int(source.lineEnd(line) - source.lineStart(line)));
+        program.append('\n');
+    }
+}
+
+void GCodeReorderer::appendTravel(QPointF &position, int &motion, const QPointF &target)
+{
+    if (distance(position, target) <= SAME_POINT) return;
+
+    program += "G0 X" + number(target.x()) + " Y" + number(target.y()) + '\n';
+    position = target;
+    motion = 0;
+}
+
+void GCodeReorderer::appendState(int &motion, double &feed, int targetMotion, double targetFeed)
+{
+    QByteArray words;
+    if ((targetMotion >= 0) && (targetMotion != motion))
+    {
+        words += "G" + QByteArray::number(targetMotion);
+        motion = targetMotion;
+    }
+    if ((targetFeed > 0) && (targetFeed != feed))
+    {
+        words += QByteArray(words.isEmpty() ? "" : " ") + "F" + number(targetFeed);
+        feed = targetFeed;
+    }
+
+    if (!words.isEmpty())
+        program += words + '\n';
+}
+
+// Feed move of a kept cut, from one vertex to another : reversed, arcs turn the other way
+void GCodeReorderer::appendCut(const CutMove &move, bool reversed, const QVector3D &from, const QVector3D &to,
+                               int &motion, double &feed)
+{
+    int code = move.isArc ? ((move.clockwise != reversed) ? 2 : 3) : move.motion;
+
+    QByteArray text;
+    if (code != motion) text += "G" + QByteArray::number(code) + " ";
+    text += "X" + number(double(to.x())) + " Y" + number(double(to.y()));
+    if (move.isArc)
+        text += " I" + number(move.center.x() - double(from.x())) +
+                " J" + number(move.center.y() - double(from.y()));
+    if (code && (move.feed > 0) && (move.feed != feed))
+    {
+        text += " F" + number(move.feed);
+        feed = move.feed;
+    }
+    program += text + '\n';
+    motion = code;
+}
+
+void GCodeReorderer::appendIsland(const GCodeSource &source, const Island &island, bool flip, int rotation, int commentLine,
+                                  QPointF &position, int &motion, double &feed)
+{
+    for (int line = commentLine; line < island.firstLine; line++)
+        if (isComment(source, line)) appendLines(source, line, line + 1);
+
+    // Where the passes start and end
+    QPointF vertex = xy(island.entry);
+    if (flip) vertex = xy(island.exit);
+    if (rotation) vertex = xy(island.passes.first().cuts.at(rotation - 1).end);
+
+    appendTravel(position, motion, vertex);
+    appendState(motion, feed, island.entryMotion, island.entryFeed);
+
+    if (!flip && !rotation)
+    {
+        appendLines(source, island.firstLine, island.lastLine + 1);
+        position = xy(island.exit);
+    }
+    else
+    {
+        // Descent at the vertex, the passes from it, retract there
+        appendLines(source, island.firstLine, island.cutLine);
+        for (int line = island.cutLine; line < island.retractLine; line++)
+            if (isComment(source, line)) appendLines(source, line, line + 1);
+
+        int cutMotion = -1;
+        double cutFeed = -1;
+        for (const Pass &pass : island.passes)
+        {
+            for (const CutMove &step : pass.steps)
+            {
+                QByteArray text;
+                if (step.motion != cutMotion) text += "G" + QByteArray::number(step.motion) + " ";
+                text += "Z" + number(double(step.end.z()));
+                if (step.motion && (step.feed > 0) && (step.feed != cutFeed))
+                {
+                    text += " F" + number(step.feed);
+                    cutFeed = step.feed;
+                }
+                program += text + '\n';
+                cutMotion = step.motion;
+            }
+
+            int count = pass.cuts.size();
+            if (flip)
+                for (int i = count - 1; i >= 0; i--)
+                    appendCut(pass.cuts.at(i), true, pass.cuts.at(i).end, i ? pass.cuts.at(i - 1).end : pass.start,
+                              cutMotion, cutFeed);
+            else
+                for (int k = 0; k < count; k++)
+                {
+                    int i = (rotation + k) % count;
+                    appendCut(pass.cuts.at(i), false, i ? pass.cuts.at(i - 1).end : pass.start, pass.cuts.at(i).end,
+                              cutMotion, cutFeed);
+                }
+        }
+
+        motion = cutMotion;
+        feed = cutFeed;
+        appendState(motion, feed, island.retractMotion, island.retractFeed);
+        appendLines(source, island.retractLine, island.lastLine + 1);
+        position = flip ? xy(island.entry) : vertex;
+    }
+
+    motion = island.exitMotion;
+    feed = island.exitFeed;
+}
@@ -0,0 +1,124 @@
+#ifndef GCODEREORDERER_H
+#define GCODEREORDERER_H
+
+#include <QByteArray>
+#include <QPointF>
+#include <QVector>
+
+#include "gcode.h"
+
+// Cuts a program in islands : from the line leaving the clearance height (the
+// level the program retracts to between cuts) to the line going back to it. Islands made of
+// moves only (G0 to G3, axis and feed words), joined by moves at clearance
+// height, are sent in another order to shorten the rapid moves between them :
+// nearest neighbour, then 2-opt, both on a grid of the island ends.
+// Open islands cutting at one depth can also be reversed (their cutting direction changes),
+// closed ones cut over the same loop at each depth can start at another vertex of it.
+// Moves between the moved islands are replaced by G0 at clearance height,
+// comments follow their island. Other lines are barriers : islands don't
+// cross them, and the program is back where it was before them.
+
+class GCodeReorderer
+{
+public:
+    GCodeReorderer();
+
+    void clear();
+
+    // Source of gcode must be there. Returns false when no rapid move is saved.
+    // reshapePaths : reverse open islands, rotate closed ones
+    bool reorder(const GCode &gcode, bool reshapePaths);
+
+    // Whole program, islands reordered
+    const QByteArray &getProgram() const { return program; }
+
+    int getIslands() const { return islands.size(); }
+    int getReversedIslands() const { return reversedIslands; }
+    int getRotatedIslands() const { return rotatedIslands; }
+    // XY distance of the moves between reordered islands, program units
+    double getRapidDistanceBefore() const { return distanceBefore; }
+    double getRapidDistanceAfter() const { return distanceAfter; }
+
+private:
+    // Move of a kept cut : feed move at the depth of its pass, or Z step before it
+    struct CutMove
+    {
+        QVector3D end;
+        int motion;
+        double feed;
+        bool isArc;
+        bool clockwise;
+        QPointF center;
+    };
+
+    // Cut at one depth, after the Z steps reaching it
+    struct Pass
+    {
+        QVector3D start;
+        QVector<CutMove> steps;
+        QVector<CutMove> cuts;
+    };
+
+    struct Island
+    {
+        int firstLine;
+        int lastLine;
+        QVector3D entry, exit;          // Points at clearance height before and after
+        int entryMotion, exitMotion;    // G0 to G3, -1 unknown
+        double entryFeed, exitFeed;
+        bool movable;
+
+        // Descent, passes, retract : the passes can be written reversed (one
+        // open pass) or from another vertex (the same closed loop at each depth)
+        bool reversible;
+        bool closed;
+        int cutLine;
+        int retractLine;
+        int retractMotion;
+        double retractFeed;
+        QVector<Pass> passes;
+    };
+
+    // Lines before an island (or after the last one)
+    struct Gap
+    {
+        bool pure;          // Moves at clearance height and comments only
+        bool absoluteXY;    // Goes somewhere whatever the previous position
+        QVector3D target;   // There
+        bool usesXY;        // Moves from the previous position before that
+
+        // Moves in XY at clearance height ending the gap, -1 none : replaced by the travel to the islands
+        int travelLine;
+        QVector3D travelStart;
+        int travelMotion;
+        double travelFeed;
+    };
+
+    static Gap newGap();
+    static float clearanceHeight(const GCode &gcode);
+    static bool isLoop(const QVector<Pass> &passes);
+
+    void scan(const GCode &gcode, bool keepCuts);
+    double optimize(int first, int last, const QPointF &startPoint, bool hasEnd, const QPointF &endPoint, bool reshapePaths,
+                    QVector<int> &order, QVector<bool> &flipped, QVector<int> &rotations) const;
+
+    void appendLines(const GCodeSource &source, int first, int end);
+    void appendTravel(QPointF &position, int &motion, const QPointF &target);
+    void appendState(int &motion, double &feed, int targetMotion, double targetFeed);
+    void appendCut(const CutMove &move, bool reversed, const QVector3D &from, const QVector3D &to,
+                   int &motion, double &feed);
+    void appendIsland(const GCodeSource &source, const Island &island, bool flip, int rotation, int commentLine,
+                      QPointF &position, int &motion, double &feed);
+
+    float safeZ;
+    QVector<Island> islands;
+    QVector<Gap> gaps;
+
+    QByteArray program;
+    int reversedIslands;
+    int rotatedIslands;
+    double distanceBefore;
+    double distanceAfter;
+};
+
+#endif // GCODEREORDERER_H
@@ -0,0 +1,445 @@
+#include "gcodesimplifier.h"
+
+#include <QDebug>
+#include <QElapsedTimer>
+#include <QtConcurrent>
+#include <cmath>
+#include <cstring>
+#include "gcodetokenizer.h"
+
+// Longest run of moves merged in one, bounds the cost of the tolerance test
+#define MAX_MERGED_MOVES 128
+
+// Fewer moves are not worth an arc
+#define MIN_ARC_MOVES 3
+// Larger circles are lines for the machine, and their center loses precision
+#define MAX_ARC_RADIUS 5000.0
+
+static float distanceToSegment(const QVector3D &point, const QVector3D &start, const QVector3D &end)
+{
+    QVector3D segment = end - start;
+    float lengthSquared = QVector3D::dotProduct(segment, segment);
+    float t = (lengthSquared > 0) ? qBound(0.0f, QVector3D::dotProduct(point - start, segment) / lengthSquared, 1.0f) : 0.0f;
+    return (point - (start + t * segment)).length();
+}
+
+// Bytes sent by the streamer : N and line number, the line and its line feed
+static int streamedBytes(const GCodeSource &source, int line)
+{
+    return 1 + QByteArray::number(line + 1).size() + int(source.lineEnd(line) - source.lineStart(line)) + 1;
+}
+
+// No system command ($) nor %. Lines without G-code words are only spaces and
+// comments when this holds : callers check the words themselves.
+static bool hasNoSystemCommand(const GCodeSource &source, int line)
+{
+    const char *start = source.lineStart(line);
+    size_t size = size_t(source.lineEnd(line) - start);
+    return !memchr(start, '$', size) && !memchr(start, '%', size);
+}
+
+static QByteArray word(char letter, double value)
+{
+    return ' ' + QByteArray(1, letter) + QByteArray::number(value, 'f', 4);
+}
+
+// G0 to G3 of the modal motion, -1 for the others
+static int motionCode(int motion)
+{
+    switch (motion)
+    {
+    case GCode::MotionType::rapidMove: return 0;
+    case GCode::MotionType::feedMove: return 1;
+    case GCode::MotionType::clockwiseArcMove: return 2;
+    case GCode::MotionType::counterClockwiseArcMove: return 3;
+    }
+    return -1;
+}
+
+static void drop(const GCodeSource &source, int line, QVector<int> &dropped, qint64 &savedBytes)
+{
+    dropped.append(line);
+    savedBytes += streamedBytes(source, line);
+}
+
+GCodeSimplifier::GCodeSimplifier()
+{
+    clear();
+}
+
+void GCodeSimplifier::clear()
+{
+    dropped.clear();
+    rewritten.clear();
+    arcLines.clear();
+    droppedLines = 0;
+    savedBytes = 0;
+}
+
+void GCodeSimplifier::simplify(const GCode &gcode, double tolerance, bool fitArcs)
+{
+    clear();
+
+    const GCodeSource *source = gcode.getSource();
+    if (!source || gcode.checkpoints.isEmpty()) return;
+
+    QElapsedTimer timer;
+    timer.start();
+
+    int nbChunks = gcode.checkpoints.size();
+    QVector<int> indexes;
+    for (int i = 0; i < nbChunks; i++) indexes.append(i);
+
+    QVector<Result> results(nbChunks);
+    Result *resultData = results.data();
+
+    QtConcurrent::blockingMap(indexes, [&gcode, tolerance, fitArcs, resultData](int i) {
+        simplifyChunk(gcode, i, float(tolerance), fitArcs, resultData[i]);
+    });
+
+    dropped.resize(source->lineCount());
+    for (const Result &result : results)
+    {
+        for (int line : result.dropped)
+            dropped.setBit(line);
+        droppedLines += result.dropped.size();
+
+        for (QHash<int, QByteArray>::const_iterator text = result.rewritten.constBegin();
+             text != result.rewritten.constEnd(); ++text)
+            rewritten.insert(text.key(), text.value());
+
+        arcLines += result.arcLines;
+        savedBytes += result.savedBytes;
+    }
+    restoreMotion(*source);
+
+    qDebug() << "GCodeSimplifier::simplify:" << droppedLines << "lines," << arcLines.size() << "arcs,"
+             << savedBytes << "bytes saved in" << timer.elapsed() << "ms";
+}
+
+void GCodeSimplifier::simplifyChunk(const GCode &gcode, int chunk, float tolerance, bool fitArcs, Result &result)
+{
+    const GCodeSource &source = *gcode.source;
+    int firstLine, lastLine, firstPoint, lastPoint;
+    gcode.chunkBounds(chunk, firstLine, lastLine, firstPoint, lastPoint);
+
+    ToolpathBuffer decoded;
+    int offset;
+    const ToolpathBuffer &points = gcode.chunkPoints(firstPoint, lastPoint, decoded, offset);
+    Span<qint32> lines = points.lines();
+    Span<ToolpathArc> arcs = points.arcs();
+    int point = firstPoint - offset;
+    int end = lastPoint - offset;
+    int arc = points.arcIndex(point);
+
+    // Modal state, as far as dropping lines is concerned. Position is unknown at the start.
+    const GCode::ModalState &state = gcode.checkpoints.at(chunk).state;
+    int motion = motionCode(state.motion);
+    double feed = chunk ? double(state.feed) : -1;
+    bool absolute = (state.mode == GCode::ModeType::absolute);
+    int plane = state.plane;
+
+    bool hasPosition = (chunk > 0);
+    QVector3D position = state.position;    // After the previous line
+    QVector3D start = position;             // Last point sent
+    QVector<Move> run;                      // Moves after the start, simplified when the run ends
+    bool feedRun = false;
+    bool xyRun = false;                     // Arcs fitted are G17 arcs
+
+    auto endRun = [&]() {
+        simplifyRun(source, start, run, feedRun, tolerance, fitArcs && xyRun, result);
+        run.clear();
+    };
+
+    char letter;
+    double value;
+
+    for (int line = firstLine; line < lastLine; line++)
+    {
+        // Points of the line
+        int count = 0;
+        bool isArc = false;
+        QVector3D target;
+        for (; (point < end) && (lines[point] <= line); point++)
+        {
+            while ((arc < arcs.size()) && (arcs[arc].point < point)) arc++;
+            if ((arc < arcs.size()) && (arcs[arc].point == point)) isArc = true;
+
+            target = points.coords(point);
+            count++;
+        }
+
+        // A line can be dropped when it only moves
+        GCodeTokenizer tokenizer(source.lineStart(line), source.lineEnd(line));
+        bool hasWords = false;
+        bool onlyMoves = true;
+        int axes = 0;
+
+        while (tokenizer.next(letter, value))
+        {
+            hasWords = true;
+            switch (letter)
+            {
+            case 'X':
+            case 'Y':
+            case 'Z':
+                axes |= bit(letter - 'X');
+                break;
+            case 'N':
+                break;
+            case 'G':
+                if ((value == 0) || (value == 1) || (value == 2) || (value == 3))
+                {
+                    if (int(value) != motion) onlyMoves = false;
+                    motion = int(value);
+                }
+                else
+                {
+                    if (value == 90) absolute = true;
+                    if (value == 91) absolute = false;
+                    if ((value == 17) || (value == 18) || (value == 19)) plane = int(value) - 17;
+                    onlyMoves = false;
+                }
+                break;
+            case 'F':
+                if (value != feed) onlyMoves = false;
+                feed = value;
+                break;
+            default:
+                onlyMoves = false;
+            }
+        }
+
+        if (!hasWords)
+        {
+            if (hasNoSystemCommand(source, line)) drop(source, line, result.dropped, result.savedBytes);
+            continue;
+        }
+
+        bool isLinearMove = onlyMoves && absolute && (count == 1) && !isArc && ((motion == 0) || (motion == 1));
+
+        if (!isLinearMove || !hasPosition)
+        {
+            // Sent as it is, moves can't be merged across it
+            endRun();
+            if (count)
+            {
+                position = target;
+                hasPosition = true;
+            }
+            start = position;
+            continue;
+        }
+
+        // Going nowhere
+        if (target == position)
+        {
+            drop(source, line, result.dropped, result.savedBytes);
+            continue;
+        }
+
+        Move move;
+        move.line = line;
+        move.end = target;
+        move.axes = axes;
+        run.append(move);
+        feedRun = (motion == 1);
+        xyRun = (plane == GCode::PlaneType::xy);
+        position = target;
+    }
+    endRun();
+}
+
+// Run of moves from start, split in lines and arcs within tolerance
+void GCodeSimplifier::simplifyRun(const GCodeSource &source, const QVector3D &runStart, const QVector<Move> &moves,
+                                  bool feedMoves, float tolerance, bool fitArcs, Result &result)
+{
+    QVector3D start = runStart;
+
+    for (int first = 0; first < moves.size(); )
+    {
+        int last = lineEnd(start, moves, first, tolerance);
+
+        QPointF center;
+        bool clockwise = false;
+        int lastArc = (fitArcs && feedMoves) ? arcEnd(start, moves, first, tolerance, center, clockwise) : -1;
+        if (lastArc > last) last = lastArc;
+
+        for (int i = first; i < last; i++)
+            drop(source, moves.at(i).line, result.dropped, result.savedBytes);
+
+        const Move &move = moves.at(last);
+        QByteArray text;
+
+        if (last == lastArc)
+        {
+            // Center is relative to the start (G91.1, the default)
+            text = QByteArray(clockwise ? "G2" : "G3") + word('X', double(move.end.x())) + word('Y', double(move.end.y()))
+                   + word('I', center.x() - double(start.x())) + word('J', center.y() - double(start.y()));
+            result.arcLines.append(move.line);
+        }
+        else
+        {
+            // Axes the last move took from dropped ones are written in it
+            QByteArray words;
+            for (int axis = 0; axis < 3; axis++)
+                if (!(move.axes & bit(axis)) && (start[axis] != move.end[axis]))
+                    words += word(char('X' + axis), double(move.end[axis]));
+
+            if (!words.isEmpty())
+            {
+                text = source.line(move.line);
+                int comment = text.indexOf(';');
+                if (comment >= 0) text.truncate(comment);
+                text += words;
+            }
+        }
+
+        if (!text.isEmpty())
+        {
+            result.rewritten.insert(move.line, text);
+            result.savedBytes -= text.size() - int(source.lineEnd(move.line) - source.lineStart(move.line));
+        }
+
+        start = move.end;
+        first = last + 1;
+    }
+}
+
+// Last move of the longest run from first within tolerance of the segment from start
+int GCodeSimplifier::lineEnd(const QVector3D &start, const QVector<Move> &moves, int first, float tolerance)
+{
+    int last = first;
+    int end = qMin(moves.size(), first + MAX_MERGED_MOVES);
+
+    for (int candidate = first + 1; candidate < end; candidate++)
+    {
+        const QVector3D &target = moves.at(candidate).end;
+        for (int i = first; i < candidate; i++)
+            if (distanceToSegment(moves.at(i).end, start, target) > tolerance)
+                return last;
+        last = candidate;
+    }
+    return last;
+}
+
+// Last move of the longest run from first on an arc from start, -1 when there is none
+int GCodeSimplifier::arcEnd(const QVector3D &start, const QVector<Move> &moves, int first, float tolerance,
+                            QPointF &center, bool &clockwise)
+{
+    int last = -1;
+    int end = qMin(moves.size(), first + MAX_MERGED_MOVES);
+
+    for (int candidate = first + MIN_ARC_MOVES - 1; candidate < end; candidate++)
+    {
+        QPointF candidateCenter;
+        bool candidateClockwise;
+        if (!fitArc(start, moves, first, candidate, tolerance, candidateCenter, candidateClockwise))
+            break;
+
+        last = candidate;
+        center = candidateCenter;
+        clockwise = candidateClockwise;
+    }
+    return last;
+}
+
+// Moves first to last on the circle through start, the middle point and the end :
+// points and middles of the segments within tolerance, same Z, turning one way for less than a turn
+bool GCodeSimplifier::fitArc(const QVector3D &start, const QVector<Move> &moves, int first, int last, float tolerance,
+                             QPointF &center, bool &clockwise)
+{
+    const QVector3D &middle = moves.at((first + last - 1) / 2).end;
+    const QVector3D &end = moves.at(last).end;
+
+    // Relative to the start, for precision
+    double bx = double(middle.x() - start.x()), by = double(middle.y() - start.y());
+    double cx = double(end.x() - start.x()), cy = double(end.y() - start.y());
+    double d = 2.0 * (bx * cy - by * cx);
+    if (d == 0.0) return false;
+
+    double b2 = bx * bx + by * by, c2 = cx * cx + cy * cy;
+    double ux = (cy * b2 - by * c2) / d;
+    double uy = (bx * c2 - cx * b2) / d;
+    double radius = sqrt(ux * ux + uy * uy);
+    if (radius > MAX_ARC_RADIUS) return false;
+
+    double centerX = double(start.x()) + ux, centerY = double(start.y()) + uy;
+    double travel = 0;
+    QVector3D previous = start;
+
+    for (int i = first; i <= last; i++)
+    {
+        const QVector3D &point = moves.at(i).end;
+        if (point.z() != start.z()) return false;
+
+        double px = double(point.x()) - centerX, py = double(point.y()) - centerY;
+        double qx = double(previous.x()) - centerX, qy = double(previous.y()) - centerY;
+        double mx = (px + qx) / 2.0, my = (py + qy) / 2.0;
+
+        if ((qAbs(sqrt(px * px + py * py) - radius) > double(tolerance)) ||
+            (qAbs(sqrt(mx * mx + my * my) - radius) > double(tolerance)))
+            return false;
+
+        double angle = atan2(qx * py - qy * px, qx * px + qy * py);
+        if ((angle == 0.0) || ((i > first) && ((angle > 0) != (travel > 0))))
+            return false;
+
+        travel += angle;
+        previous = point;
+    }
+
+    // A whole turn ends where it starts : the arc would be ambiguous
+    if (qAbs(travel) >= 2.0 * M_PI - 0.01) return false;
+
+    center = QPointF(centerX, centerY);
+    clockwise = (travel < 0);
+    return true;
+}
+
+// After an arc, the source goes on in G1 : it is set again on the next line sent.
+// G1 can't share a line with G10, G28, G30, G92 (axis words of their own), nor be on $ and % lines.
+void GCodeSimplifier::restoreMotion(const GCodeSource &source)
+{
+    char letter;
+    double value;
+
+    for (int i = 0; i < arcLines.size(); i++)
+    {
+        int next = (i + 1 < arcLines.size()) ? arcLines.at(i + 1) : source.lineCount();
+
+        for (int line = arcLines.at(i) + 1; line < next; line++)
+        {
+            if (isDropped(line) || !hasNoSystemCommand(source, line)) continue;
+
+            QByteArray text = this->line(source, line);
+            GCodeTokenizer tokenizer(text.constData(), text.constData() + text.size());
+            bool hasWords = false;
+            bool hasMotion = false;
+            bool hasAxisCommand = false;
+
+            while (tokenizer.next(letter, value))
+            {
+                hasWords = true;
+                if (letter != 'G') continue;
+
+                int code = int(value);
+                if ((code <= 3) || (code == 38) || (code == 80)) hasMotion = true;
+                if ((code == 10) || (code == 28) || (code == 30) || (code == 92)) hasAxisCommand = true;
+            }
+
+            if (hasMotion) break;
+            if (!hasWords || hasAxisCommand) continue;
+
+            rewritten.insert(line, "G1 " + text);
+            savedBytes -= 3;
+            break;
+        }
+    }
+}
+
+QByteArray GCodeSimplifier::line(const GCodeSource &source, int line) const
+{
+    QHash<int, QByteArray>::const_iterator text = rewritten.constFind(line);
+    return (text != rewritten.constEnd()) ? *text : source.line(line);
+}
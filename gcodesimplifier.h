@@ -0,0 +1,78 @@
+#ifndef GCODESIMPLIFIER_H
+#define GCODESIMPLIFIER_H
+
+#include <QBitArray>
+#include <QHash>
+#include <QByteArray>
+#include <QPointF>
+#include <QVector>
+
+#include "gcode.h"
+
+// Lines of a parsed program not worth sending : each line costs a round trip
+// and a planner block. Dropped lines are
+// - moves going nowhere (zero length) and lines without words,
+// - linear moves whose end is within tolerance of the segment merging them
+//   with the previous and next moves,
+// - feed moves of a polyline lying on a circle within tolerance : the last
+//   one is sent as a G2 / G3 arc (same Z), under G17 only.
+// Only lines made of X, Y, Z words (and of G0, G1, F repeating the modal state)
+// are dropped, in absolute mode. The line ending a merged run gets the axis
+// words it relied on from dropped lines, the first line after an arc gets G1 back.
+// The source is not changed : the streamer skips dropped lines.
+// Chunks of the parse are simplified in parallel, runs of moves don't cross them.
+
+class GCodeSimplifier
+{
+public:
+    GCodeSimplifier();
+
+    void clear();
+    bool isEmpty() const { return !droppedLines; }
+
+    // Tolerance is in program units. Source of gcode must be there.
+    void simplify(const GCode &gcode, double tolerance, bool fitArcs = true);
+
+    bool isDropped(int line) const { return (line < dropped.size()) && dropped.testBit(line); }
+    // Text to send for a line kept, from the source or rewritten
+    QByteArray line(const GCodeSource &source, int line) const;
+
+    int getDroppedLines() const { return droppedLines; }
+    int getFittedArcs() const { return arcLines.size(); }
+    // Bytes not streamed, with the line numbers added by the streamer
+    qint64 getSavedBytes() const { return savedBytes; }
+
+private:
+    struct Move
+    {
+        int line;
+        QVector3D end;
+        int axes;       // Axis words of the line, one bit per axis
+    };
+
+    struct Result
+    {
+        QVector<int> dropped;
+        QHash<int, QByteArray> rewritten;
+        QVector<int> arcLines;
+        qint64 savedBytes = 0;
+    };
+
+    static void simplifyChunk(const GCode &gcode, int chunk, float tolerance, bool fitArcs, Result &result);
+    static void simplifyRun(const GCodeSource &source, const QVector3D &start, const QVector<Move> &moves,
+                            bool feedMoves, float tolerance, bool fitArcs, Result &result);
+    static int lineEnd(const QVector3D &start, const QVector<Move> &moves, int first, float tolerance);
+    static int arcEnd(const QVector3D &start, const QVector<Move> &moves, int first, float tolerance,
+                      QPointF &center, bool &clockwise);
+    static bool fitArc(const QVector3D &start, const QVector<Move> &moves, int first, int last, float tolerance,
+                       QPointF &center, bool &clockwise);
+    void restoreMotion(const GCodeSource &source);
+
+    QBitArray dropped;
+    QHash<int, QByteArray> rewritten;
+    QVector<int> arcLines;
+    int droppedLines;
+    qint64 savedBytes;
+};
+
+#endif // GCODESIMPLIFIER_H
@@ -0,0 +1,176 @@
+#include "gcodesource.h"
+
+#include <QDebug>
+#include <cstring>
+
+GCodeSource::GCodeSource()
+{
+    map = nullptr;
+    bytes = nullptr;
+    length = 0;
+    offsets.append(0);
+}
+
+GCodeSource::~GCodeSource()
+{
+    close();
+}
+
+bool GCodeSource::open(const QString &fileName)
+{
+    close();
+
+    file.setFileName(fileName);
+    if (!file.open(QFile::ReadOnly))
+    {
+        qDebug() << "GCodeSource::open: Can't open file" << fileName;
+        return false;
+    }
+
+    // Line offsets are 32 bits
+    if (file.size() > 0xFFFFFFFFLL)
+    {
+        qDebug() << "GCodeSource::open: File too big" << fileName;
+        file.close();
+        return false;
+    }
+
+    this->fileName = fileName;
+    length = file.size();
+
+    if (length)
+    {
+        map = file.map(0, length);
+        if (!map)
+        {
+            // Some devices can't be mapped, read them instead
+            qDebug() << "GCodeSource::open: Can't map file, reading it" << fileName;
+            buffer = file.readAll();
+        }
+    }
+
+    bytes = map ? reinterpret_cast<const char *>(map) : buffer.constData();
+
+    indexLines();
+    return true;
+}
+
+void GCodeSource::setData(const QByteArray &data)
+{
+    QString name = fileName;
+    close();
+    fileName = name;
+
+    buffer = data;
+    bytes = buffer.constData();
+    length = buffer.size();
+
+    indexLines();
+}
+
+void GCodeSource::close()
+{
+    if (map)
+    {
+        file.unmap(map);
+        map = nullptr;
+    }
+    if (file.isOpen())
+        file.close();
+
+    fileName.clear();
+    buffer.clear();
+    bytes = nullptr;
+    length = 0;
+
+    offsets.clear();
+    offsets.append(0);
+}
+
+void GCodeSource::indexLines()
+{
+    offsets.clear();
+
+    // A rough estimation of the line count avoids most reallocations
+    offsets.reserve(int(length / 24) + 2);
+
+    const char *cursor = bytes;
+    const char *end = bytes + length;
+
+    offsets.append(0);
+    while (cursor < end)
+    {
+        const char *lineFeed = static_cast<const char *>(memchr(cursor, '\n', size_t(end - cursor)));
+        if (!lineFeed) break;
+        cursor = lineFeed + 1;
+        offsets.append(quint32(cursor - bytes));
+    }
+
+    // Last line has no line feed, it is empty when data ends with one
+    offsets.append(quint32(length));
+}
+
+void GCodeSource::replaceLines(int first, int count, const QByteArray &text)
+{
+    if (map)
+    {
+        // Mapped file is read only
+        buffer = QByteArray(bytes, int(length));
+        file.unmap(map);
+        map = nullptr;
+        file.close();
+    }
+
+    quint32 start = offsets.at(first);
+    quint32 end = offsets.at(first + count);
+
+    // Lines removed up to the end have no line feed to keep
+    QByteArray insertion = text;
+    if (first + count < lineCount())
+        insertion.append('\n');
+
+    buffer.replace(int(start), int(end - start), insertion);
+    bytes = buffer.constData();
+    length = buffer.size();
+
+    // Lines before are unchanged, lines after are shifted
+    quint32 diff = quint32(insertion.size()) - (end - start);
+
+    QVector<quint32> updated;
+    updated.reserve(offsets.size() + text.count('\n'));
+    for (int i = 0; i <= first; i++)
+        updated.append(offsets.at(i));
+
+    // Start of the new lines, the one after them is in shifted offsets
+    const char *cursor = text.constData();
+    const char *textEnd = cursor + text.size();
+    while (cursor < textEnd)
+    {
+        const char *lineFeed = static_cast<const char *>(memchr(cursor, '\n', size_t(textEnd - cursor)));
+        if (!lineFeed) break;
+        cursor = lineFeed + 1;
+        updated.append(start + quint32(cursor - text.constData()));
+    }
+
+    for (int i = first + count; i < offsets.size(); i++)
+        updated.append(offsets.at(i) + diff);
+
+    offsets = updated;
+}
+
+const char *GCodeSource::lineEnd(int index) const
+{
+    const char *start = bytes + offsets.at(index);
+    const char *end = bytes + offsets.at(index + 1);
+
+    // Remove line feed (and carriage return) from the view
+    if ((end > start) && (end[-1] == '\n')) end--;
+    if ((end > start) && (end[-1] == '\r')) end--;
+    return end;
+}
+
+QByteArray GCodeSource::line(int index) const
+{
+    const char *start = lineStart(index);
+    return QByteArray::fromRawData(start, int(lineEnd(index) - start));
+}
@@ -0,0 +1,57 @@
+#ifndef GCODESOURCE_H
+#define GCODESOURCE_H
+
+#include <QByteArray>
+#include <QFile>
+#include <QVector>
+
+// Text of a G-code program, shared by the editor, the parser and the streamer.
+// A file is memory mapped, editor text is kept in one QByteArray. In both
+// cases the start of each line is indexed once, and lines are given back as
+// views on the data (QByteArray::fromRawData) : nothing is copied.
+
+class GCodeSource
+{
+public:
+    GCodeSource();
+    ~GCodeSource();
+
+    bool open(const QString &fileName);
+    void setData(const QByteArray &data);
+    void close();
+
+    // Replace count lines from first by text ('\n' separated lines, without the last
+    // line feed). A mapped file is copied to memory on first change.
+    void replaceLines(int first, int count, const QByteArray &text);
+
+    bool isEmpty() const { return !length; }
+    const QString &getFileName() const { return fileName; }
+
+    const char *data() const { return bytes; }
+    qint64 size() const { return length; }
+
+    // As in an editor, a program ending with a line feed ends with an empty line
+    int lineCount() const { return offsets.size() - 1; }
+
+    // Line without its line feed. The view is only valid while the source
+    // is not closed or changed.
+    QByteArray line(int index) const;
+    const char *lineStart(int index) const { return bytes + offsets.at(index); }
+    const char *lineEnd(int index) const;
+
+private:
+    void indexLines();
+
+    QString fileName;
+    QFile file;
+    uchar *map;
+    QByteArray buffer;
+
+    const char *bytes;
+    qint64 length;
+
+    // Offset of the start of each line, plus one past the end of data
+    QVector<quint32> offsets;
+};
+
+#endif // GCODESOURCE_H
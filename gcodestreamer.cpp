@@ -0,0 +1,541 @@
+#include "gcodestreamer.h"
+
+#include <QDebug>
+#include <QCoreApplication>
+#include <cmath>
+
+// Progress is given at most every (ms)
+#define PROGRESS_INTERVAL 100
+
+// Feeder waits room in a full ring (ms) : the ring holds seconds of moves
+#define FEEDER_WAIT 10
+
+GCodeStreamFeeder::GCodeStreamFeeder(GCodeStreamRing *ring)
+{
+    this->ring = ring;
+    source = nullptr;
+    failedLine.storeRelease(-1);
+}
+
+GCodeStreamFeeder::~GCodeStreamFeeder()
+{
+    cancel();
+}
+
+void GCodeStreamFeeder::feed(GCodeStreamSource *source)
+{
+    cancel();
+
+    this->source = source;
+    canceled.storeRelease(0);
+    waiting.storeRelease(0);
+    failedLine.storeRelease(-1);
+    start();
+}
+
+void GCodeStreamFeeder::cancel()
+{
+    if (!isRunning()) return;
+
+    canceled.storeRelease(1);
+    wait();
+}
+
+void GCodeStreamFeeder::run()
+{
+    QByteArray line;
+    int sourceLine;
+
+    while (!canceled.loadAcquire())
+    {
+        if (!source->next(line, sourceLine)) break;
+
+        // Not an end of program : the ring stays open, lines after it are never sent
+        if (line.size() >= ring->getMaxLine())
+        {
+            qDebug() << "GCodeStreamFeeder::run: Line" << sourceLine + 1 << "too long, stream stopped";
+            failedLine.storeRelease(qMax(sourceLine, 0));
+            emit failed();
+            return;
+        }
+
+        while (!ring->push(line, sourceLine))
+        {
+            if (canceled.loadAcquire()) return;
+            msleep(FEEDER_WAIT);
+        }
+
+        if (waiting.fetchAndStoreOrdered(0))
+            emit linesAvailable();
+    }
+
+    if (canceled.loadAcquire()) return;
+
+    ring->close();
+    emit linesAvailable();
+}
+
+// Realtime commands to write
+static const QEvent::Type realtimeEvent = QEvent::Type(QEvent::registerEventType());
+
+GCodeStreamer::GCodeStreamer(QObject *parent) : QObject(parent), feeder(&ring)
+{
+    port = nullptr;
+    pendingFirst = pendingCount = 0;
+    pendingBytes = 0;
+    source = nullptr;
+    bufferSize = 0;
+    steps = 0;
+    sentLine = answeredLine = -1;
+    clock.start();
+
+    connect( &feeder, SIGNAL(linesAvailable()), this, SLOT(fill()), Qt::QueuedConnection);
+    connect( &feeder, SIGNAL(failed()), this, SLOT(onFeederFailed()), Qt::QueuedConnection);
+
+    // Slots and queued calls run in the streamer thread
+    moveToThread(&thread);
+    thread.start();
+}
+
+GCodeStreamer::~GCodeStreamer()
+{
+    detach();
+    feeder.cancel();
+    thread.quit();
+    thread.wait();
+}
+
+void GCodeStreamer::attach(Port *port)
+{
+    detach();
+
+    this->port = port;
+    port->moveToThread(&thread);
+    QMetaObject::invokeMethod(this, [this]() {
+        connect(this->port, SIGNAL(lineAvailable(QString&)), this, SLOT(onLineAvailable(QString&)));
+    }, Qt::QueuedConnection);
+}
+
+void GCodeStreamer::detach()
+{
+    if (!port) return;
+
+    // Port goes back to the caller thread, which deletes it
+    QThread *caller = QThread::currentThread();
+    QMetaObject::invokeMethod(this, [this, caller]() {
+        writeRealtime();
+        disconnect(port, SIGNAL(lineAvailable(QString&)), this, SLOT(onLineAvailable(QString&)));
+        port->moveToThread(caller);
+        commands.clear();
+        clearPending();
+        clearSource();
+        setState(StateType::stateIdle);
+    }, Qt::BlockingQueuedConnection);
+
+    port = nullptr;
+
+    if (getRealtimeCount())
+        qDebug() << "GCodeStreamer::detach:" << getRealtimeCount() << "realtime commands, p50"
+                 << getRealtimeLatency(0.5) << "µs, p99" << getRealtimeLatency(0.99)
+                 << "µs, max" << getRealtimeMaxLatency() << "µs";
+}
+
+bool GCodeStreamer::send(const QByteArray &data, bool isLine)
+{
+    if (!port) return false;
+
+    QMetaObject::invokeMethod(this, [this, data, isLine]() {
+        if (!isLine)
+        {
+            write(data.constData(), data.size(), false, false, -1);
+            return;
+        }
+
+        commands.enqueue(data);
+        fill();
+    }, Qt::QueuedConnection);
+    return true;
+}
+
+bool GCodeStreamer::sendRealtime(char command)
+{
+    if (!port) return false;
+
+    quint32 position = realtimeHead.loadAcquire();
+    if (position - realtimeTail.loadAcquire() == REALTIME_QUEUE_SIZE)
+    {
+        qDebug() << "GCodeStreamer::sendRealtime: Too many commands waiting";
+        return false;
+    }
+
+    Realtime &next = realtime[position % REALTIME_QUEUE_SIZE];
+    next.command = command;
+    next.time = clock.nsecsElapsed();
+    realtimeHead.storeRelease(position + 1);
+
+    // Handled before the normal events waiting : answers, commands
+    if (!realtimePosted.fetchAndStoreOrdered(1))
+        QCoreApplication::postEvent(this, new QEvent(realtimeEvent), Qt::HighEventPriority);
+    return true;
+}
+
+bool GCodeStreamer::event(QEvent *event)
+{
+    if (event->type() == realtimeEvent)
+    {
+        writeRealtime();
+        return true;
+    }
+    return QObject::event(event);
+}
+
+void GCodeStreamer::writeRealtime()
+{
+    // Commands sent from now on post again
+    realtimePosted.storeRelease(0);
+
+    quint32 position = realtimeTail.loadAcquire();
+    quint32 end = realtimeHead.loadAcquire();
+    for (; position != end; position++)
+    {
+        const Realtime &command = realtime[position % REALTIME_QUEUE_SIZE];
+        if (port)
+            port->write(&command.command, 1);
+
+        int latency = int((clock.nsecsElapsed() - command.time) / 1000);
+        latencyBins[qMin(latency / REALTIME_LATENCY_BIN, REALTIME_LATENCY_BINS)].ref();
+        latencyCount.ref();
+        if (latency > latencyMax.loadAcquire())
+            latencyMax.storeRelease(latency);
+    }
+    realtimeTail.storeRelease(position);
+}
+
+int GCodeStreamer::getRealtimeLatency(double quantile) const
+{
+    int count = getRealtimeCount();
+    if (!count) return 0;
+
+    // Upper bound of the bin reaching the quantile
+    int target = qMax(1, int(std::ceil(quantile * count)));
+    int sum = 0;
+    for (int bin = 0; bin < REALTIME_LATENCY_BINS; bin++)
+    {
+        sum += latencyBins[bin].loadAcquire();
+        if (sum >= target)
+            return qMin((bin + 1) * REALTIME_LATENCY_BIN, getRealtimeMaxLatency());
+    }
+    return getRealtimeMaxLatency();
+}
+
+void GCodeStreamer::reset()
+{
+    if (!port) return;
+
+    // Returns once the feeder is stopped
+    state.storeRelease(StateType::stateIdle);
+    QMetaObject::invokeMethod(this, [this]() {
+        commands.clear();
+        clearPending();
+        clearSource();
+        emit stateChanged(StateType::stateIdle);
+    }, Qt::BlockingQueuedConnection);
+}
+
+void GCodeStreamer::start(GCodeStreamSource *source, int bufferSize, bool step)
+{
+    // Known at once by the caller, source is used once the thread gets it
+    int started = step ? StateType::stateStepping : StateType::stateRunning;
+    state.storeRelease(started);
+
+    QMetaObject::invokeMethod(this, [this, source, bufferSize, step, started]() {
+        clearSource();
+
+        this->source = source;
+        this->bufferSize = bufferSize;
+        steps = step ? 1 : 0;
+        sentLine = answeredLine = -1;
+        progressTimer.invalidate();
+
+        qDebug() << "GCodeStreamer::start: buffer" << bufferSize << "bytes";
+        emit stateChanged(started);
+
+        // Lines are sent as soon as the feeder prepares them
+        feeder.feed(source);
+        fill();
+    }, Qt::QueuedConnection);
+}
+
+void GCodeStreamer::step()
+{
+    QMetaObject::invokeMethod(this, [this]() {
+        if (!source || (getState() == StateType::stateDraining)) return;
+        steps = 1;
+        setState(StateType::stateStepping);
+        fill();
+    }, Qt::QueuedConnection);
+}
+
+void GCodeStreamer::hold()
+{
+    QMetaObject::invokeMethod(this, [this]() {
+        if ((getState() == StateType::stateRunning) || (getState() == StateType::stateStepping))
+            setState(StateType::stateHeld);
+    }, Qt::QueuedConnection);
+}
+
+void GCodeStreamer::resume()
+{
+    QMetaObject::invokeMethod(this, [this]() {
+        if (!source || (getState() == StateType::stateDraining)) return;
+        setState(StateType::stateRunning);
+        fill();
+    }, Qt::QueuedConnection);
+}
+
+void GCodeStreamer::stop()
+{
+    if (!port) return;
+
+    // Returns once the feeder is stopped : the source can be used again
+    state.storeRelease(StateType::stateIdle);
+    QMetaObject::invokeMethod(this, [this]() {
+        clearSource();
+        emit stateChanged(StateType::stateIdle);
+    }, Qt::BlockingQueuedConnection);
+}
+
+void GCodeStreamer::onFeederFailed()
+{
+    // Signal of a feeder canceled since
+    int line = feeder.getFailedLine();
+    if (!source || (line < 0)) return;
+
+    // Lines already in the machine run, nothing more is sent : step() and resume() need a source
+    qDebug() << "GCodeStreamer::onFeederFailed: Stream held on line" << line + 1;
+    source = nullptr;
+    steps = 0;
+    setState(StateType::stateHeld);
+    emit failed(line);
+}
+
+// Lines prepared assume the line in error changed the machine state : they are
+// prepared again, from the first one not sent
+void GCodeStreamer::restartSource()
+{
+    if (!source) return;
+
+    feeder.cancel();
+
+    const char *data;
+    int bytes, line = -1;
+    int linesWithout = 0;
+    while (ring.front(data, bytes, line) && (line < 0))
+    {
+        linesWithout++;
+        ring.pop();
+    }
+    ring.clear();
+
+    source->restart(line, linesWithout);
+    feeder.feed(source);
+}
+
+void GCodeStreamer::clearSource()
+{
+    feeder.cancel();
+    ring.clear();
+    source = nullptr;
+    steps = 0;
+}
+
+void GCodeStreamer::setState(int newState)
+{
+    if (state.fetchAndStoreOrdered(newState) == newState) return;
+
+    reportProgress(true);
+    emit stateChanged(newState);
+}
+
+// A line of bytes fits in the machine buffer now : always when it is empty
+bool GCodeStreamer::hasRoom(int bytes) const
+{
+    if (pendingCount == STREAM_PENDING_LINES) return false;
+    return !pendingCount || (pendingBytes + bytes <= bufferSize);
+}
+
+bool GCodeStreamer::write(const char *data, int bytes, bool isLine, bool streamed, int sourceLine)
+{
+    if (!port) return false;
+
+    // Not written when its answer can't be counted
+    if (isLine && (pendingCount == STREAM_PENDING_LINES))
+    {
+        qDebug() << "GCodeStreamer::write: Too many lines not answered";
+        return false;
+    }
+
+    // Realtime commands go first
+    if (realtimeHead.loadAcquire() != realtimeTail.loadAcquire())
+        writeRealtime();
+
+    if (port->write(data, bytes) != bytes)
+    {
+        qDebug() << "GCodeStreamer::write: Error writing" << QByteArray(data, bytes);
+        return false;
+    }
+
+    // Each line is answered, realtime commands are not
+    if (isLine)
+    {
+        Pending &line = pending[(pendingFirst + pendingCount) % STREAM_PENDING_LINES];
+        line.bytes = bytes;
+        line.sourceLine = sourceLine;
+        line.streamed = streamed;
+        pendingCount++;
+        pendingBytes += bytes;
+
+        pendingLineCount.storeRelease(pendingCount);
+        pendingByteCount.storeRelease(pendingBytes);
+    }
+    return true;
+}
+
+void GCodeStreamer::clearPending()
+{
+    pendingFirst = pendingCount = 0;
+    pendingBytes = 0;
+
+    pendingLineCount.storeRelease(0);
+    pendingByteCount.storeRelease(0);
+}
+
+void GCodeStreamer::onLineAvailable(QString &line)
+{
+    bool ok = line.startsWith("ok");
+    if (ok || line.startsWith("error:"))
+    {
+        bool streamed = pendingCount && pending[pendingFirst].streamed;
+        answered(!ok);
+
+        // Answers of streamed lines stay here, but errors
+        if (streamed && ok) return;
+    }
+    else if (line.startsWith("Grbl "))
+    {
+        // Machine reset : its buffer is empty
+        clearPending();
+        fill();
+    }
+
+    emit lineReceived(line);
+}
+
+void GCodeStreamer::answered(bool error)
+{
+    if (!pendingCount) return;
+
+    const Pending &line = pending[pendingFirst];
+    pendingFirst = (pendingFirst + 1) % STREAM_PENDING_LINES;
+    pendingCount--;
+    pendingBytes -= line.bytes;
+
+    pendingLineCount.storeRelease(pendingCount);
+    pendingByteCount.storeRelease(pendingBytes);
+
+    if (line.streamed)
+    {
+        if (line.sourceLine >= 0)
+            answeredLine = line.sourceLine;
+
+        // No more lines after an error, those in the machine buffer still run
+        int current = getState();
+        if (error && ((current == StateType::stateRunning) || (current == StateType::stateStepping)))
+        {
+            qDebug() << "GCodeStreamer::answered: Error on line" << line.sourceLine + 1;
+            setState(StateType::stateHeld);
+            restartSource();
+        }
+    }
+
+    fill();
+}
+
+void GCodeStreamer::fill()
+{
+    // Commands of the machine before the next streamed line
+    while (!commands.isEmpty())
+    {
+        const QByteArray &command = commands.head();
+        if (!hasRoom(command.size()) || !write(command.constData(), command.size(), true, false, -1))
+            return;
+        commands.dequeue();
+    }
+
+    if (!source) return;
+
+    forever
+    {
+        int current = getState();
+        if ((current != StateType::stateRunning) && (current != StateType::stateStepping))
+            break;
+
+        // Next line prepared. Stepping looks at it too, the end is known with the last answer.
+        const char *data;
+        int bytes, line;
+        if (!ring.front(data, bytes, line))
+        {
+            if (ring.isDone())
+            {
+                setState(StateType::stateDraining);
+                break;
+            }
+
+            // Told by the feeder after its next line, which may be already there
+            feeder.wake();
+            if (!ring.front(data, bytes, line))
+            {
+                if ((current == StateType::stateRunning) && (pendingBytes < bufferSize))
+                    ring.countEmptyStall();
+                break;
+            }
+        }
+
+        // Stepping sends one line at a time, like send-response
+        if ((current == StateType::stateStepping) && !steps)
+            break;
+        if (pendingCount && (current == StateType::stateStepping))
+            break;
+        if (!hasRoom(bytes) || !write(data, bytes, true, true, line))
+            break;
+        ring.pop();
+        if (line >= 0)
+            sentLine = line;
+
+        if (current == StateType::stateStepping)
+            steps--;
+    }
+
+    if ((getState() == StateType::stateDraining) && !pendingCount)
+    {
+        qDebug() << "GCodeStreamer::fill: Stream ended, ring" << ring.getMaxBytes() << "/" << ring.getSize()
+                 << "bytes at most," << ring.getFullStalls() << "full," << ring.getEmptyStalls() << "empty;"
+                 << getRealtimeCount() << "realtime commands, p99" << getRealtimeLatency(0.99)
+                 << "µs, max" << getRealtimeMaxLatency() << "µs";
+        clearSource();
+        setState(StateType::stateIdle);
+        emit ended();
+        return;
+    }
+
+    reportProgress(false);
+}
+
+void GCodeStreamer::reportProgress(bool now)
+{
+    if (!now && progressTimer.isValid() && (progressTimer.elapsed() < PROGRESS_INTERVAL))
+        return;
+
+    progressTimer.start();
+    emit progress(sentLine, answeredLine);
+}
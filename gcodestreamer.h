@@ -0,0 +1,220 @@
+#ifndef GCODESTREAMER_H
+#define GCODESTREAMER_H
+
+#include <QObject>
+#include <QThread>
+#include <QAtomicInt>
+#include <QAtomicInteger>
+#include <QElapsedTimer>
+#include <QEvent>
+#include <QQueue>
+
+#include "port.h"
+#include "gcodestreamring.h"
+
+// Lines in the machine buffer at most : a receive buffer of some kB
+#define STREAM_PENDING_LINES 1024
+
+// Realtime commands waiting their write at most
+#define REALTIME_QUEUE_SIZE 64
+
+// Realtime latencies are counted by 10 µs, up to 10 ms
+#define REALTIME_LATENCY_BIN 10
+#define REALTIME_LATENCY_BINS 1000
+
+// Lines to stream, read in the feeder thread
+class GCodeStreamSource
+{
+public:
+    virtual ~GCodeStreamSource() {}
+
+    // Next line without its line feed, and the source line it comes from (-1 when none).
+    // False after the last line.
+    virtual bool next(QByteArray &line, int &sourceLine) = 0;
+
+    // Lines given and not sent are given again, prepared for an unknown machine state :
+    // the lines without source line before sourceLine (its last ones), then sourceLine
+    // (-1 : where the source is). Not called while next() runs.
+    virtual void restart(int sourceLine, int linesWithout) = 0;
+};
+
+// Prepares the lines of a source in its own thread, into a ring read by the streamer
+class GCodeStreamFeeder : public QThread
+{
+    Q_OBJECT
+
+public:
+    explicit GCodeStreamFeeder(GCodeStreamRing *ring);
+    virtual ~GCodeStreamFeeder();
+
+    void feed(GCodeStreamSource *source);
+    // Returns when the thread is done
+    void cancel();
+
+    // Ring found empty : linesAvailable() is emitted after the next push
+    void wake() { waiting.storeRelease(1); }
+
+    // Source line not fitting in the ring, -1 when none. The ring is left open.
+    int getFailedLine() const { return failedLine.loadAcquire(); }
+
+signals:
+    void linesAvailable();
+    void failed();
+
+protected:
+    virtual void run();
+
+private:
+    GCodeStreamRing *ring;
+    GCodeStreamSource *source;
+    QAtomicInt canceled;
+    QAtomicInt waiting;
+    QAtomicInt failedLine;
+};
+
+// Streams lines to a Grbl machine from its own thread, which owns the port :
+// the next line is written as soon as an answer makes room, whatever the GUI
+// is doing. Character counting keeps the receive buffer of the machine full,
+// a buffer size of zero waits the answer of each line (send-response).
+// Lines are prepared ahead by a feeder thread : writing them takes no lock
+// and allocates nothing. After an error, the lines not sent are prepared again.
+// Lines received are given back by lineReceived(), but the ok answering a
+// streamed line, counted here. Commands of the machine are sent by send() :
+// their lines wait room in the buffer like streamed ones, and go first.
+// Realtime commands have their own lane : a high priority event has them
+// written before any line waiting.
+
+class GCodeStreamer : public QObject
+{
+    Q_OBJECT
+
+public:
+    class StateType
+    {
+    public:
+        enum
+        {
+            stateIdle,          // No source
+            stateRunning,       // Lines sent while the buffer has room
+            stateHeld,          // Lines kept until resume(), after an error too
+            stateStepping,      // One line per step(), once the previous one is answered
+            stateDraining       // All lines sent, waiting their answers
+        };
+    };
+
+    explicit GCodeStreamer(QObject *parent = nullptr);
+    virtual ~GCodeStreamer();
+
+    // Port is used from the streamer thread until detach() gives it back
+    void attach(Port *port);
+    void detach();
+
+    // Command of the machine, counted in the buffer when it is a line
+    bool send(const QByteArray &data, bool isLine);
+    // Realtime command of one byte, from one thread : the GUI one
+    bool sendRealtime(char command);
+    // Machine reset : lines not answered are lost, the stream stops
+    void reset();
+
+    // Lines of source are sent until its end. Source must live until the stream is idle.
+    void start(GCodeStreamSource *source, int bufferSize, bool step = false);
+    void step();
+    void hold();
+    void resume();
+    // Lines not sent are dropped
+    void stop();
+
+    int getState() const { return state.loadAcquire(); }
+    bool isIdle() const { return getState() == StateType::stateIdle; }
+
+    // Lines sent and not answered yet, and their bytes
+    int getPendingLines() const { return pendingLineCount.loadAcquire(); }
+    int getPendingBytes() const { return pendingByteCount.loadAcquire(); }
+
+    // Lines prepared and not sent, occupancy and stalls
+    const GCodeStreamRing &getRing() const { return ring; }
+
+    // Realtime commands written, and their latency in µs from sendRealtime() to the port
+    // (the byte given to the driver) : at quantile (0.99 for p99), and the highest
+    int getRealtimeCount() const { return latencyCount.loadAcquire(); }
+    int getRealtimeLatency(double quantile) const;
+    int getRealtimeMaxLatency() const { return latencyMax.loadAcquire(); }
+
+protected:
+    virtual bool event(QEvent *event);
+
+signals:
+    void lineReceived(QString line);
+    void stateChanged(int state);
+    // Source lines of the last line sent and of the last line answered, a few times per second
+    void progress(int sentLine, int answeredLine);
+    // Last line of the source answered
+    void ended();
+    // Source line that can't be streamed : the stream is held until stop()
+    void failed(int sourceLine);
+
+private slots:
+    void onLineAvailable(QString &line);
+    void fill();
+    void onFeederFailed();
+
+private:
+    // Streamer thread only
+
+    struct Pending
+    {
+        int bytes;
+        int sourceLine;
+        bool streamed;
+    };
+
+    void setState(int newState);
+    bool hasRoom(int bytes) const;
+    bool write(const char *data, int bytes, bool isLine, bool streamed, int sourceLine);
+    void answered(bool error);
+    void restartSource();
+    void clearPending();
+    void clearSource();
+    void reportProgress(bool now);
+    void writeRealtime();
+
+    QThread thread;
+    Port *port;
+
+    // Lines in the machine buffer, in sending order, from first
+    Pending pending[STREAM_PENDING_LINES];
+    int pendingFirst, pendingCount;
+    int pendingBytes;
+
+    // Lines of send() waiting room in the buffer
+    QQueue<QByteArray> commands;
+
+    GCodeStreamSource *source;
+    GCodeStreamRing ring;
+    GCodeStreamFeeder feeder;
+    int bufferSize;
+    int steps;
+
+    int sentLine, answeredLine;
+    QElapsedTimer progressTimer;
+
+    // Read from any thread
+    QAtomicInt state;
+    QAtomicInt pendingLineCount, pendingByteCount;
+
+    // Realtime lane, from the GUI thread (head) to the streamer thread (tail)
+    struct Realtime
+    {
+        char command;
+        qint64 time;        // ns of clock
+    };
+    Realtime realtime[REALTIME_QUEUE_SIZE];
+    QAtomicInteger<quint32> realtimeHead, realtimeTail;
+    QAtomicInt realtimePosted;
+    QElapsedTimer clock;
+
+    QAtomicInt latencyBins[REALTIME_LATENCY_BINS + 1];
+    QAtomicInt latencyCount, latencyMax;
+};
+
+#endif // GCODESTREAMER_H
@@ -0,0 +1,115 @@
+#include "gcodestreamring.h"
+
+#include <cstring>
+
+GCodeStreamRing::GCodeStreamRing(int size)
+{
+    this->size = size;
+    mask = quint32(size - 1);
+    buffer.resize(size / int(sizeof(qint64)));
+    clear();
+}
+
+void GCodeStreamRing::clear()
+{
+    head.storeRelease(0);
+    tail.storeRelease(0);
+    closed.storeRelease(0);
+
+    lines.storeRelease(0);
+    maxBytes.storeRelease(0);
+    fullStalls.storeRelease(0);
+    emptyStalls.storeRelease(0);
+}
+
+quint32 GCodeStreamRing::recordSize(int bytes)
+{
+    return (quint32(sizeof(Header)) + quint32(bytes) + 7) & ~quint32(7);
+}
+
+GCodeStreamRing::Header *GCodeStreamRing::header(quint32 position) const
+{
+    return reinterpret_cast<Header *>(const_cast<qint64 *>(buffer.constData()) + ((position & mask) >> 3));
+}
+
+int GCodeStreamRing::getBytes() const
+{
+    return int(head.loadAcquire() - tail.loadAcquire());
+}
+
+bool GCodeStreamRing::push(const QByteArray &line, int sourceLine)
+{
+    int bytes = line.size() + 1;
+    quint32 record = recordSize(bytes);
+    quint32 position = head.loadAcquire();
+    quint32 used = position - tail.loadAcquire();
+
+    // A record is not cut by the end of the ring
+    quint32 toEnd = quint32(size) - (position & mask);
+    quint32 needed = (record > toEnd) ? record + toEnd : record;
+
+    if (quint32(size) - used < needed)
+    {
+        fullStalls.ref();
+        return false;
+    }
+
+    if (record > toEnd)
+    {
+        header(position)->bytes = -1;
+        position += toEnd;
+    }
+
+    Header *next = header(position);
+    next->bytes = bytes;
+    next->sourceLine = sourceLine;
+    char *data = reinterpret_cast<char *>(next + 1);
+    memcpy(data, line.constData(), size_t(line.size()));
+    data[line.size()] = '\n';
+
+    head.storeRelease(position + record);
+    lines.ref();
+
+    int occupancy = int(position + record - tail.loadAcquire());
+    if (occupancy > maxBytes.loadAcquire())
+        maxBytes.storeRelease(occupancy);
+    return true;
+}
+
+void GCodeStreamRing::close()
+{
+    closed.storeRelease(1);
+}
+
+bool GCodeStreamRing::front(const char *&data, int &bytes, int &sourceLine)
+{
+    quint32 position = tail.loadAcquire();
+    if (position == head.loadAcquire()) return false;
+
+    Header *first = header(position);
+    if (first->bytes < 0)
+    {
+        position += quint32(size) - (position & mask);
+        tail.storeRelease(position);
+        if (position == head.loadAcquire()) return false;
+        first = header(position);
+    }
+
+    data = reinterpret_cast<const char *>(first + 1);
+    bytes = first->bytes;
+    sourceLine = first->sourceLine;
+    return true;
+}
+
+void GCodeStreamRing::pop()
+{
+    quint32 position = tail.loadAcquire();
+    tail.storeRelease(position + recordSize(header(position)->bytes));
+    lines.deref();
+}
+
+bool GCodeStreamRing::isDone() const
+{
+    // Closed after its last push
+    return closed.loadAcquire() && (tail.loadAcquire() == head.loadAcquire());
+}
@@ -0,0 +1,73 @@
+#ifndef GCODESTREAMRING_H
+#define GCODESTREAMRING_H
+
+#include <QVector>
+#include <QByteArray>
+#include <QAtomicInt>
+#include <QAtomicInteger>
+
+// Bytes of the ring, a power of two : some thousands of lines
+#define STREAM_RING_SIZE (64 * 1024)
+
+// Lines ready to write, from the thread preparing them (producer) to the
+// thread writing them (consumer), without lock : each index is written by one
+// thread only. Lines are kept contiguous with their line feed, the writer
+// gives them to the port from the ring, nothing is allocated after construction.
+// A line not fitting before the end of the ring starts at its beginning.
+
+class GCodeStreamRing
+{
+public:
+    explicit GCodeStreamRing(int size = STREAM_RING_SIZE);
+
+    // Producer. A line feed is added. False when full, the line is not taken.
+    bool push(const QByteArray &line, int sourceLine);
+    // No more lines
+    void close();
+    int getMaxLine() const { return size / 2; }
+
+    // Consumer. First line, false when empty.
+    bool front(const char *&data, int &bytes, int &sourceLine);
+    void pop();
+    // Closed and all lines taken
+    bool isDone() const;
+
+    // Neither thread uses the ring : empty, open, counters reset
+    void clear();
+
+    // Occupancy, and its highest since clear()
+    int getLines() const { return lines.loadAcquire(); }
+    int getBytes() const;
+    int getMaxBytes() const { return maxBytes.loadAcquire(); }
+    int getSize() const { return size; }
+
+    // Stalls : producer finding the ring full, consumer finding it empty with room in the machine
+    int getFullStalls() const { return fullStalls.loadAcquire(); }
+    int getEmptyStalls() const { return emptyStalls.loadAcquire(); }
+    void countEmptyStall() { emptyStalls.ref(); }
+
+private:
+    struct Header
+    {
+        qint32 bytes;           // -1 : end of the ring skipped
+        qint32 sourceLine;
+    };
+
+    static quint32 recordSize(int bytes);
+    Header *header(quint32 position) const;
+
+    // 8 bytes aligned
+    QVector<qint64> buffer;
+    int size;
+    quint32 mask;
+
+    // Bytes pushed and popped since clear(), wrapping
+    QAtomicInteger<quint32> head, tail;
+    QAtomicInt closed;
+
+    QAtomicInt lines;
+    QAtomicInt maxBytes;
+    QAtomicInt fullStalls, emptyStalls;
+};
+
+#endif // GCODESTREAMRING_H
@@ -0,0 +1,142 @@
+#ifndef GCODETOKENIZER_H
+#define GCODETOKENIZER_H
+
+// Cursor based G-code tokenizer.
+// It walks the raw bytes of one line a single time, skipping spaces and
+// comments, and parses each word value in place : no QString, no temporary
+// buffer and no allocation per word.
+
+class GCodeTokenizer
+{
+public:
+    GCodeTokenizer(const char *begin, const char *end) : cursor(begin), end(end) {}
+
+    // Get next word of the line. Letter is returned upper case.
+    // Returns false when the end of line (or a ';' comment) is reached.
+    inline bool next(char &letter, double &value);
+
+    // Position of the cursor, just after the last word read
+    const char *position() const { return cursor; }
+
+    // Parse a number : [+|-] digits [. digits]
+    // Any number of digits is accepted, exponents are not (E is a G-code word).
+    // Returns a pointer after the last char used, or begin if there is no number.
+    static inline const char *parseNumber(const char *begin, const char *end, double &value);
+
+private:
+    const char *cursor;
+    const char *end;
+};
+
+inline const char *GCodeTokenizer::parseNumber(const char *begin, const char *end, double &value)
+{
+    // Exact powers of ten, doubles are exact up to 1e22
+    static const double pow10[] = {
+        1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+    };
+    const int maxDigits = 19; // Fits in 64 bits
+
+    const char *p = begin;
+    bool negative = false;
+
+    if ((p < end) && ((*p == '-') || (*p == '+')))
+    {
+        negative = (*p == '-');
+        p++;
+    }
+
+    unsigned long long mantissa = 0;
+    int digits = 0;      // Significant digits stored in mantissa
+    int exponent = 0;    // Power of ten to apply to mantissa
+    bool hasDigits = false;
+
+    // Integer part
+    for (; (p < end) && (*p >= '0') && (*p <= '9'); p++)
+    {
+        hasDigits = true;
+        if (digits < maxDigits)
+        {
+            mantissa = mantissa * 10 + static_cast<unsigned>(*p - '0');
+            if (mantissa) digits++;
+        }
+        else exponent++; // Digits lost, keep magnitude
+    }
+
+    // Fractional part
+    if ((p < end) && (*p == '.'))
+    {
+        p++;
+        for (; (p < end) && (*p >= '0') && (*p <= '9'); p++)
+        {
+            hasDigits = true;
+            if (digits < maxDigits)
+            {
+                mantissa = mantissa * 10 + static_cast<unsigned>(*p - '0');
+                if (mantissa) digits++;
+                exponent--;
+            }
+        }
+    }
+
+    if (!hasDigits)
+    {
+        value = 0;
+        return begin;
+    }
+
+    double result = double(mantissa);
+    while (exponent < -22) { result /= 1e22; exponent += 22; }
+    while (exponent > 22) { result *= 1e22; exponent -= 22; }
+    if (exponent < 0)
+        result /= pow10[-exponent];
+    else
+        result *= pow10[exponent];
+
+    value = negative ? -result : result;
+    return p;
+}
+
+inline bool GCodeTokenizer::next(char &letter, double &value)
+{
+    while (cursor < end)
+    {
+        char c = *cursor++;
+
+        if ((c == ' ') || (c == '\t') || (c == '\r'))
+            continue; // Ignore spaces
+
+        if (c == '(')
+        {
+            // Comment until ')' or end of line
+            while ((cursor < end) && (*cursor != ')')) cursor++;
+            if (cursor < end) cursor++;
+            continue;
+        }
+
+        if (c == ';')
+        {
+            // Comment until end of line
+            cursor = end;
+            return false;
+        }
+
+        if ((c >= 'a') && (c <= 'z'))
+            c -= 'a' - 'A';
+
+        if ((c >= 'A') && (c <= 'Z'))
+        {
+            letter = c;
+
+            // Spaces are allowed between the letter and its value
+            while ((cursor < end) && ((*cursor == ' ') || (*cursor == '\t'))) cursor++;
+            cursor = parseNumber(cursor, end, value);
+            return true;
+        }
+
+        // Anything else (%, line feed, ...) is ignored.
+    }
+    return false;
+}
+
+#endif // GCODETOKENIZER_H
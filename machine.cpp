@@ -27,6 +27,8 @@ Machine::Machine(QWidget *parent) :
     lineNumber = 0;
     fOverride = rOverride = spindleSpeedOverride = 0;
 
+    connect( &streamer, SIGNAL(lineReceived(QString)), this, SLOT(receive(QString)));
+
 //    this->port = port;
 }
 
@@ -137,6 +139,20 @@ int Machine::getSpindleSpeedOverride() { return spindleSpeedOverride; };
 
 const QString &Machine::getLastLine() { return lastLine; };
 
+QVector3D Machine::getStepsPerMillimeter() { return QVector3D(); };
+QVector3D Machine::getMaxRates() { return QVector3D(); };
+QVector3D Machine::getAccelerations() { return QVector3D(); };
+double Machine::getJunctionDeviation() { return 0; };
+double Machine::getArcTolerance() { return 0; };
+
+int Machine::getStreamBufferSize() { return 0; };
+GCodeStreamer *Machine::getStreamer() { return &streamer; };
+
+void Machine::receive(QString line)
+{
+    parse(line);
+}
+
 bool Machine::sendCommand(QString gcode, bool withNewline, bool noLog)
 {
     if (!port) return false;
@@ -155,5 +171,18 @@ bool Machine::sendCommand(QString gcode, bool withNewline, bool noLog)
     }
 
     emit commandSent(gcode);
-    return port->write(gcode.toLocal8Bit()) == gcode.size();
+
+    // Written in the streamer thread, lines once the machine buffer has room
+    return streamer.send(gcode.toLocal8Bit(), withNewline);
+}
+
+bool Machine::sendRealtime(char command)
+{
+    if (!port) return false;
+
+    // Not logged on the way : the byte is written first
+    bool sent = streamer.sendRealtime(command);
+
+    emit commandSent(QString(QChar(uchar(command))));
+    return sent;
 }
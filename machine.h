@@ -10,6 +10,7 @@
 #include <QTabWidget>
 
 #include "port.h"
+#include "gcodestreamer.h"
 #include "bits.h"
 #include "singletonFactory.h"
 
@@ -216,6 +217,8 @@ protected:
     //QJsonObject &config;
 
     Port *port;
+    // Writes to the port and reads it, in its own thread
+    GCodeStreamer streamer;
 
 public:
 //    explicit Machine(QJsonObject &configMachine, QWidget *parent = nullptr);
@@ -234,6 +237,8 @@ public:
     virtual bool stopMove()=0;
 
     virtual bool sendCommand(QString gcode, bool withNewline = true, bool noLog = false);
+    // One byte command, written before the lines waiting
+    virtual bool sendRealtime(char command);
     virtual bool ask(int commandCode, int commandArg = 0, bool noLog = false) = 0;
 
     void setMachineConfigurationWidget(QTabWidget *configTabWidget);
@@ -288,6 +293,21 @@ public:
 
     virtual const QString &getLastLine();
 
+    // Machine resolution, zero when unknown
+    virtual QVector3D getStepsPerMillimeter();
+    // Planner limits, zero when unknown : mm/min, mm/s², mm
+    virtual QVector3D getMaxRates();
+    virtual QVector3D getAccelerations();
+    virtual double getJunctionDeviation();
+    virtual double getArcTolerance();
+
+    // Bytes the machine can hold without answering, zero to wait each answer
+    virtual int getStreamBufferSize();
+    GCodeStreamer *getStreamer();
+
+    // Status reports received per second, zero when not polled
+    virtual double getStatusRate() { return 0; }
+
     virtual void setXWorkingZero()=0;
     virtual void setYWorkingZero()=0;
     virtual void setZWorkingZero()=0;
@@ -296,6 +316,10 @@ public slots:
     virtual void parse(QString &line)=0;
     virtual int openConfiguration();
 
+protected slots:
+    // Line of the machine, from the streamer thread
+    void receive(QString line);
+
 signals:
     void versionUpdated(); // When name or version has been found or changed
     void statusUpdated(); // When status of machine has been received (changed or not)
@@ -21,6 +21,17 @@
 #define CMD_STARTBLOCK "$N"
 #define CMD_CHECK      "$C"
 
+// Serial receive buffer, until [OPT:] tells it
+#define RX_BUFFER_SIZE_DEFAULT 128
+
+// Status polling periods (ms) : moving, moving on grblHAL, stopped, sleeping
+#define STATUS_INTERVAL_MOVING      100
+#define STATUS_INTERVAL_MOVING_FAST 20
+#define STATUS_INTERVAL_STOPPED     250
+#define STATUS_INTERVAL_SLEEP       1000
+// Report awaited longer is considered lost
+#define STATUS_LOST                 1000
+
 MachineGrbl::MachineGrbl(QWidget *parent) :
 //    MachineGrbl::MachineGrbl(QJsonObject &configMachine, QWidget *parent) :
 //    Machine(configMachine, parent),
@@ -40,6 +51,13 @@ MachineGrbl::MachineGrbl(QWidget *parent) :
 
     port = nullptr;
 
+    statusClock.start();
+    statusAsked = statusLastReport = -1;
+    statusRoundTrip = statusJitter = statusPeriod = 0;
+    statusLastRoundTrip = -1;
+    statusSkipped = 0;
+    statusFast = false;
+
     qDebug() << "MachineGrbl::MachineGrbl: machine initialized.";
 }
 
@@ -68,15 +86,15 @@ void MachineGrbl::openMachine(QString portName)
 //               bit(FeatureFlags::flagName);
     features = 0;
 
-    connect( port, SIGNAL(lineAvailable(QString&)), this, SLOT(parse(QString&)));
+    // Lines come back from the streamer thread
+    streamer.attach(port);
     connect( &statusTimer, SIGNAL(timeout()), this, SLOT(timeout()));
 
     // Start by asking informations about version
 //    ask(CommandType::commandInfos);
     ask(CommandType::commandReset);
 
-    // And ask for status on a 5Hz basis (maximum recommended by Grbl)
-    //statusTimer.start(200);
+    // Status is asked once the machine has reset, at a rate given by its state
 }
 
 void MachineGrbl::closeMachine()
@@ -86,7 +104,7 @@ void MachineGrbl::closeMachine()
 
     if (port)
     {
-        disconnect( port, SIGNAL(lineAvailable(QString&)), this, SLOT(parse(QString&)));
+        streamer.detach();
         delete port;
         port = nullptr;
     }
@@ -585,6 +603,47 @@ bool MachineGrbl::getConfiguration()
     return true;
 }
 
+QVector3D MachineGrbl::getStepsPerMillimeter()
+{
+    // $100, $101, $102 : zero until configuration has been read
+    return QVector3D( config.value(MachineGrbl::ConfigType::configXSteps).toFloat(),
+                      config.value(MachineGrbl::ConfigType::configYSteps).toFloat(),
+                      config.value(MachineGrbl::ConfigType::configZSteps).toFloat() );
+}
+
+QVector3D MachineGrbl::getMaxRates()
+{
+    // $110, $111, $112
+    return QVector3D( config.value(MachineGrbl::ConfigType::configXMaxRate).toFloat(),
+                      config.value(MachineGrbl::ConfigType::configYMaxRate).toFloat(),
+                      config.value(MachineGrbl::ConfigType::configZMaxRate).toFloat() );
+}
+
+QVector3D MachineGrbl::getAccelerations()
+{
+    // $120, $121, $122
+    return QVector3D( config.value(MachineGrbl::ConfigType::configXAcceleration).toFloat(),
+                      config.value(MachineGrbl::ConfigType::configYAcceleration).toFloat(),
+                      config.value(MachineGrbl::ConfigType::configZAcceleration).toFloat() );
+}
+
+double MachineGrbl::getJunctionDeviation()
+{
+    return config.value(MachineGrbl::ConfigType::configJunctionDeviation).toDouble();
+}
+
+double MachineGrbl::getArcTolerance()
+{
+    return config.value(MachineGrbl::ConfigType::configArcTolerance).toDouble();
+}
+
+int MachineGrbl::getStreamBufferSize()
+{
+    // Character counting : one byte of the ring buffer is never used
+    int size = (rxBufferMax > 0) ? rxBufferMax : RX_BUFFER_SIZE_DEFAULT;
+    return size - 1;
+}
+
 // ----------------------------------------------------------------------------------
 bool MachineGrbl::ask(int commandCode, int commandArg, bool noLog)
 {
@@ -750,13 +809,91 @@ bool MachineGrbl::ask(int commandCode, int commandArg, bool noLog)
         return false;
     }
 
-    return sendCommand(cmd, newLine, noLog);
+    // Realtime commands bypass the lines waiting
+    bool sent = (!newLine && (cmd.size() == 1)) ? sendRealtime(char(cmd.at(0).unicode())) : sendCommand(cmd, newLine, noLog);
+
+    // Grbl flushes its receive buffer on reset, the stream stops
+    if (commandCode == CommandType::commandReset)
+        streamer.reset();
+
+    return sent;
 }
 
 void MachineGrbl::timeout()
 {
+    qint64 now = statusClock.nsecsElapsed();
+
+    // One report at a time : a slow machine sets the rate
+    if (statusAsked >= 0)
+    {
+        if (now - statusAsked < qint64(STATUS_LOST) * 1000000)
+        {
+            statusSkipped++;
+            return;
+        }
+        qDebug() << "MachineGrbl::timeout: Status report lost.";
+    }
+
 //    if (hasFeature( FeatureFlags::flagAskStatus))
-        ask(CommandType::commandStatus, 0, true);
+    if (ask(CommandType::commandStatus, 0, true))
+        statusAsked = now;
+}
+
+int MachineGrbl::getStatusInterval()
+{
+    switch (state)
+    {
+    case StateType::stateRun:
+    case StateType::stateJog:
+    case StateType::stateHome:
+        return statusFast ? STATUS_INTERVAL_MOVING_FAST : STATUS_INTERVAL_MOVING;
+    case StateType::stateHold:
+        // Hold:1 still decelerates
+        if (holdCode) return statusFast ? STATUS_INTERVAL_MOVING_FAST : STATUS_INTERVAL_MOVING;
+        return STATUS_INTERVAL_STOPPED;
+    case StateType::stateSleep:
+        return STATUS_INTERVAL_SLEEP;
+    default:
+        return STATUS_INTERVAL_STOPPED;
+    }
+}
+
+double MachineGrbl::getStatusRate()
+{
+    return (statusPeriod > 0) ? 1000.0 / statusPeriod : 0;
+}
+
+void MachineGrbl::statusReceived()
+{
+    qint64 now = statusClock.nsecsElapsed();
+
+    // Averages over some reports (1/16). Jitter as in RFC 3550 : from the
+    // difference between consecutive round trips.
+    if (statusAsked >= 0)
+    {
+        double roundTrip = (now - statusAsked) / 1e6;
+        if (statusLastRoundTrip >= 0)
+            statusJitter += (qAbs(roundTrip - statusLastRoundTrip) - statusJitter) / 16;
+        statusLastRoundTrip = roundTrip;
+        statusRoundTrip = (statusRoundTrip == 0) ? roundTrip : statusRoundTrip + (roundTrip - statusRoundTrip) / 16;
+        statusAsked = -1;
+    }
+
+    if (statusLastReport >= 0)
+    {
+        double period = (now - statusLastReport) / 1e6;
+        statusPeriod = (statusPeriod == 0) ? period : statusPeriod + (period - statusPeriod) / 16;
+    }
+    statusLastReport = now;
+
+    int interval = getStatusInterval();
+    if (statusTimer.isActive() && (statusTimer.interval() != interval))
+    {
+        qDebug() << "MachineGrbl::statusReceived: Status every" << interval << "ms, rate"
+                 << getStatusRate() << "Hz, round trip" << statusRoundTrip << "ms, jitter"
+                 << statusJitter << "ms," << statusSkipped << "polls skipped";
+        statusTimer.setInterval(interval);
+    }
 }
 
 void MachineGrbl::parse(QString &line)
@@ -775,6 +912,9 @@ void MachineGrbl::parse(QString &line)
         qDebug() << "Grbl::parse: Machine name " << machineName;
         bitSet(features, FeatureFlags::flagName);
 
+        // grblHAL answers as GrblHAL
+        statusFast = machineName.startsWith("GrblHAL", Qt::CaseInsensitive);
+
         machineVersion = blocks.at(1);
         qDebug() << "Grbl::parse: Partial version " << machineVersion;
         bitSet(features, FeatureFlags::flagVersion);
@@ -786,7 +926,11 @@ void MachineGrbl::parse(QString &line)
         //           Informations are asked multiple times (4 times).
         //           It works, but that take plenty of time
         ask(CommandType::commandInfos);
-        statusTimer.start(200);
+
+        // A report asked before the reset will not come
+        statusAsked = statusLastReport = -1;
+        statusPeriod = 0;
+        statusTimer.start(getStatusInterval());
 
         emit resetDone();
     }
@@ -820,6 +964,7 @@ void MachineGrbl::parse(QString &line)
     else if (line.startsWith('<') ) // This is status
     {
         parseStatus(line);
+        statusReceived();
         emit statusUpdated();
     }
     else if (line.startsWith('>') ) // This is status
@@ -3,6 +3,7 @@
 
 #include <QTimer>
 #include <QMap>
+#include <QElapsedTimer>
 
 #include "machine.h"
 #include "portSerial.h"
@@ -190,6 +191,22 @@ public:
 
     virtual bool ask(int command, int arg = 0, bool noLog = false);
 
+    virtual QVector3D getStepsPerMillimeter();
+    virtual QVector3D getMaxRates();
+    virtual QVector3D getAccelerations();
+    virtual double getJunctionDeviation();
+    virtual double getArcTolerance();
+
+    virtual int getStreamBufferSize();
+
+    // Status polling : period asked now (ms), and measured on the reports received
+    // (Hz, round trip and its jitter in ms), polls skipped while a report was awaited
+    virtual int getStatusInterval();
+    virtual double getStatusRate();
+    double getStatusRoundTrip() { return statusRoundTrip; }
+    double getStatusJitter() { return statusJitter; }
+    int getStatusSkipped() { return statusSkipped; }
+
     void loadErrorsMessages();
     void loadAlarmsMessages();
     void loadBuildOptionsMessages();
@@ -214,9 +231,18 @@ private slots:
     virtual void writeConfiguration();
 
 private:
+    void statusReceived();
+
     Ui::MachineGrbl *ui;
 
     QTimer  statusTimer;
+    QElapsedTimer statusClock;
+    qint64 statusAsked;         // ns of statusClock, -1 when no report awaited
+    qint64 statusLastReport;
+    double statusRoundTrip, statusJitter, statusPeriod;
+    double statusLastRoundTrip; // ms, -1 before the first one
+    int statusSkipped;
+    bool statusFast;            // grblHAL reports at 50 Hz and more
 //    PortSerial serial;
 
 
@@ -7,6 +7,8 @@
 #include <QWidget>
 #include <QMessageBox>
 #include <QFileDialog>
+#include <QInputDialog>
+#include <QTextBlock>
 #include <QDebug>
 
 #include "machineGrbl.h"
@@ -41,11 +43,27 @@ MainWindow::MainWindow(QWidget *parent) :
     // editingFinished seems to be emitted when Alt is pressed.
     connect( ui->commandComboBox->lineEdit(), &QFocusLineEdit::editingFinished, this, &MainWindow::onGcodeChanged);
 
+    // Source follows each edit, to parse only changed lines
+    editorLoading = false;
+    changedFirstLine = -1;
+    changedRemovedLines = changedAddedLines = 0;
+    connect( ui->gcodeCodeEditor->document(), &QTextDocument::contentsChange, this, &MainWindow::onEditorContentsChange);
+
+    // Tool path of the line under the cursor is highlighted
+    connect( ui->gcodeCodeEditor, &QPlainTextEdit::cursorPositionChanged, this, &MainWindow::onEditorCursorMoved);
+
+    gcodeLoading = false;
+    connect( &gcodeLoader, &GCodeLoader::partsAvailable, this, &MainWindow::onGcodePartsLoaded);
+    connect( &gcodeLoader, &QThread::finished, this, &MainWindow::onGcodeLoaded);
+    connect( &gcodeEstimator, &QThread::finished, this, &MainWindow::onGcodeEstimated);
+
     //gcodeParser = new GCode();
     machine = nullptr;
 
     on_jogIntervalSlider_valueChanged( 3 );
     gcodeIndex = 0;
+    gcodeStartLine = 0;
+    simplifyTolerance = 0.005;
 
     this->onPortsUpdate();
     connect( &portsTimer, SIGNAL(timeout()), this, SLOT(onPortsUpdate()) );
@@ -56,6 +74,8 @@ MainWindow::MainWindow(QWidget *parent) :
 
 MainWindow::~MainWindow()
 {
+    gcodeLoader.cancel();
+    gcodeEstimator.cancel();
     if (machine) delete machine;
     delete ui;
 }
@@ -253,15 +273,30 @@ void MainWindow::homing()
 
 bool MainWindow::newFile()
 {
+    // The streamer reads the source until it is idle
+    if (isStreaming()) return false;
+
     if (ui->gcodeCodeEditor->isWindowModified())
         saveFile();
 
+    // Source is about to change
+    cancelSourceLoad();
+
+    editorLoading = true;
     ui->gcodeCodeEditor->clear();
+    editorLoading = false;
+
+    gcodeSource.setData( QByteArray() );
+    changedFirstLine = 0;
+    changedRemovedLines = -1;
     return true;
 }
 
 void MainWindow::openFile(QString fileName)
 {
+    // The streamer reads the source until it is idle
+    if (isStreaming()) return;
+
     if (ui->gcodeCodeEditor->isWindowModified())
         saveFile();
 
@@ -273,34 +308,318 @@ void MainWindow::openFile(QString fileName)
     }
 
     if (fileName.isNull()) return;
-    QFile file( fileName );
 
-    if (file.open(QFile::ReadOnly | QFile::Text))
+    // Previous file may still be parsed, from the source about to be unmapped
+    cancelSourceLoad();
+
+    if (gcodeSource.open( fileName ))
+    {
+        // The editor needs its own QString : this is the only copy of the file.
+        editorLoading = true;
+        ui->gcodeCodeEditor->setPlainText( QString::fromUtf8(gcodeSource.data(), int(gcodeSource.size())) );
+        ui->gcodeCodeEditor->document()->setModified(false);
+        editorLoading = false;
+
+        loadSource();
+
+        gcodeIndex = 0;
+    }
+    else QMessageBox::critical(this,"Error",QString("Can't read file %1").arg( fileName ));
+}
+
+void MainWindow::parseGcode()
+{
+    // Source is already up to date, parse only the changed lines when possible
+    ui->gcodeCodeEditor->document()->setModified(false);
+
+    if ((changedFirstLine >= 0) && (changedRemovedLines >= 0) &&
+        gcodeParser.update(changedFirstLine, changedRemovedLines, changedAddedLines))
     {
-        ui->gcodeCodeEditor->setPlainText(file.readAll());
+        changedFirstLine = -1;
+        updateGcodeInformations();
+    }
+    else
+        parseSource();
+}
 
-        QStringList lines = ui->gcodeCodeEditor->toPlainText().split("\n");
-        gcodeParser.parse( lines );
+void MainWindow::parseSource()
+{
+    // Compact tool path is quantized to the machine steps (default ones without machine)
+    gcodeParser.setCompact( ui->actionCompactToolpath->isChecked(),
+                            machine ? machine->getStepsPerMillimeter() : QVector3D() );
 
-        ui->linesNbLabel->setText( QString().setNum( lines.size()) );
-        ui->pointsNbLabel->setText( QString().setNum(gcodeParser.getPoints().size()) );
-        ui->visualizer->setGCode( &gcodeParser );
+    gcodeParser.parse( gcodeSource );
+    changedFirstLine = -1;
+    changedRemovedLines = changedAddedLines = 0;
+    updateGcodeInformations();
+}
 
-        QVector3D size = gcodeParser.getBoxSize();
-        ui->gCodeSizeInfo->setText( QString("%1 / %2 mm")
-                    .arg( QString().sprintf("%4.2f", double(size.x())) )
-                    .arg( QString().sprintf("%4.2f", double(size.y())) )
-                    );
+void MainWindow::loadSource()
+{
+    bool compact = ui->actionCompactToolpath->isChecked();
+    QVector3D steps = machine ? machine->getStepsPerMillimeter() : QVector3D();
 
-        QVector3D minPoint = gcodeParser.getBoxMin();
-        ui->gCodeZeroInfo->setText( QString("%1 / %2 mm")
-                    .arg( QString().sprintf("%4.2f",  - double(minPoint.x())) )
-                    .arg( QString().sprintf("%4.2f",  - double(minPoint.y())) )
-                    );
+    // Parts are added to an empty tool path until the whole file is parsed
+    gcodeParser.clear();
+    gcodeParser.setCompact(compact, steps);
+    changedFirstLine = -1;
+    changedRemovedLines = changedAddedLines = 0;
+    updateGcodeInformations();
 
-        gcodeIndex = 0;
+    // Source can't change during the parse
+    gcodeLoading = true;
+    updateSourceLock();
+
+    gcodeLoader.load(&gcodeSource, compact, steps);
+}
+
+void MainWindow::waitSourceLoaded()
+{
+    if (!gcodeLoading) return;
+
+    gcodeLoader.wait();
+    onGcodeLoaded();
+}
+
+void MainWindow::cancelSourceLoad()
+{
+    gcodeEstimator.cancel();
+    if (!gcodeLoading) return;
+
+    gcodeLoader.cancel();
+    onGcodeLoaded();
+}
+
+void MainWindow::onGcodePartsLoaded()
+{
+    if (!gcodeLoading) return;
+
+    if (gcodeLoader.takeParts(gcodeParser))
+    {
+        updateGcodeInformations();
+        statusBar()->showMessage( tr("Parsing G-code : %1 / %2 lines")
+                                  .arg(gcodeParser.getSize()).arg(gcodeSource.lineCount()) );
     }
-    else QMessageBox::critical(this,"Error",QString("Can't read file %1").arg( fileName ));
+}
+
+void MainWindow::onGcodeLoaded()
+{
+    // A canceled parse may signal after the next one started
+    if (!gcodeLoading || gcodeLoader.isRunning()) return;
+
+    gcodeLoading = false;
+    gcodeLoader.clearParts();
+    updateSourceLock();
+    statusBar()->clearMessage();
+
+    if (gcodeLoader.isParsed())
+    {
+        gcodeParser = gcodeLoader.takeGCode();
+        updateGcodeInformations();
+    }
+    else
+    {
+        // Canceled : nothing valid to show
+        gcodeParser.clear();
+        changedFirstLine = 0;
+        changedRemovedLines = -1;
+        updateGcodeInformations();
+    }
+}
+
+void MainWindow::onEditorContentsChange(int position, int charsRemoved, int charsAdded)
+{
+    Q_UNUSED(charsRemoved)
+    if (editorLoading) return;
+
+    // Editor is read-only while the streamer reads the source
+    if (isStreaming())
+    {
+        qDebug() << "MainWindow::onEditorContentsChange: Source changed during a run, ignored";
+        return;
+    }
+
+    // The estimation reads the source
+    gcodeEstimator.cancel();
+
+    QTextDocument *document = ui->gcodeCodeEditor->document();
+
+    // Blocks holding the new text replace the same first block and some old ones
+    QTextBlock block = document->findBlock(position);
+    int firstLine = block.blockNumber();
+    int lastLine = document->findBlock( qMin(position + charsAdded, document->characterCount() - 1) ).blockNumber();
+    int addedLines = lastLine - firstLine + 1;
+    int removedLines = addedLines - (document->blockCount() - gcodeSource.lineCount());
+
+    if ((firstLine < 0) || (lastLine < firstLine) || (removedLines < 1) ||
+        (firstLine + removedLines > gcodeSource.lineCount()))
+    {
+        // Lost track of the editor : take all its text, a full parse will follow
+        qDebug() << "MainWindow::onEditorContentsChange: Editor and source differ, reloading source";
+        gcodeSource.setData( document->toPlainText().toUtf8() );
+        changedFirstLine = 0;
+        changedRemovedLines = -1;
+        return;
+    }
+
+    QByteArray text;
+    for (int i = 0; i < addedLines; i++, block = block.next())
+    {
+        if (i) text.append('\n');
+        text.append( block.text().toUtf8() );
+    }
+
+    // Highlighting also signals blocks, without changing their text
+    if (removedLines == addedLines)
+    {
+        const char *start = gcodeSource.lineStart(firstLine);
+        if (QByteArray::fromRawData(start, int(gcodeSource.lineEnd(lastLine) - start)) == text)
+            return;
+    }
+
+    gcodeSource.replaceLines(firstLine, removedLines, text);
+
+    if (changedRemovedLines < 0)
+        return; // Full parse already needed
+
+    if (changedFirstLine < 0)
+    {
+        changedFirstLine = firstLine;
+        changedRemovedLines = removedLines;
+        changedAddedLines = addedLines;
+    }
+    else
+    {
+        // Merge with previous changes : lines after them are shifted by their size change
+        int first = qMin(changedFirstLine, firstLine);
+        int end = qMax(changedFirstLine + changedAddedLines, firstLine + removedLines);
+        changedRemovedLines = end - (changedAddedLines - changedRemovedLines) - first;
+        changedAddedLines = end + (addedLines - removedLines) - first;
+        changedFirstLine = first;
+    }
+}
+
+void MainWindow::onEditorCursorMoved()
+{
+    int line = ui->gcodeCodeEditor->textCursor().blockNumber();
+    ui->visualizer->setSelection( gcodeParser.firstPoint(line), gcodeParser.firstPoint(line + 1) );
+}
+
+// Heights and feeds listed in the statistics tool tip
+#define STATS_TOOLTIP_BINS 10
+
+void MainWindow::updateGcodeInformations()
+{
+    ui->linesNbLabel->setText( QString().setNum( gcodeParser.getSize() ) );
+    ui->pointsNbLabel->setText( QString().setNum(gcodeParser.getPointCount()) );
+    ui->visualizer->setGCode( &gcodeParser );
+
+    QVector3D size = gcodeParser.getBoxSize();
+    ui->gCodeSizeInfo->setText( QString("%1 / %2 mm")
+                .arg( QString().sprintf("%4.2f", double(size.x())) )
+                .arg( QString().sprintf("%4.2f", double(size.y())) )
+                );
+
+    QVector3D minPoint = gcodeParser.getBoxMin();
+    ui->gCodeZeroInfo->setText( QString("%1 / %2 mm")
+                .arg( QString().sprintf("%4.2f",  - double(minPoint.x())) )
+                .arg( QString().sprintf("%4.2f",  - double(minPoint.y())) )
+                );
+
+    // Statistics come with the parse, details in the tool tip
+    const ToolpathStats &stats = gcodeParser.getStats();
+    ui->gCodeLengthInfo->setText( QString("%1 / %2 mm")
+                .arg( stats.getCutLength(), 0, 'f', 1 )
+                .arg( stats.getRapidLength(), 0, 'f', 1 )
+                );
+
+    QStringList details;
+    details << tr("Feed moves: %1").arg( stats.getMoves(GCode::MotionType::feedMove) )
+            << tr("Arcs: %1").arg( stats.getMoves(GCode::MotionType::clockwiseArcMove) +
+                                   stats.getMoves(GCode::MotionType::counterClockwiseArcMove) )
+            << tr("Rapid moves: %1").arg( stats.getMoves(GCode::MotionType::rapidMove) );
+
+    QVector<ToolpathStats::Bin> levels = stats.getZLevels();
+    details << tr("Cut heights: %1").arg( levels.size() );
+    for (int i = 0; i < qMin(levels.size(), STATS_TOOLTIP_BINS); i++)
+        details << QString("  Z%1 : %2 mm").arg( double(levels.at(i).value) ).arg( levels.at(i).length, 0, 'f', 1 );
+    if (levels.size() > STATS_TOOLTIP_BINS) details << "  ...";
+
+    QVector<ToolpathStats::Bin> feeds = stats.getFeeds();
+    details << tr("Feeds: %1").arg( feeds.size() );
+    for (int i = 0; i < qMin(feeds.size(), STATS_TOOLTIP_BINS); i++)
+        details << QString("  F%1 : %2 mm").arg( double(feeds.at(i).value) ).arg( feeds.at(i).length, 0, 'f', 1 );
+    if (feeds.size() > STATS_TOOLTIP_BINS) details << "  ...";
+
+    ui->gCodeLengthInfo->setToolTip( details.join("\n") );
+
+    if (!gcodeLoading)
+        estimateGcode();
+}
+
+void MainWindow::estimateGcode()
+{
+    // Grbl defaults for what the machine did not give
+    PlannerSettings settings;
+    if (machine)
+    {
+        settings.maxRate = machine->getMaxRates();
+        settings.acceleration = machine->getAccelerations();
+        settings.junctionDeviation = machine->getJunctionDeviation();
+        settings.arcTolerance = machine->getArcTolerance();
+        settings.blockBufferSize = machine->getBlockBufferMax();
+    }
+
+    ui->gCodeTimeInfo->setText( tr("Estimating...") );
+    gcodeEstimator.estimate(gcodeParser, settings);
+}
+
+void MainWindow::onGcodeEstimated()
+{
+    // A canceled estimation may signal after the next one started
+    if (gcodeEstimator.isRunning() || !gcodeEstimator.isEstimated()) return;
+
+    ui->gCodeTimeInfo->setText( formatDuration( gcodeEstimator.getTotalTime() ) );
+
+    // Not during a run, its predictor keeps the plan it started with, unless it started without one
+    if (!isStreaming() || runTimePredictor.isEmpty())
+        runTimePredictor.setPlan( gcodeEstimator.getLineTimes(), gcodeEstimator.getRapidLineTimes() );
+}
+
+QString MainWindow::formatDuration(double seconds)
+{
+    qint64 s = qRound64(seconds);
+    return QString("%1:%2:%3")
+            .arg( s / 3600 )
+            .arg( (s / 60) % 60, 2, 10, QChar('0') )
+            .arg( s % 60, 2, 10, QChar('0') );
+}
+
+void MainWindow::updateRemainingTime()
+{
+    if (!machine || machine->getStreamer()->isIdle() || runTimePredictor.isEmpty()) return;
+
+    // Machine gives the line number sent with the command (N), numbered from 1
+    int line = machine->hasInfo( Machine::InfoFlags::flagHasLineNumber ) ? machine->getLineNumber() - 1 : -1;
+    int bufferedLines = machine->hasInfo( Machine::InfoFlags::flagHasBuffer ) ?
+                            machine->getBlockBufferMax() - machine->getBlockBuffer() : 0;
+    double feed = machine->hasInfo( Machine::InfoFlags::flagHasFeedRate ) ? machine->getFeedRate() : -1;
+
+    // Distance to the end of the executing line
+    double distance = -1;
+    int executing = runTimePredictor.getLine();
+    int lastPoint = gcodeParser.firstPoint(executing + 1) - 1;
+    if (machine->hasInfo( Machine::InfoFlags::flagHasWorkingCoords ) &&
+        (lastPoint >= gcodeParser.firstPoint(executing)) && (lastPoint >= 0))
+        distance = double( (gcodeParser.pointCoords(lastPoint) - machine->getWorkingCoordinates()).length() );
+
+    runTimePredictor.update( runTimer.elapsed(), line, gcodeIndex, bufferedLines,
+                             machine->isState( Machine::StateType::stateRun ),
+                             machine->getFOverride(), machine->getROverride(), feed, distance );
+
+    if (runTimePredictor.getRemainingTime() >= 0)
+        ui->gcodeExecutedProgressBar->setFormat( tr("%p% - %1 remaining")
+                                                 .arg( formatDuration(runTimePredictor.getRemainingTime()) ) );
 }
 
 bool MainWindow::saveFile()
@@ -417,6 +736,13 @@ void MainWindow::openMachine()
 
         connect( machine, SIGNAL(infoUpdated()), this, SLOT(onInfoUpdated()) );
 
+        // Progress of the stream, from its thread
+        GCodeStreamer *streamer = machine->getStreamer();
+        connect( streamer, SIGNAL(stateChanged(int)), this, SLOT(onStreamStateChanged(int)) );
+        connect( streamer, SIGNAL(progress(int,int)), this, SLOT(onStreamProgress(int,int)) );
+        connect( streamer, SIGNAL(ended()), this, SLOT(onStreamEnded()) );
+        connect( streamer, SIGNAL(failed(int)), this, SLOT(onStreamFailed(int)) );
+
         setUIConnected();
         qDebug() << "Connected to" << portName.toUtf8().data();
         ui->statusbar->showMessage(tr("Connected to machine.", "StatusBar message"));
@@ -455,6 +781,7 @@ void MainWindow::closeMachine()
     }
 
     setUIDisconnected();
+    updateSourceLock();
 }
 
 void MainWindow::onMachineLog( QString line )
@@ -659,10 +986,13 @@ void MainWindow::onLineNumberUpdated()
         ui->gcodeCodeEditor->setCurrentLine( machine->getLineNumber() );
         ui->lineNbLabel->setText( QString("%1 / %2")
                                   .arg(machine->getLineNumber())
-                                  .arg(gcodeParser.getLines().size())
+                                  .arg(gcodeParser.getSize())
                                   );
         //ui->infoLabel->setText( QString("%1").arg(machine->getLineNumber()) );
         ui->gcodeExecutedProgressBar->setValue( machine->getLineNumber() );
+
+        // Tool path is drawn until the end of the line (numbered from 1)
+        ui->visualizer->setNbPoints( gcodeParser.firstPoint( machine->getLineNumber() ) );
     }
 }
 
@@ -817,6 +1147,8 @@ void MainWindow::onStatusUpdated()
 
     // Display status in statusBar for debug ???
     ui->statusbar->showMessage( machine->getLastLine(), 250);
+
+    updateRemainingTime();
 }
 
 void MainWindow::onGcodeChanged()
@@ -858,40 +1190,66 @@ void MainWindow::checkGcode()
 
         gcodeIndex = 0;
 
+        waitSourceLoaded();
         if (ui->gcodeCodeEditor->document()->isModified())
-        {
-            QString text = ui->gcodeCodeEditor->toPlainText();
-            gcodeParser.parse( text );
-            ui->gcodeCodeEditor->document()->setModified(false);
-        }
+            parseGcode();
+        simplifyGcode();
 
         ui->gcodeExecutedProgressBar->setValue(0);
-        ui->gcodeExecutedProgressBar->setMaximum( gcodeParser.getLines().size() );
+        ui->gcodeExecutedProgressBar->setMaximum( gcodeParser.getSize() );
 
         if (machine->isState( MachineGrbl::StateType::stateIdle))
         {
+            gcodeStream.start( &gcodeSource, &gcodeSimplifier, 0, QList<QByteArray>(), QByteArray(),
+                               ui->actionMinimizeLines->isChecked(), machine->getStepsPerMillimeter() );
+
             machine->ask(MachineGrbl::CommandType::commandCheck);
-            connect(machine, SIGNAL(commandExecuted()), this, SLOT(onCommandExecuted()));
-            sendNextGCode();
+            machine->getStreamer()->start( &gcodeStream, streamBufferSize() );
         }
     }
 }
 
+int MainWindow::streamBufferSize()
+{
+    // Character counting, or send-response
+    return ui->actionFillBuffer->isChecked() ? machine->getStreamBufferSize() : 0;
+}
+
 void MainWindow::runGcode(bool step)
 {
     if (!machineOk()) return; // security
 
-    if (gcodeIndex == 0)
+    GCodeStreamer *streamer = machine->getStreamer();
+    bool starting = streamer->isIdle();
+
+    if (starting)
     {
+        waitSourceLoaded();
         if (ui->gcodeCodeEditor->document()->isModified())
+            parseGcode();
+        simplifyGcode();
+
+        ui->gcodeExecutedProgressBar->setValue(0);
+        ui->gcodeExecutedProgressBar->setMaximum( gcodeParser.getSize() );
+
+        // Start from a line : the machine is first brought in the state of this line
+        gcodeIndex = 0;
+        gcodePreamble.clear();
+        gcodeMotion.clear();
+        if ((gcodeStartLine > 0) && (gcodeStartLine < gcodeSource.lineCount()))
         {
-            QString text = ui->gcodeCodeEditor->toPlainText();
-            gcodeParser.parse( text );
-            ui->gcodeCodeEditor->document()->setModified(false);
+            gcodePreamble = gcodeParser.preamble(gcodeStartLine);
+            gcodeMotion = gcodeParser.resumeMotion(gcodeStartLine);
+            gcodeIndex = gcodeStartLine;
+            qDebug() << "MainWindow::runGcode: from line" << gcodeStartLine + 1 << gcodePreamble << gcodeMotion;
         }
+        gcodeStartLine = 0;
 
-        ui->gcodeExecutedProgressBar->setValue(0);
-        ui->gcodeExecutedProgressBar->setMaximum( gcodeParser.getLines().size() );
+        gcodeStream.start( &gcodeSource, &gcodeSimplifier, gcodeIndex, gcodePreamble, gcodeMotion,
+                           ui->actionMinimizeLines->isChecked(), machine->getStepsPerMillimeter() );
+
+        runTimer.start();
+        runTimePredictor.start(gcodeIndex, runTimer.elapsed());
 
         if (!step)
         {
@@ -902,30 +1260,37 @@ void MainWindow::runGcode(bool step)
             // machine->ask(Grbl::CommandType::commandOverrideCoolantMistToggle);
 
         }
-        connect(machine, SIGNAL(commandExecuted()), this, SLOT(onCommandExecuted()));
     }
 
-    stepCommand = step;
-
     machine->ask(Machine::CommandType::commandPause, step);
 
     ui->runToolButton->setEnabled(step);
     ui->stepToolButton->setEnabled(true);
     ui->stopToolButton->setEnabled(true);
 
-    sendNextGCode();
+    if (starting)
+    {
+        streamer->start( &gcodeStream, streamBufferSize(), step );
+        updateSourceLock();
+    }
+    else if (step)
+        streamer->step();
+    else
+        streamer->resume();
 }
 
 void MainWindow::pauseGcode()
 {
     qDebug() << "MainWindow::pauseGcode";
+    if (machine)
+        machine->getStreamer()->hold();
 }
 
 void MainWindow::stopGcode()
 {
     if (machine)
     {
-        disconnect(machine, SIGNAL(commandExecuted()), this, SLOT(onCommandExecuted()));
+        machine->getStreamer()->stop();
         machine->ask(Machine::CommandType::commandPause, true);
         doResetOnHold = true;
 
@@ -933,46 +1298,100 @@ void MainWindow::stopGcode()
             machine->ask(MachineGrbl::CommandType::commandCheck);
     }
 
+    endGcode();
+}
+
+void MainWindow::endGcode()
+{
     gcodeIndex = 0;
+    gcodeStartLine = 0;
+    gcodePreamble.clear();
+    gcodeMotion.clear();
 
     ui->runToolButton->setEnabled(true);
     ui->stepToolButton->setEnabled(true);
     ui->stopToolButton->setEnabled(false);
 
     ui->gcodeExecutedProgressBar->setValue(0);
+    ui->gcodeExecutedProgressBar->setFormat( "%p%" );
     ui->lineNbLabel->setText( QString() );
+
+    updateSourceLock();
 }
 
-void MainWindow::onCommandExecuted()
+bool MainWindow::isStreaming()
 {
-    qDebug() << "MainWindow::onCommandExecuted() stepCommand=" << stepCommand;
+    return machine && !machine->getStreamer()->isIdle();
+}
 
-    if (stepCommand)
-    {
-        ui->actionStep->setEnabled(true);
-    }
-    else sendNextGCode();
+void MainWindow::updateSourceLock()
+{
+    // Source is read by the parse, and by the streamer until it is idle
+    bool streaming = isStreaming();
+    ui->gcodeCodeEditor->setReadOnly(gcodeLoading || streaming);
+    ui->actionNew->setEnabled(!streaming);
+    ui->actionOpen->setEnabled(!streaming);
+    ui->actionSimplifyToolpath->setEnabled(!streaming);
+    ui->actionFitArcs->setEnabled(!streaming);
+    ui->actionReorderToolpath->setEnabled(!streaming);
+    ui->actionCompactToolpath->setEnabled(!streaming);
 }
 
-void MainWindow::sendNextGCode()
+void MainWindow::onStreamStateChanged(int state)
 {
-    if (!machineOk()) return; // security
+    qDebug() << "MainWindow::onStreamStateChanged:" << state;
 
-    QStringList lines = gcodeParser.getLines();
-    if (gcodeIndex < lines.size())
+    // Stream stopped by a reset of the machine
+    if ((state == GCodeStreamer::StateType::stateIdle) && machine && machine->getStreamer()->isIdle())
+        endGcode();
+
+    // Stream stopped by an error : it goes on with run or step
+    if (state == GCodeStreamer::StateType::stateHeld)
     {
-        machine->sendCommand( QString("N%1%2").arg(gcodeIndex+1).arg(lines.at(gcodeIndex)).toUtf8() );
-        gcodeIndex++;
+        ui->runToolButton->setEnabled(true);
+        ui->statusbar->showMessage(tr("Streaming held.", "StatusBar message"));
     }
+}
+
+void MainWindow::onStreamProgress(int sentLine, int answeredLine)
+{
+    Q_UNUSED(answeredLine)
+
+    // Lines sent, in source lines
+    if (sentLine >= 0)
+        gcodeIndex = sentLine + 1;
+}
 
-    if (gcodeIndex >= lines.size())
+void MainWindow::onStreamFailed(int sourceLine)
+{
+    // The program is not complete : the machine is held, only stop goes on
+    if (machine)
+        machine->ask(Machine::CommandType::commandPause, true);
+
+    ui->runToolButton->setEnabled(false);
+    ui->stepToolButton->setEnabled(false);
+    ui->stopToolButton->setEnabled(true);
+    ui->statusbar->showMessage(tr("Streaming stopped on line %1.", "StatusBar message").arg(sourceLine + 1));
+
+    QMessageBox::critical(this, tr("Streaming error"),
+                          tr("Line %1 is too long to be sent, the program is held before it.\n"
+                             "Stop the program to use the machine again.").arg(sourceLine + 1));
+}
+
+void MainWindow::onStreamEnded()
+{
+    // The stream left the program source, its counts can be read
+    const GCodeMinimizer &minimizer = gcodeStream.getMinimizer();
+    if (gcodeStream.isMinimized() && minimizer.getLines())
     {
-        disconnect(machine, SIGNAL(commandExecuted()), this, SLOT(onCommandExecuted()));
-        ui->gcodeExecutedProgressBar->setValue(lines.size());
-        ui->lineNbLabel->setText( QString() );
-        stopGcode();
+        double bytesIn = double(minimizer.getBytesIn()) / minimizer.getLines();
+        double bytesOut = double(minimizer.getBytesOut()) / minimizer.getLines();
+        qDebug() << "MainWindow::onStreamEnded: bytes per line" << bytesIn << "->" << bytesOut;
+        ui->statusbar->showMessage(tr("Lines sent: %1 bytes per line, %2 before minimizing.", "StatusBar message")
+                                   .arg(bytesOut, 0, 'f', 1).arg(bytesIn, 0, 'f', 1));
     }
-};
+    endGcode();
+}
 
 void MainWindow::resetMachine()
 {
@@ -1284,6 +1703,24 @@ void MainWindow::on_actionConfig_triggered()
     machine->openConfiguration();
 }
 
+void MainWindow::on_actionRunFromLine_triggered()
+{
+    if (!machineOk()) return; // security
+    if (!machine->getStreamer()->isIdle()) return; // a program is running
+
+    waitSourceLoaded();
+    int nbLines = gcodeSource.lineCount();
+    if (!nbLines) return;
+
+    bool ok;
+    int line = QInputDialog::getInt(this, tr("Run from line"), tr("Line:"),
+                                    ui->gcodeCodeEditor->textCursor().blockNumber() + 1, 1, nbLines, 1, &ok);
+    if (!ok) return;
+
+    gcodeStartLine = line - 1;
+    runGcode();
+}
+
 void MainWindow::on_resetToolButton_clicked()
 {
     resetMachine();
@@ -1474,12 +1911,129 @@ void MainWindow::on_actionAbout_triggered()
                        );
 }
 
+void MainWindow::on_actionCompactToolpath_toggled(bool checked)
+{
+    Q_UNUSED(checked)
+
+    // The source is parsed again : not while it streams
+    if (isStreaming()) return;
+
+    // Tool path storage changes on parse
+    if (!gcodeSource.isEmpty())
+        loadSource();
+}
+
+void MainWindow::on_actionSimplifyToolpath_toggled(bool checked)
+{
+    // The streamer reads the simplifier until it is idle
+    if (isStreaming()) return;
+
+    if (!checked)
+    {
+        gcodeSimplifier.clear();
+        return;
+    }
+
+    bool ok;
+    double tolerance = QInputDialog::getDouble(this, tr("Simplify tool path"), tr("Tolerance (mm):"),
+                                               simplifyTolerance, 0, 1, 4, &ok);
+    if (!ok)
+    {
+        ui->actionSimplifyToolpath->setChecked(false);
+        return;
+    }
+    simplifyTolerance = tolerance;
+
+    // Done again on each run, the program may change until then
+    waitSourceLoaded();
+    if (ui->gcodeCodeEditor->document()->isModified())
+        parseGcode();
+    simplifyGcode();
+}
+
+void MainWindow::on_actionFitArcs_toggled(bool checked)
+{
+    Q_UNUSED(checked)
+
+    if (!isStreaming() && ui->actionSimplifyToolpath->isChecked())
+    {
+        waitSourceLoaded();
+        if (ui->gcodeCodeEditor->document()->isModified())
+            parseGcode();
+        simplifyGcode();
+    }
+}
+
+void MainWindow::on_actionReorderToolpath_triggered()
+{
+    // The program is replaced : not while it streams
+    if (isStreaming()) return;
+
+    waitSourceLoaded();
+    if (ui->gcodeCodeEditor->document()->isModified())
+        parseGcode();
+
+    QMessageBox::StandardButton answer = QMessageBox::question(this, tr("Reorder tool path"),
+            tr("Reverse open paths and start closed ones at another point when it shortens rapid moves ?\n"
+               "Their cutting direction or plunge point changes."),
+            QMessageBox::Yes | QMessageBox::No | QMessageBox::Cancel, QMessageBox::No);
+    if (answer == QMessageBox::Cancel) return;
+
+    GCodeReorderer reorderer;
+    if (!reorderer.reorder(gcodeParser, answer == QMessageBox::Yes))
+    {
+        QMessageBox::information(this, tr("Reorder tool path"),
+                                 tr("No rapid move saved, %1 paths.").arg(reorderer.getIslands()));
+        return;
+    }
+
+    // New program in the editor, not saved
+    QByteArray program = reorderer.getProgram();
+    cancelSourceLoad();
+
+    editorLoading = true;
+    ui->gcodeCodeEditor->setPlainText( QString::fromUtf8(program) );
+    ui->gcodeCodeEditor->document()->setModified(false);
+    ui->gcodeCodeEditor->setWindowModified(true);
+    editorLoading = false;
+
+    gcodeSource.setData( program );
+    loadSource();
+
+    QMessageBox::information(this, tr("Reorder tool path"),
+                             tr("Rapid moves between paths : %1 mm instead of %2 mm.\n%3 paths, %4 reversed, %5 started elsewhere.")
+                             .arg(reorderer.getRapidDistanceAfter(), 0, 'f', 0)
+                             .arg(reorderer.getRapidDistanceBefore(), 0, 'f', 0)
+                             .arg(reorderer.getIslands()).arg(reorderer.getReversedIslands())
+                             .arg(reorderer.getRotatedIslands()));
+}
+
+void MainWindow::simplifyGcode()
+{
+    if (isStreaming()) return;
+
+    if (!ui->actionSimplifyToolpath->isChecked())
+    {
+        gcodeSimplifier.clear();
+        return;
+    }
+
+    gcodeSimplifier.simplify(gcodeParser, simplifyTolerance, ui->actionFitArcs->isChecked());
+    statusBar()->showMessage( tr("Simplified tool path : %1 lines and %2 bytes saved, %3 arcs")
+                              .arg(gcodeSimplifier.getDroppedLines()).arg(gcodeSimplifier.getSavedBytes())
+                              .arg(gcodeSimplifier.getFittedArcs()) );
+}
+
 
 void MainWindow::on_gCodeExecutionSlider_valueChanged(int value)
 {
-    int nbPoints = gcodeParser.getPoints().size();
+    // Slider moves by lines, tool path is drawn until the end of the line
+    int nbLines = gcodeParser.getSize();
     int max = ui->gCodeExecutionSlider->maximum();
-    ui->visualizer->setNbPoints(nbPoints * value / max);
+    int line = int(qint64(nbLines) * value / max);
+
+    ui->visualizer->setNbPoints( gcodeParser.firstPoint(line) );
+    if (line > 0) ui->gcodeCodeEditor->setCurrentLine(line);
 }
 
 void MainWindow::on_topViewToolButton_clicked()
@@ -1508,16 +2062,9 @@ void MainWindow::on_tabWidget_currentChanged(int index)
 {
     if (ui->tabWidget->currentIndex() == TabGCode)
     {
-        // Il faut mettre une methode parse dans l'objet MainWindow, pour
-        // gérer ce qui suit et mettre à jour les informations.
-        //YLG
         qDebug() << "MainWindow::on_tabWidget_currentChanged(" << index << ")";
         if (ui->gcodeCodeEditor->document()->isModified())
-        {
-            QString text = ui->gcodeCodeEditor->toPlainText();
-            gcodeParser.parse( text );
-            ui->gcodeCodeEditor->document()->setModified(false);
-        }
+            parseGcode();
     }
 
     if (index == TabToolPath)
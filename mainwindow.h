@@ -5,9 +5,16 @@
 #include <QTextEdit>
 #include <QKeyEvent>
 #include <QTimer>
+#include <QElapsedTimer>
 
 #include "portSerial.h"
 #include "gcode.h"
+#include "gcodeloader.h"
+#include "gcodeestimator.h"
+#include "runtimepredictor.h"
+#include "gcodesimplifier.h"
+#include "gcodereorderer.h"
+#include "gcodeprogramsource.h"
 #include "machine.h"
 //#include "gcodehighlighter.h"
 
@@ -43,11 +50,25 @@ public:
     bool saveConfiguration();
 
     bool gcodeSend(QString gcode);
-    void sendNextGCode();
+    int streamBufferSize();
+    void endGcode();
+    bool isStreaming();
+    void updateSourceLock();
 
     void resetMachine();
     void uncheckJogButtons();
 
+    void parseGcode();
+    void parseSource();
+    void loadSource();
+    void waitSourceLoaded();
+    void cancelSourceLoad();
+    void estimateGcode();
+    void updateRemainingTime();
+    void simplifyGcode();
+    static QString formatDuration(double seconds);
+    void updateGcodeInformations();
+
 public slots:
     bool newFile();
     //void openFile();
@@ -75,6 +96,11 @@ private slots:
     void onInfoUpdated();
     void onStatusUpdated();
     void onGcodeChanged();
+    void onEditorContentsChange(int position, int charsRemoved, int charsAdded);
+    void onEditorCursorMoved();
+    void onGcodePartsLoaded();
+    void onGcodeLoaded();
+    void onGcodeEstimated();
     void onPortsUpdate();
 
    // void onPortError(Port::PortError error);
@@ -83,7 +109,10 @@ private slots:
 
     void onMachineLog( QString line );
 
-    void onCommandExecuted();
+    void onStreamStateChanged(int state);
+    void onStreamProgress(int sentLine, int answeredLine);
+    void onStreamEnded();
+    void onStreamFailed(int sourceLine);
 
     // Automatically connected :
     void on_connectPushButton_clicked();
@@ -136,6 +165,7 @@ private slots:
     void on_coolantMistPushButton_clicked(bool checked);
 
     void on_actionConfig_triggered();
+    void on_actionRunFromLine_triggered();
 
     void on_resetToolButton_clicked();
     void on_cancelJogToolButton_clicked();
@@ -151,6 +181,10 @@ private slots:
     void on_zeroMachineToolButton_clicked();
 
     void on_actionAbout_triggered();
+    void on_actionCompactToolpath_toggled(bool checked);
+    void on_actionSimplifyToolpath_toggled(bool checked);
+    void on_actionFitArcs_toggled(bool checked);
+    void on_actionReorderToolpath_triggered();
     void on_jogIntervalSlider_valueChanged(int value);
 
     void on_gCodeExecutionSlider_valueChanged(int value);
@@ -174,13 +208,42 @@ private:
     QStringList devicesList;
     Machine *machine;
 
+    GCodeSource gcodeSource;
     GCode gcodeParser;
 
+    // Opened files are parsed in background, gcodeParser shows parts meanwhile
+    GCodeLoader gcodeLoader;
+    bool gcodeLoading;
+
+    // Run time of the parsed program, estimated in background
+    GCodeEstimator gcodeEstimator;
+    // Remaining time of the run, updated by status reports
+    RunTimePredictor runTimePredictor;
+    QElapsedTimer runTimer;
+
+    // Lines not sent, when the tool path is simplified
+    GCodeSimplifier gcodeSimplifier;
+    double simplifyTolerance;
+
+    // Lines streamed, numbered and minimized, read by the streamer thread during a run
+    GCodeProgramSource gcodeStream;
+
+    // Editor lines changed since last parse, in source lines.
+    // No change when first line is -1, all lines when removed lines is -1.
+    bool editorLoading;
+    int changedFirstLine, changedRemovedLines, changedAddedLines;
+
     //QStringList gcode;
+    // Lines sent, in source lines
     int gcodeIndex;
 
+    // Run from a line : commands restoring the modal state of the line, sent before it
+    int gcodeStartLine;
+    QList<QByteArray> gcodePreamble;
+    QByteArray gcodeMotion;
+
     double jogInterval;
-    bool stepCommand, doResetOnHold;
+    bool doResetOnHold;
     bool movingMachine, movingWorking;
 };
 
@@ -37,6 +37,7 @@ public:
 
     virtual bool setProperty(const char *prop, QVariant &val);
     virtual qint64 	write(const QByteArray &) = 0;
+    virtual qint64 	write(const char *data, qint64 size) = 0;
 
     virtual QString errorString() = 0;
 
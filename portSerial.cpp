@@ -5,7 +5,8 @@
 
 #define debugSerial 0
 
-PortSerial::PortSerial() : Port ()
+// Serial is a child : it goes with the port to the streamer thread
+PortSerial::PortSerial() : Port (), serial(this)
 {
     setSpeed();
     setDataBits();
@@ -185,6 +186,14 @@ qint64 PortSerial::write(const QByteArray &byteArray)
     return res;
 }
 
+qint64 PortSerial::write(const char *data, qint64 size)
+{
+    if (debugSerial) qDebug() << "SerialPort::write: Send " << QByteArray(data, int(size));
+    qint64 res = serial.write(data, size);
+    serial.flush();
+    return res;
+}
+
 QString PortSerial::errorString()
 {
     return serial.errorString();
@@ -50,6 +50,7 @@ public:
     virtual bool setProperty(const char *prop, QVariant &val);
     // prop IN ( 'speed', 'dataBits', 'flowControl', 'parity', 'stopBits' )
     virtual qint64 	write(const QByteArray &byteArray);
+    virtual qint64 	write(const char *data, qint64 size);
 
     virtual QString errorString();
 
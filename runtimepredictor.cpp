@@ -0,0 +1,104 @@
+#include "runtimepredictor.h"
+
+#include <QtGlobal>
+
+// Weight of the plan in the correction, seconds : the first lines can't say much
+#define CORRECTION_PRIOR 60.0
+#define CORRECTION_MIN 0.25
+#define CORRECTION_MAX 4.0
+
+// Smoothing of the measured lag, by report
+#define LAG_SMOOTHING 0.1
+
+RunTimePredictor::RunTimePredictor()
+{
+    clear();
+}
+
+void RunTimePredictor::setPlan(const QVector<float> &lineTimes, const QVector<float> &rapidLineTimes)
+{
+    int count = lineTimes.size();
+    feedSuffix.fill(0.0, count + 1);
+    rapidSuffix.fill(0.0, count + 1);
+
+    for (int line = count - 1; line >= 0; line--)
+    {
+        double rapid = (line < rapidLineTimes.size()) ? double(rapidLineTimes.at(line)) : 0.0;
+        rapidSuffix[line] = rapidSuffix.at(line + 1) + rapid;
+        feedSuffix[line] = feedSuffix.at(line + 1) + double(lineTimes.at(line)) - rapid;
+    }
+
+    // A run already started keeps its start line and progress
+}
+
+void RunTimePredictor::clear()
+{
+    feedSuffix.clear();
+    rapidSuffix.clear();
+    start(0, 0);
+}
+
+void RunTimePredictor::start(int line, qint64 time)
+{
+    currentLine = line;
+    lastTime = time;
+    elapsed = elapsedDone = 0;
+    plannedDone = 0;
+    lag = 0;
+    hasLag = false;
+    correction = 1.0;
+    remaining = -1;
+}
+
+double RunTimePredictor::planned(int first, int last, double feedScale, double rapidScale) const
+{
+    int end = feedSuffix.size() - 1;
+    first = qBound(0, first, end);
+    last = qBound(first, last, end);
+
+    return (feedSuffix.at(first) - feedSuffix.at(last)) * feedScale +
+           (rapidSuffix.at(first) - rapidSuffix.at(last)) * rapidScale;
+}
+
+void RunTimePredictor::update(qint64 time, int line, int sentLine, int bufferedLines, bool running,
+                              int feedOverride, int rapidOverride, double feed, double remainingDistance)
+{
+    if (isEmpty()) return;
+
+    if (running) elapsed += double(time - lastTime);
+    lastTime = time;
+
+    // Executing line, from the machine or from the lag behind the sender
+    if (line >= 0)
+    {
+        lag = hasLag ? lag + LAG_SMOOTHING * (double(sentLine - line) - lag) : double(sentLine - line);
+        hasLag = true;
+    }
+    else
+        line = sentLine - qRound(hasLag ? lag : double(bufferedLines));
+
+    double feedScale = 100.0 / ((feedOverride > 0) ? feedOverride : 100);
+    double rapidScale = 100.0 / ((rapidOverride > 0) ? rapidOverride : 100);
+
+    // Lines done since last report : learn how long they really took
+    if (line > currentLine)
+    {
+        plannedDone += planned(currentLine, line, feedScale, rapidScale);
+        elapsedDone = elapsed;
+        currentLine = line;
+
+        correction = qBound(CORRECTION_MIN,
+                            (elapsedDone / 1000.0 + CORRECTION_PRIOR) / (plannedDone + CORRECTION_PRIOR),
+                            CORRECTION_MAX);
+    }
+
+    // Executing line : its remaining distance at the actual feed, or what is left of its plan
+    double current;
+    if ((feed > 0) && (remainingDistance >= 0))
+        current = remainingDistance / (feed / 60.0);
+    else
+        current = qMax(0.0, planned(currentLine, currentLine + 1, feedScale, rapidScale) * correction -
+                            (elapsed - elapsedDone) / 1000.0);
+
+    remaining = current + planned(currentLine + 1, feedSuffix.size() - 1, feedScale, rapidScale) * correction;
+}
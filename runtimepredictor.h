@@ -0,0 +1,57 @@
+#ifndef RUNTIMEPREDICTOR_H
+#define RUNTIMEPREDICTOR_H
+
+#include <QVector>
+
+// Remaining time of a program being run.
+// The estimated times of the lines (at 100%) are summed once from the end,
+// then a status report costs the same whatever the size of the program :
+// the remaining plan after the executing line is scaled by the overrides and
+// by a correction learnt from the time really spent on the lines done, and
+// the executing line takes its remaining distance at the actual feed.
+
+class RunTimePredictor
+{
+public:
+    RunTimePredictor();
+
+    // Seconds of each line at 100%, with the part of rapid moves
+    void setPlan(const QVector<float> &lineTimes, const QVector<float> &rapidLineTimes);
+    void clear();
+    bool isEmpty() const { return feedSuffix.size() < 2; }
+
+    // Run starts at line, time in ms
+    void start(int line, qint64 time);
+
+    // One status report :
+    // line, executing line, -1 when the machine does not give it : it is then
+    // sentLine (next line to send) less the lag measured before, or the lines
+    // buffered by the machine (bufferedLines).
+    // running is false during a hold, its time is not learnt.
+    // Overrides are in percent, 0 when unknown. feed (mm/min) and remainingDistance
+    // (mm to the end of the executing line) are negative when unknown.
+    void update(qint64 time, int line, int sentLine, int bufferedLines, bool running,
+                int feedOverride, int rapidOverride, double feed, double remainingDistance);
+
+    // Seconds, negative before the first report
+    double getRemainingTime() const { return remaining; }
+    int getLine() const { return currentLine; }
+
+private:
+    double planned(int first, int last, double feedScale, double rapidScale) const;
+
+    // Times from each line to the end, size is lines + 1
+    QVector<double> feedSuffix, rapidSuffix;
+
+    int currentLine;
+    qint64 lastTime;
+    double elapsed;         // Running time, ms
+    double elapsedDone;     // Running time when the current line started, ms
+    double plannedDone;     // Planned time of the lines done, with overrides, s
+    double lag;             // Lines sent but not executed, when the machine gives its line
+    bool hasLag;
+    double correction;
+    double remaining;
+};
+
+#endif // RUNTIMEPREDICTOR_H
@@ -0,0 +1,192 @@
+#include "toolpathbuffer.h"
+
+#include <cstring>
+#include <cmath>
+#include <algorithm>
+
+// Arc segments computed together, from one exact rotation
+#define ARC_LANES 16
+
+// Finest arc tolerance, as Grbl default $12 (mm)
+#define ARC_TOLERANCE 0.002
+
+int ToolpathArc::segments(double tolerance) const
+{
+    double travel = fabs(double(endAngle) - double(startAngle));
+    tolerance = qMax(tolerance, ARC_TOLERANCE);
+
+    // At least four segments by turn, even when the arc is smaller than the tolerance
+    int segments = int(ceil(travel / (0.5 * M_PI)));
+
+    // As Grbl : chord length for a sagitta of tolerance
+    if (tolerance < double(radius))
+        segments = qMax(segments, int(floor(0.5 * travel * double(radius) /
+                                            sqrt(tolerance * (2.0 * double(radius) - tolerance)))));
+    return segments;
+}
+
+void ToolpathArc::tessellate(int segments, float startZ, QVector<QVector3D> &points) const
+{
+    if (segments < 2) return;
+
+    double theta_per_segment = (double(endAngle) - double(startAngle)) / segments;
+    double linear_per_segment = double(pitch) * theta_per_segment;
+    double r_axis0 = double(radius) * cos(double(startAngle));
+    double r_axis1 = double(radius) * sin(double(startAngle));
+
+    int first = points.size();
+    points.resize(first + segments - 1);
+    QVector3D *out = points.data() + first - 1;
+
+    /* Segments are computed by blocks of ARC_LANES. The radius vector is rotated to the start of
+       each block with an exact cos/sin, then each lane applies its own rotation (j * theta).
+       Nothing accumulates from one block to the next, and lanes don't depend on each other.
+       Short arcs only use their first lanes. */
+    double lane_cos[ARC_LANES], lane_sin[ARC_LANES];
+    int used_lanes = qMin(int(ARC_LANES), segments);
+    for (int j = 0; j < used_lanes; j++) {
+        lane_cos[j] = cos(j * theta_per_segment);
+        lane_sin[j] = sin(j * theta_per_segment);
+    }
+
+    for (int i = 1; i < segments; i += ARC_LANES) {
+        double cos_Ti = cos(i * theta_per_segment);
+        double sin_Ti = sin(i * theta_per_segment);
+        double rb_axis0 = r_axis0 * cos_Ti - r_axis1 * sin_Ti;
+        double rb_axis1 = r_axis0 * sin_Ti + r_axis1 * cos_Ti;
+
+        int lanes = qMin(int(ARC_LANES), segments - i);
+        for (int j = 0; j < lanes; j++) {
+            out[i + j] = QVector3D(float(double(centerX) + rb_axis0 * lane_cos[j] - rb_axis1 * lane_sin[j]),
+                                   float(double(centerY) + rb_axis0 * lane_sin[j] + rb_axis1 * lane_cos[j]),
+                                   float(double(startZ) + (i + j) * linear_per_segment));
+        }
+    }
+}
+
+void ToolpathBuffer::clear()
+{
+    arcArray.clear();
+    xArray.clear();
+    yArray.clear();
+    zArray.clear();
+    motionArray.clear();
+    lineArray.clear();
+}
+
+void ToolpathBuffer::reserve(int size)
+{
+    xArray.reserve(size);
+    yArray.reserve(size);
+    zArray.reserve(size);
+    motionArray.reserve(size);
+    lineArray.reserve(size);
+}
+
+void ToolpathBuffer::squeeze()
+{
+    arcArray.squeeze();
+    xArray.squeeze();
+    yArray.squeeze();
+    zArray.squeeze();
+    motionArray.squeeze();
+    lineArray.squeeze();
+}
+
+void ToolpathBuffer::resize(int size)
+{
+    xArray.resize(size);
+    yArray.resize(size);
+    zArray.resize(size);
+    motionArray.resize(size);
+    lineArray.resize(size);
+}
+
+void ToolpathBuffer::appendArc(const QVector3D &coords, int motion, int line, ToolpathArc arc)
+{
+    arc.point = size();
+    arcArray.append(arc);
+    append(coords, motion, line);
+}
+
+void ToolpathBuffer::append(const ToolpathBuffer &other)
+{
+    int offset = size();
+    int firstArc = arcArray.size();
+    arcArray += other.arcArray;
+    for (int i = firstArc; i < arcArray.size(); i++)
+        arcArray[i].point += offset;
+
+    xArray += other.xArray;
+    yArray += other.yArray;
+    zArray += other.zArray;
+    motionArray += other.motionArray;
+    lineArray += other.lineArray;
+}
+
+template <typename T>
+static void replaceValues(QVector<T> &values, int first, int count, const QVector<T> &other)
+{
+    int size = values.size();
+    int newSize = size - count + other.size();
+
+    if (newSize > size) values.resize(newSize);
+
+    T *data = values.data();
+    memmove(data + first + other.size(), data + first + count, size_t(size - first - count) * sizeof(T));
+    memcpy(data + first, other.constData(), size_t(other.size()) * sizeof(T));
+
+    if (newSize < size) values.resize(newSize);
+}
+
+void ToolpathBuffer::replace(int first, int count, const ToolpathBuffer &other)
+{
+    replaceValues(xArray, first, count, other.xArray);
+    replaceValues(yArray, first, count, other.yArray);
+    replaceValues(zArray, first, count, other.zArray);
+    replaceValues(motionArray, first, count, other.motionArray);
+    replaceValues(lineArray, first, count, other.lineArray);
+
+    // Arcs of the replaced points are replaced, next ones follow their points
+    int firstArc = arcIndex(first);
+    int endArc = arcIndex(first + count);
+    replaceValues(arcArray, firstArc, endArc - firstArc, other.arcArray);
+
+    ToolpathArc *arcs = arcArray.data();
+    for (int i = firstArc; i < firstArc + other.arcArray.size(); i++)
+        arcs[i].point += first;
+    for (int i = firstArc + other.arcArray.size(); i < arcArray.size(); i++)
+        arcs[i].point += other.size() - count;
+}
+
+ToolpathBuffer ToolpathBuffer::mid(int first, int count) const
+{
+    ToolpathBuffer part;
+    part.xArray = xArray.mid(first, count);
+    part.yArray = yArray.mid(first, count);
+    part.zArray = zArray.mid(first, count);
+    part.motionArray = motionArray.mid(first, count);
+    part.lineArray = lineArray.mid(first, count);
+
+    int firstArc = arcIndex(first);
+    part.arcArray = arcArray.mid(firstArc, arcIndex(first + count) - firstArc);
+    for (ToolpathArc &arc : part.arcArray)
+        arc.point -= first;
+    return part;
+}
+
+int ToolpathBuffer::arcIndex(int point) const
+{
+    return int(std::lower_bound(arcArray.constBegin(), arcArray.constEnd(), point,
+                                [](const ToolpathArc &arc, int point) { return arc.point < point; })
+               - arcArray.constBegin());
+}
+
+void ToolpathBuffer::shiftLines(int first, int delta)
+{
+    if (!delta) return;
+
+    qint32 *lines = lineArray.data();
+    for (int i = first; i < lineArray.size(); i++)
+        lines[i] += delta;
+}
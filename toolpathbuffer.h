@@ -0,0 +1,120 @@
+#ifndef TOOLPATHBUFFER_H
+#define TOOLPATHBUFFER_H
+
+#include <QVector>
+#include <QVector3D>
+
+// Read only view on contiguous values
+template <typename T>
+struct Span
+{
+    const T *data;
+    int count;
+
+    Span(const T *data = nullptr, int count = 0) : data(data), count(count) {}
+
+    int size() const { return count; }
+    bool isEmpty() const { return !count; }
+    const T &operator[](int i) const { return data[i]; }
+    const T *begin() const { return data; }
+    const T *end() const { return data + count; }
+};
+
+// Arc (G2, G3) ending at a point of a tool path, from the previous point.
+// Angles are around the center in the XY plane, endAngle - startAngle is the
+// signed travel. Z moves by pitch per radian (helix).
+
+struct ToolpathArc
+{
+    qint32 point;
+    float centerX, centerY;
+    float radius;
+    float startAngle, endAngle;
+    float pitch;
+
+    // Segments for a chord error below tolerance (mm), never finer than the machine does
+    int segments(double tolerance) const;
+
+    // Appends the segments-1 points between start and end of the arc
+    void tessellate(int segments, float startZ, QVector<QVector3D> &points) const;
+};
+
+// Feed (F, program units per minute) of the points of a tool path from point
+// to the next feed change. Feed changes are rare, they are kept aside in point order.
+
+struct ToolpathFeed
+{
+    qint32 point;
+    float feed;
+};
+
+// Points of a tool path, stored as a structure of arrays : one contiguous
+// array per coordinate, one for motions and one for source lines.
+// A point costs 17 bytes, and loops over one coordinate only touch its array.
+// Arcs are one point, their geometry is kept aside in point order.
+
+class ToolpathBuffer
+{
+public:
+    void clear();
+    void reserve(int size);
+    void squeeze();
+    void resize(int size);
+
+    int size() const { return lineArray.size(); }
+    bool isEmpty() const { return lineArray.isEmpty(); }
+
+    inline void append(const QVector3D &coords, int motion, int line);
+    void appendArc(const QVector3D &coords, int motion, int line, ToolpathArc arc);
+    void append(const ToolpathBuffer &other);
+
+    // Replace count points from first by the points of other
+    void replace(int first, int count, const ToolpathBuffer &other);
+    // Copy of count points from first, with their arcs
+    ToolpathBuffer mid(int first, int count) const;
+    // Add delta to the line of points from first to the end
+    void shiftLines(int first, int delta);
+
+    // First arc at or after point
+    int arcIndex(int point) const;
+
+    QVector3D coords(int i) const { return QVector3D(xArray.at(i), yArray.at(i), zArray.at(i)); }
+    int motion(int i) const { return motionArray.at(i); }
+    int line(int i) const { return lineArray.at(i); }
+
+    // Axis 0, 1, 2 are X, Y, Z
+    Span<float> axis(int axis) const { const QVector<float> &a = axisArray(axis); return Span<float>(a.constData(), a.size()); }
+    Span<float> x() const { return axis(0); }
+    Span<float> y() const { return axis(1); }
+    Span<float> z() const { return axis(2); }
+    Span<quint8> motions() const { return Span<quint8>(motionArray.constData(), motionArray.size()); }
+    Span<qint32> lines() const { return Span<qint32>(lineArray.constData(), lineArray.size()); }
+    Span<ToolpathArc> arcs() const { return Span<ToolpathArc>(arcArray.constData(), arcArray.size()); }
+
+    // Write access, used by the parser to fix points up
+    float *axisData(int axis) { return axisArray(axis).data(); }
+    quint8 *motionData() { return motionArray.data(); }
+    qint32 *lineData() { return lineArray.data(); }
+    ToolpathArc *arcData() { return arcArray.data(); }
+    void resizeArcs(int size) { arcArray.resize(size); }
+
+private:
+    const QVector<float> &axisArray(int axis) const { return axis == 0 ? xArray : (axis == 1 ? yArray : zArray); }
+    QVector<float> &axisArray(int axis) { return axis == 0 ? xArray : (axis == 1 ? yArray : zArray); }
+
+    QVector<float> xArray, yArray, zArray;
+    QVector<quint8> motionArray;
+    QVector<qint32> lineArray;
+    QVector<ToolpathArc> arcArray;
+};
+
+inline void ToolpathBuffer::append(const QVector3D &coords, int motion, int line)
+{
+    xArray.append(coords.x());
+    yArray.append(coords.y());
+    zArray.append(coords.z());
+    motionArray.append(quint8(motion));
+    lineArray.append(qint32(line));
+}
+
+#endif // TOOLPATHBUFFER_H
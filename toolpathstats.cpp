@@ -0,0 +1,286 @@
+#include "toolpathstats.h"
+
+#include <cmath>
+#include <algorithm>
+#include "gcode.h"
+
+// Reductions are computed in lanes : independent accumulators kept in one
+// vector register, without a branch per point
+#define STATS_LANES 8
+
+// Cut heights closer than this are one level (program units)
+#define Z_LEVEL_RESOLUTION 0.01
+
+ToolpathStats::ToolpathStats()
+{
+    clear();
+}
+
+void ToolpathStats::clear()
+{
+    minPoint = maxPoint = {0, 0, 0};
+    lastPoint = {0, 0, 0};
+    pointCount = 0;
+
+    for (int motion = 0; motion < MotionTypes; motion++)
+    {
+        lengths[motion] = 0;
+        moves[motion] = 0;
+    }
+
+    zLevels.clear();
+    feedBins.clear();
+}
+
+// Lowest and highest of values
+static void reduceRange(const float *values, int size, float &low, float &high)
+{
+    float lowLanes[STATS_LANES], highLanes[STATS_LANES];
+    for (int j = 0; j < STATS_LANES; j++)
+        lowLanes[j] = highLanes[j] = values[0];
+
+    int i = 0;
+    for (; i + STATS_LANES <= size; i += STATS_LANES)
+        for (int j = 0; j < STATS_LANES; j++)
+        {
+            float value = values[i + j];
+            lowLanes[j] = (value < lowLanes[j]) ? value : lowLanes[j];
+            highLanes[j] = (value > highLanes[j]) ? value : highLanes[j];
+        }
+
+    for (; i < size; i++)
+    {
+        lowLanes[0] = qMin(lowLanes[0], values[i]);
+        highLanes[0] = qMax(highLanes[0], values[i]);
+    }
+
+    low = lowLanes[0];
+    high = highLanes[0];
+    for (int j = 1; j < STATS_LANES; j++)
+    {
+        low = qMin(low, lowLanes[j]);
+        high = qMax(high, highLanes[j]);
+    }
+}
+
+// Length of the move to each point, from the previous one
+static void segmentLengths(const float *x, const float *y, const float *z, int size,
+                           const QVector3D &start, float *lengths)
+{
+    lengths[0] = (QVector3D(x[0], y[0], z[0]) - start).length();
+
+    for (int i = 1; i < size; i++)
+    {
+        float dx = x[i] - x[i - 1];
+        float dy = y[i] - y[i - 1];
+        float dz = z[i] - z[i - 1];
+        lengths[i] = std::sqrt(dx * dx + dy * dy + dz * dz);
+    }
+}
+
+template <typename Key>
+static void addToBin(QMap<Key, ToolpathStats::Bin> &bins, Key key, float value, double length, int moves)
+{
+    if (!moves) return;
+
+    typename QMap<Key, ToolpathStats::Bin>::iterator bin = bins.find(key);
+    if (bin == bins.end())
+    {
+        ToolpathStats::Bin added;
+        added.value = value;
+        added.length = 0;
+        added.moves = 0;
+        bin = bins.insert(key, added);
+    }
+    bin->length += length;
+    bin->moves += moves;
+
+    // Removed : no move left at this height or feed
+    if (bin->moves <= 0) bins.erase(bin);
+}
+
+void ToolpathStats::add(const ToolpathBuffer &points, int firstPoint, const QVector<ToolpathFeed> &feeds)
+{
+    int size = points.size();
+    if (!size) return;
+
+    QVector3D low, high;
+    bounds(points, low, high);
+
+    for (int axis = 0; axis < 3; axis++)
+    {
+        minPoint[axis] = pointCount ? qMin(minPoint[axis], low[axis]) : low[axis];
+        maxPoint[axis] = pointCount ? qMax(maxPoint[axis], high[axis]) : high[axis];
+    }
+
+    accumulate(points, firstPoint, feeds, lastPoint, 1);
+
+    lastPoint = points.coords(size - 1);
+    pointCount += size;
+}
+
+bool ToolpathStats::replace(int firstPoint, const ToolpathBuffer &removed, const QVector<ToolpathFeed> &removedFeeds,
+                            const ToolpathBuffer &added, const QVector<ToolpathFeed> &addedFeeds, const QVector3D &start)
+{
+    QVector3D removedLow, removedHigh, addedLow, addedHigh;
+    if (!removed.isEmpty()) bounds(removed, removedLow, removedHigh);
+    if (!added.isEmpty()) bounds(added, addedLow, addedHigh);
+
+    // Points removed on the box, and not reached again : the box left is only known from all points
+    for (int axis = 0; axis < 3; axis++)
+    {
+        if (removed.isEmpty()) break;
+        bool lowKept = !added.isEmpty() && (addedLow[axis] <= removedLow[axis]);
+        bool highKept = !added.isEmpty() && (addedHigh[axis] >= removedHigh[axis]);
+        if (((removedLow[axis] <= minPoint[axis]) && !lowKept) ||
+            ((removedHigh[axis] >= maxPoint[axis]) && !highKept)) return false;
+    }
+
+    for (int axis = 0; axis < 3; axis++)
+    {
+        if (added.isEmpty()) break;
+        minPoint[axis] = qMin(minPoint[axis], addedLow[axis]);
+        maxPoint[axis] = qMax(maxPoint[axis], addedHigh[axis]);
+    }
+
+    bool atEnd = (firstPoint + removed.size() == pointCount);
+
+    accumulate(removed, firstPoint, removedFeeds, start, -1);
+    accumulate(added, firstPoint, addedFeeds, start, 1);
+
+    if (atEnd)
+        lastPoint = added.isEmpty() ? start : added.coords(added.size() - 1);
+    pointCount += added.size() - removed.size();
+    return true;
+}
+
+void ToolpathStats::bounds(const ToolpathBuffer &points, QVector3D &low, QVector3D &high)
+{
+    const float *axes[3] = { points.x().data, points.y().data, points.z().data };
+    for (int axis = 0; axis < 3; axis++)
+        reduceRange(axes[axis], points.size(), low[axis], high[axis]);
+
+    // Quarter turns crossed by arcs : they reach the circle extremes there
+    for (const ToolpathArc &arc : points.arcs())
+    {
+        if ((arc.point < 0) || (arc.point >= points.size())) continue;
+
+        double radius = double(arc.radius);
+        double from = qMin(double(arc.startAngle), double(arc.endAngle));
+        double to = qMax(double(arc.startAngle), double(arc.endAngle));
+        for (int quarter = int(ceil(from / M_PI_2)); quarter * M_PI_2 <= to; quarter++)
+        {
+            switch (((quarter % 4) + 4) % 4)
+            {
+            case 0: high[0] = qMax(high[0], float(double(arc.centerX) + radius)); break;
+            case 1: high[1] = qMax(high[1], float(double(arc.centerY) + radius)); break;
+            case 2: low[0] = qMin(low[0], float(double(arc.centerX) - radius)); break;
+            case 3: low[1] = qMin(low[1], float(double(arc.centerY) - radius)); break;
+            }
+        }
+    }
+}
+
+void ToolpathStats::accumulate(const ToolpathBuffer &points, int firstPoint, const QVector<ToolpathFeed> &feeds,
+                               const QVector3D &start, int sign)
+{
+    int size = points.size();
+    if (!size) return;
+
+    const float *axes[3] = { points.x().data, points.y().data, points.z().data };
+
+    segments.resize(size);
+    float *segment = segments.data();
+    segmentLengths(axes[0], axes[1], axes[2], size, start, segment);
+
+    // Arcs are one point : their length instead of the chord
+    for (const ToolpathArc &arc : points.arcs())
+    {
+        if ((arc.point < 0) || (arc.point >= size)) continue;
+
+        double travel = double(arc.endAngle) - double(arc.startAngle);
+        double turn = travel * double(arc.radius);
+        double rise = travel * double(arc.pitch);
+        segment[arc.point] = float(sqrt(turn * turn + rise * rise));
+    }
+
+    // Totals by motion, and cuts by height and feed. Cuts at one height
+    // and one feed come in runs : a bin is looked up once per run.
+    const quint8 *motions = points.motions().data;
+    const float *z = axes[2];
+    bool hasFeeds = !feeds.isEmpty();
+
+    int feed = int(std::upper_bound(feeds.constBegin(), feeds.constEnd(), firstPoint,
+                                    [](int point, const ToolpathFeed &run) { return point < run.point; })
+                   - feeds.constBegin()) - 1;
+
+    qint32 level = 0;
+    double levelLength = 0;
+    int levelMoves = 0;
+    int feedRun = feed;
+    double feedLength = 0;
+    int feedMoves = 0;
+
+    for (int i = 0; i < size; i++)
+    {
+        int motion = motions[i] & (MotionTypes - 1);
+        double length = sign * double(segment[i]);
+        lengths[motion] += length;
+        moves[motion] += sign;
+
+        if ((motion < GCode::MotionType::feedMove) || (motion > GCode::MotionType::counterClockwiseArcMove))
+            continue;
+
+        qint32 cutLevel = qint32(lround(double(z[i]) / Z_LEVEL_RESOLUTION));
+        if (cutLevel != level)
+        {
+            addToBin(zLevels, level, float(level * Z_LEVEL_RESOLUTION), levelLength, levelMoves);
+            level = cutLevel;
+            levelLength = 0;
+            levelMoves = 0;
+        }
+        levelLength += length;
+        levelMoves += sign;
+
+        if (!hasFeeds) continue;
+
+        while ((feed + 1 < feeds.size()) && (feeds.at(feed + 1).point <= firstPoint + i))
+            feed++;
+        if (feed != feedRun)
+        {
+            if (feedRun >= 0)
+                addToBin(feedBins, feeds.at(feedRun).feed, feeds.at(feedRun).feed, feedLength, feedMoves);
+            feedRun = feed;
+            feedLength = 0;
+            feedMoves = 0;
+        }
+        feedLength += length;
+        feedMoves += sign;
+    }
+
+    addToBin(zLevels, level, float(level * Z_LEVEL_RESOLUTION), levelLength, levelMoves);
+    if (feedRun >= 0)
+        addToBin(feedBins, feeds.at(feedRun).feed, feeds.at(feedRun).feed, feedLength, feedMoves);
+}
+
+double ToolpathStats::getCutLength() const
+{
+    return lengths[GCode::MotionType::feedMove] +
+           lengths[GCode::MotionType::clockwiseArcMove] +
+           lengths[GCode::MotionType::counterClockwiseArcMove];
+}
+
+double ToolpathStats::getRapidLength() const
+{
+    return lengths[GCode::MotionType::rapidMove];
+}
+
+QVector<ToolpathStats::Bin> ToolpathStats::getZLevels() const
+{
+    return zLevels.values().toVector();
+}
+
+QVector<ToolpathStats::Bin> ToolpathStats::getFeeds() const
+{
+    return feedBins.values().toVector();
+}
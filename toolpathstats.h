@@ -0,0 +1,86 @@
+#ifndef TOOLPATHSTATS_H
+#define TOOLPATHSTATS_H
+
+#include <QMap>
+#include <QVector>
+#include <QVector3D>
+#include "toolpathbuffer.h"
+
+// Bounding box and statistics of a tool path, from one pass over its arrays.
+// Parts are added in point order, the first point of a part moves from the
+// last point of the previous one. Arcs count for their length, and their
+// bulge is in the box. Lengths are in program units, like the points.
+
+class ToolpathStats
+{
+public:
+    // Motion fits in 3 bits
+    enum { MotionTypes = 8 };
+
+    // Cut length and moves at one height or feed
+    struct Bin
+    {
+        float value;
+        double length;
+        int moves;
+    };
+
+    ToolpathStats();
+
+    void clear();
+
+    // Next points of the tool path. Their first point is firstPoint in the whole tool path,
+    // where feeds are given, arcs are indexed in points. Without feeds, the feed
+    // distribution is not updated.
+    void add(const ToolpathBuffer &points, int firstPoint, const QVector<ToolpathFeed> &feeds);
+    // Points from firstPoint replaced, with the feeds before and after. Both ranges end
+    // with the point following them, if any, its move from them changes. Returns false
+    // when removed points were on the box and added ones don't reach it : the stats
+    // must be computed again.
+    bool replace(int firstPoint, const ToolpathBuffer &removed, const QVector<ToolpathFeed> &removedFeeds,
+                 const ToolpathBuffer &added, const QVector<ToolpathFeed> &addedFeeds, const QVector3D &start);
+
+    bool isEmpty() const { return !pointCount; }
+    int getPointCount() const { return pointCount; }
+
+    QVector3D getMin() const { return minPoint; }
+    QVector3D getMax() const { return maxPoint; }
+    QVector3D getSize() const { return maxPoint - minPoint; }
+
+    // By GCode::MotionType
+    double getLength(int motion) const { return lengths[motion]; }
+    int getMoves(int motion) const { return moves[motion]; }
+
+    // Feed moves and arcs, rapid moves
+    double getCutLength() const;
+    double getRapidLength() const;
+
+    // Cut length by height of the cut (Z rounded to Z_LEVEL_RESOLUTION), from the lowest
+    QVector<Bin> getZLevels() const;
+    // Cut length by feed, from the slowest
+    QVector<Bin> getFeeds() const;
+
+private:
+    friend class GCodeCache;
+
+    // Box of points, arc bulges included
+    static void bounds(const ToolpathBuffer &points, QVector3D &low, QVector3D &high);
+    // Lengths, moves and bins of points added (sign 1) or removed (sign -1), the first one moving from start
+    void accumulate(const ToolpathBuffer &points, int firstPoint, const QVector<ToolpathFeed> &feeds,
+                    const QVector3D &start, int sign);
+
+    QVector3D minPoint, maxPoint;
+    int pointCount;
+    QVector3D lastPoint;
+
+    double lengths[MotionTypes];
+    int moves[MotionTypes];
+
+    QMap<qint32, Bin> zLevels;
+    QMap<float, Bin> feedBins;
+
+    // Segment lengths of the part added, kept to not allocate each time
+    QVector<float> segments;
+};
+
+#endif // TOOLPATHSTATS_H
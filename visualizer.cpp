@@ -2,6 +2,10 @@
 #include <QMouseEvent>
 #include <QMatrix4x4>
 #include <QPainter>
+#include <QtMath>
+
+// Vertical field of view (degrees)
+#define VISUALIZER_FOV 30.0f
 
 Visualizer::Visualizer(QWidget *parent) :
     QOpenGLWidget(parent)
@@ -9,6 +13,7 @@ Visualizer::Visualizer(QWidget *parent) :
     resize(1000, 800);
     gcode = nullptr;
     nbPoints = 0;
+    selectionFirst = selectionLast = 0;
     time.start();
 }
 
@@ -51,7 +56,7 @@ void Visualizer::paintGL()
     // Projection matrix
     glMatrixMode(GL_PROJECTION);
     QMatrix4x4  projection;
-    projection.perspective(30.0f, 1.0f*width()/height(), 0.1f, 100.0f);
+    projection.perspective(VISUALIZER_FOV, 1.0f*width()/height(), 0.1f, 100.0f);
     glLoadMatrixf(projection.constData());
 
     paintBoard();
@@ -144,25 +149,53 @@ void Visualizer::paintGCode()
     if (gcode)
     {
         QVector3D lastPoint = {0,0,0};
-        QList<GCode::Point> points = gcode->getPoints();
+        QVector3D lastPosition = {0,0,0};
+        float minZ = gcode->getBoxMin().z();
 
         int lastMotion = -1;
+        bool lastSelected = false;
         float color = 0.9f;
 
-        glBegin(GL_LINES);
-            for( int i=0 ; i < nbPoints; i++)
-            {
-                QVector3D point = points.at(i).coords;
-                QVector3D minPoint = gcode->getBoxMin();
+        // Arcs are cut for a chord error of half a pixel at the current distance.
+        // A scene unit is 100 mm, a pixel is 2 * distance * tan(fov / 2) / height units.
+        double tolerance = 0.5 * 100.0 * 2.0 * double(distance) *
+                           tan(qDegreesToRadians(double(VISUALIZER_FOV) / 2.0)) / qMax(height(), 1);
+        QVector<QVector3D> arcPoints;
 
-                int motion = points.at(i).motion;
+        // Compact tool path is decoded one block at a time
+        ToolpathReader reader = gcode->getReader();
 
+        glBegin(GL_LINES);
+        while (reader.next() && (reader.firstPoint() < nbPoints))
+        {
+            const ToolpathBuffer &points = reader.points();
+            Span<float> x = points.x();
+            Span<float> y = points.y();
+            Span<float> z = points.z();
+            Span<quint8> motions = points.motions();
+            Span<ToolpathArc> arcs = points.arcs();
+            int arc = 0;
+            int count = qMin(points.size(), nbPoints - reader.firstPoint());
+
+            for( int i=0 ; i < count; i++)
+            {
                 // Convert X and Y from mm to cm, but keep Z bigger for visualization
-                point.setX( point.x() / 100.0f );
-                point.setY( point.y() / 100.0f );
-                point.setZ( (point.z() - minPoint.z()) / 10.0f );
+                QVector3D point( x[i] / 100.0f, y[i] / 100.0f, (z[i] - minZ) / 10.0f );
 
-                if (motion != lastMotion)
+                // Plunges and feed moves above Z0 are drawn as rapid moves
+                int motion = motions[i];
+                if ((motion == GCode::MotionType::feedMove) &&
+                    ((z[i] > 0) || ((x[i] == lastPosition.x()) && (y[i] == lastPosition.y()))))
+                    motion = GCode::MotionType::rapidMove;
+                int index = reader.firstPoint() + i;
+                bool selected = (index >= selectionFirst) && (index < selectionLast);
+
+                if (selected)
+                {
+                    // Selected lines are red, whatever the motion
+                    if (!lastSelected) glColor3f(1.0f, 0.0f, 0.0f);
+                }
+                else if ((motion != lastMotion) || lastSelected)
                 {
                     // Change color according to motion
                     switch(motion)
@@ -192,7 +225,23 @@ void Visualizer::paintGCode()
                         break;
 
                     default:
-                        qDebug() << "Visualizer::paintGL: Point " << i << " motion is unknown : " << motion;
+                        qDebug() << "Visualizer::paintGL: Point " << reader.firstPoint() + i << " motion is unknown : " << motion;
+                    }
+                }
+
+                if ((arc < arcs.size()) && (arcs[arc].point == i))
+                {
+                    // Segments of the arc, before the last one to the point
+                    const ToolpathArc &geometry = arcs[arc++];
+                    arcPoints.clear();
+                    geometry.tessellate(geometry.segments(tolerance), lastPosition.z(), arcPoints);
+
+                    for (const QVector3D &position : arcPoints)
+                    {
+                        QVector3D segment( position.x() / 100.0f, position.y() / 100.0f, (position.z() - minZ) / 10.0f );
+                        glVertex3f(lastPoint.x(), lastPoint.y(), lastPoint.z());
+                        glVertex3f(segment.x(), segment.y(), segment.z());
+                        lastPoint = segment;
                     }
                 }
 
@@ -201,8 +250,11 @@ void Visualizer::paintGCode()
 
                 //qDebug() << "Point " << point.x() << ", " << point.y();
                 lastPoint = point;
+                lastPosition = QVector3D(x[i], y[i], z[i]);
                 lastMotion = motion;
+                lastSelected = selected;
             }
+        }
         glEnd();
     }
 }
@@ -302,7 +354,7 @@ void Visualizer::setGCode(GCode *gcode)
 {
     this->gcode = gcode;
     // Here we must update the nbPoints var from the slider, but how ???
-    nbPoints = gcode->getPoints().size();
+    nbPoints = gcode->getPointCount();
     update();
 }
 
@@ -311,3 +363,12 @@ void Visualizer::setNbPoints(int nbPoints)
     this->nbPoints = nbPoints;
     update();
 }
+
+void Visualizer::setSelection(int first, int last)
+{
+    if ((first == selectionFirst) && (last == selectionLast)) return;
+
+    selectionFirst = first;
+    selectionLast = last;
+    update();
+}
@@ -15,6 +15,8 @@ public:
 
     void setGCode(GCode *gcode);
     void setNbPoints(int nbPoints);
+    // Points [first, last) are highlighted
+    void setSelection(int first, int last);
 
     void setRotation(QVector3D rot) { rotation = rot; update(); }
     void setPosition(QVector3D pos) { center = pos; update(); }
@@ -52,6 +54,7 @@ private:
 
     GCode *gcode;
     int nbPoints;
+    int selectionFirst, selectionLast;
 };
 
 #endif // VISUALIZER_H